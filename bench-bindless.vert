@@ -0,0 +1,27 @@
+#version 450
+#extension GL_ARB_separate_shader_objects : enable
+#extension GL_ARB_shading_language_420pack : enable
+#extension GL_EXT_nonuniform_qualifier : require
+
+layout (location = 0) in vec3 pos;
+
+layout (push_constant) uniform scene_block {
+    mat4 matrix;
+    uint size;
+    uint draw;
+} scene;
+
+// The buffers of vk_bindless_set, indexed with the draw pushed before each draw
+layout (std430, set = 0, binding = 1) readonly buffer draw_block {
+    vec4 tint;
+} draws[];
+
+layout (location = 0) out vec4 fragColor;
+
+void main() {
+    uint i = gl_InstanceIndex;
+    uvec3 cell = uvec3(i % scene.size, (i / scene.size) % scene.size, i / (scene.size * scene.size));
+
+    fragColor = vec4(vec3(cell) / float(scene.size), 1) * draws[scene.draw].tint;
+    gl_Position = scene.matrix * vec4(pos + vec3(cell) * 2, 1);
+}
@@ -0,0 +1,489 @@
+
+#include <errno.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <cmath>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <vulkan/vulkan.h>
+
+#define GLM_FORCE_RADIANS
+#define GLM_FORCE_DEPTH_ZERO_TO_ONE
+#define GLM_FORCE_LEFT_HANDED
+#include <glm/mat4x4.hpp>
+#include <glm/gtc/matrix_transform.hpp>
+#include <glm/gtc/type_ptr.hpp>
+
+#include "stringview.h"
+#include "format.h"
+#include "log.h"
+#include "trace.h"
+#include "vk.h"
+#include "vk_pipeline.h"
+#include "vk_render_graph.h"
+#include "vk_submit.h"
+#include "frame_stats.h"
+
+namespace {
+
+enum class camera_path {
+    orbit,
+    flythrough,
+};
+
+struct scene {
+    const char *name;
+    // The voxels fill a size^3 grid
+    uint32_t size;
+    // The voxels are split in this many draws, each with its own pipeline
+    uint32_t pipelines;
+    camera_path path;
+    // Too heavy for software rasterizers, only run when named on the command line
+    bool opt_in;
+};
+
+const scene scenes[] = {
+    { "voxels-10", 10, 1, camera_path::orbit, false },
+    { "voxels-100", 100, 1, camera_path::orbit, false },
+    { "voxels-1000", 1000, 1, camera_path::orbit, true },
+    { "flythrough-100", 100, 1, camera_path::flythrough, false },
+    { "pipelines-16", 100, 16, camera_path::orbit, false },
+    { "pipelines-256", 100, 256, camera_path::orbit, false },
+};
+
+struct options {
+    bool bindless = true;
+    uint32_t frames = 300;
+    uint32_t warmup = 10;
+    uint32_t width = 1280;
+    uint32_t height = 720;
+    std::string output = "vktest_bench.json";
+    std::string device;
+    std::vector<std::string> scenes;
+};
+
+struct result {
+    const scene *s;
+    frame_stats cpu;
+    frame_stats gpu;
+    frame_stats frame;
+};
+
+struct push_constants {
+    float matrix[16];
+    uint32_t size;
+    // Only with the bindless set
+    uint32_t draw;
+};
+
+// Every draw has its own data, a tint, at this stride in a storage buffer. It is
+// the largest minStorageBufferOffsetAlignment allowed, so it suits all devices.
+const uint64_t draw_stride = 256;
+
+uint32_t get_max_draws()
+{
+    uint32_t max = 0;
+    for (const scene &s: scenes) {
+        max = std::max(max, s.pipelines);
+    }
+    return max;
+}
+
+// The camera only depends on the frame number, so every run renders the same images
+glm::mat4 get_camera(const scene &s, uint32_t frame, uint32_t frames, float aspect)
+{
+    float t = float(frame) / frames;
+    float extent = 2.f * s.size;
+    glm::vec3 center = glm::vec3(s.size - 1.f);
+    glm::vec3 pos = center, target = center;
+
+    switch (s.path) {
+    case camera_path::orbit: {
+        float radius = extent * 1.2f + 2.f;
+        float angle = t * 2.f * glm::pi<float>();
+        pos = center + glm::vec3(radius * std::cos(angle), radius * 0.4f, radius * std::sin(angle));
+        break;
+    }
+    case camera_path::flythrough: {
+        auto start = center + glm::vec3(-extent, extent * 0.25f, -extent);
+        auto end = center + glm::vec3(extent, -extent * 0.25f, extent);
+        pos = start + (end - start) * t;
+        target = end;
+        break;
+    }
+    }
+
+    auto projection = glm::perspective<float>(glm::radians(60.f), aspect, 0.1f, extent * 4.f + 16.f);
+    auto view = glm::lookAt(pos, target, glm::vec3(0, 1, 0));
+    return projection * view;
+}
+
+double to_ms(uint64_t ns)
+{
+    return ns / 1.e6;
+}
+
+}
+
+// Renders into an offscreen image, no window system is needed. The per draw
+// data is either reached through a descriptor set bound for each draw, or
+// through the bindless set indexed with a push constant.
+class bench
+{
+public:
+    struct vertex { float p[3]; };
+
+    bench(const vk_device &device, uint32_t width, uint32_t height, bool bindless)
+        : m_device(device)
+        , m_queue(device.get_queue())
+        , m_batch(device, m_queue)
+        , m_cmd_pool(device)
+        , m_color(device, VK_FORMAT_B8G8R8A8_UNORM, vk_image::usage::color_attachment | vk_image::usage::transfer_src, vk_image::aspect::color,
+                  { width, height, 1u }, false)
+        , m_depth(device, VK_FORMAT_D24_UNORM_S8_UINT, vk_image::usage::depth_stencil_attachment, vk_image::aspect::depth, { width, height, 1u }, true)
+        , m_renderpass(device, m_color.get_image().get_format(), m_depth.get_image().get_format())
+        , m_framebuffer(device, m_color.get_image(), m_depth.get_view(), m_renderpass)
+        , m_vertices(device, 8)
+        , m_indices(device, vk_buffer::usage::index_buffer, 36 * sizeof(uint32_t), 0)
+        , m_memory(device, vk_device_memory::property::host_visible | vk_device_memory::property::host_coherent,
+                   get_indices_offset() + m_indices.get_required_memory_size(),
+                   m_vertices.get_required_memory_type() & m_indices.get_required_memory_type())
+        , m_draws(device, vk_buffer::usage::storage_buffer, get_max_draws() * draw_stride, 0)
+        , m_draws_memory(device, vk_device_memory::property::host_visible | vk_device_memory::property::host_coherent,
+                         m_draws.get_required_memory_size(), m_draws.get_required_memory_type())
+        , m_vertex_shader(device, vk_shader_module::stage::vertex, bindless ? "vert-bench-bindless.spv" : "vert-bench.spv")
+        , m_fragment_shader(device, vk_shader_module::stage::fragment, "frag.spv")
+        , m_descset_layout(device, { m_vertex_shader, m_fragment_shader })
+        , m_descpool(device, { { vk_descriptor::type::storage_buffer, get_max_draws() } })
+        , m_bindless(bindless ? std::make_unique<vk_bindless_set>(device, 0, get_max_draws()) : nullptr)
+        , m_pipeline_layout(device, { m_bindless ? &m_bindless->get_layout() : &m_descset_layout }, { m_vertex_shader, m_fragment_shader })
+        , m_queries(device, 2)
+        , m_graph(device)
+        , m_scene(nullptr)
+    {
+        m_vertices.bind_memory(&m_memory, 0);
+        m_vertices.map([](void *data) {
+            static const vertex vertices[] = {
+                { { -1.f, -1.f, -1.f } }, { { -1.f, 1.f, -1.f } }, { { 1.f, 1.f, -1.f } }, { { 1.f, -1.f, -1.f } },
+                { { -1.f, -1.f,  1.f } }, { { -1.f, 1.f,  1.f } }, { { 1.f, 1.f,  1.f } }, { { 1.f, -1.f,  1.f } },
+            };
+            memcpy(data, vertices, sizeof(vertices));
+        });
+
+        m_indices.bind_memory(&m_memory, get_indices_offset());
+        m_indices.map([](void *data) {
+            static const uint32_t indices[] = {
+                0, 1, 2, 0, 2, 3,
+                3, 2, 6, 3, 6, 7,
+                4, 0, 3, 4, 3, 7,
+                4, 5, 0, 0, 5, 1,
+                1, 5, 6, 1, 6, 2,
+                7, 6, 5, 7, 5, 4,
+            };
+            memcpy(data, indices, sizeof(indices));
+        });
+
+        init_draws();
+        init_graph();
+    }
+
+    bool is_bindless() const { return m_bindless != nullptr; }
+
+    void init_draws()
+    {
+        uint32_t count = get_max_draws();
+        m_draws.bind_memory(&m_draws_memory, 0);
+        m_draws.map([count](void *data) {
+            for (uint32_t i = 0; i < count; ++i) {
+                float t = float(i) / count;
+                const float tint[] = { 1.f, 1.f - t * 0.5f, 0.5f + t * 0.5f, 1.f };
+                memcpy(static_cast<char *>(data) + i * draw_stride, tint, sizeof(tint));
+            }
+        });
+
+        for (uint32_t i = 0; i < count; ++i) {
+            if (m_bindless) {
+                m_draw_ids.push_back(m_bindless->add_buffer(m_draws, i * draw_stride, 4 * sizeof(float)));
+                continue;
+            }
+
+            struct {
+                vk_descriptor::type type() const { return vk_descriptor::type::storage_buffer; }
+                const vk_buffer &buffer() const { return buf; }
+                uint64_t offset() const { return index * draw_stride; }
+                uint64_t size() const { return 4 * sizeof(float); }
+                const vk_buffer &buf;
+                uint32_t index;
+            } update_info = { m_draws, i };
+            m_descsets.push_back(m_descpool.allocate_descriptor_set(m_descset_layout));
+            m_descsets.back().update(update_info);
+        }
+    }
+
+    void init_graph()
+    {
+        using access = vk_render_graph::access;
+
+        auto color = m_graph.import_image(vk_image::aspect::color);
+        m_graph.set_image(color, m_color.get_image());
+        auto depth = m_graph.import_image(vk_image::aspect::depth | vk_image::aspect::stencil);
+        m_graph.set_image(depth, m_depth.get_image());
+        auto vertices = m_graph.import_buffer(m_vertices);
+        auto indices = m_graph.import_buffer(m_indices);
+
+        m_graph.add_pass("voxels", [this](const vk_command_buffer &cmd_buffer) {
+            VkClearValue color_clear, depth_clear;
+            color_clear.color = { .float32 = { 1.f, 1.f, 1.f, 1.f } };
+            depth_clear.depthStencil = { 1.f, 0 };
+
+            m_renderpass.set_clear_values({ color_clear, depth_clear });
+            vk_renderpass_record(m_renderpass, cmd_buffer, m_framebuffer) {
+                auto viewport = vk_viewport(0, 0, m_framebuffer.get_width(), m_framebuffer.get_height());
+                cmd_buffer.set_parameter(viewport);
+                vkCmdBindIndexBuffer(cmd_buffer.get_handle(), m_indices.get_handle(), 0, VK_INDEX_TYPE_UINT32);
+                uint32_t constants_size = m_bindless ? sizeof(m_constants) : offsetof(push_constants, draw);
+                vkCmdPushConstants(cmd_buffer.get_handle(), m_pipeline_layout.get_handle(), VK_SHADER_STAGE_VERTEX_BIT, 0, constants_size, &m_constants);
+                if (m_bindless) {
+                    m_bindless->bind(cmd_buffer, VK_PIPELINE_BIND_POINT_GRAPHICS, m_pipeline_layout);
+                }
+
+                uint32_t count = m_scene->size * m_scene->size * m_scene->size;
+                uint32_t first = 0;
+                for (size_t i = 0; i < m_pipelines.size(); ++i) {
+                    uint32_t instances = (count - first) / (m_pipelines.size() - i);
+                    cmd_buffer.set_parameter(*m_pipelines[i]);
+                    if (m_bindless) {
+                        vkCmdPushConstants(cmd_buffer.get_handle(), m_pipeline_layout.get_handle(), VK_SHADER_STAGE_VERTEX_BIT,
+                                           offsetof(push_constants, draw), sizeof(uint32_t), &m_draw_ids[i]);
+                    } else {
+                        VkDescriptorSet descset = m_descsets[i].get_handle();
+                        vkCmdBindDescriptorSets(cmd_buffer.get_handle(), VK_PIPELINE_BIND_POINT_GRAPHICS, m_pipeline_layout.get_handle(), 0, 1, &descset, 0, nullptr);
+                    }
+                    vkCmdDrawIndexed(cmd_buffer.get_handle(), 36, instances, 0, 0, first);
+                    first += instances;
+                }
+            }
+        }).read(vertices, access::vertex_buffer)
+          .read(indices, access::index_buffer)
+          .write(color, access::color_attachment)
+          .write(depth, access::depth_attachment);
+
+        m_graph.set_output(color, access::transfer_src);
+        m_graph.compile();
+        m_graph.set_timestamp_queries(&m_queries);
+    }
+
+    void run(const scene &s, uint32_t frames, uint32_t warmup, result &r)
+    {
+        m_scene = &s;
+        m_pipelines.clear();
+        for (uint32_t i = 0; i < s.pipelines; ++i) {
+            m_pipelines.push_back(std::make_unique<vk_graphics_pipeline>(m_device));
+            vk_graphics_pipeline &p = *m_pipelines.back();
+            p.add_stage(m_vertex_shader, "main");
+            p.add_stage(m_fragment_shader, "main");
+            p.add_binding(m_vertices, vk_graphics_pipeline::input_rate::vertex, { 0 });
+            p.set_primitive_mode(vk_graphics_pipeline::triangle_list, false);
+            p.create(m_renderpass, m_pipeline_layout);
+        }
+
+        float aspect = float(m_framebuffer.get_width()) / m_framebuffer.get_height();
+        for (uint32_t frame = 0; frame < warmup + frames; ++frame) {
+            TRACE_ZONE("frame");
+            uint64_t begin = trace::now();
+
+            auto matrix = get_camera(s, frame < warmup ? 0 : frame - warmup, frames, aspect);
+            memcpy(m_constants.matrix, glm::value_ptr(matrix), sizeof(m_constants.matrix));
+            m_constants.size = s.size;
+
+            // The previous frame was waited for
+            m_cmd_pool.reset();
+            auto cmd_buffer = m_cmd_pool.get_command_buffer();
+            cmd_buffer.begin();
+            m_graph.execute(cmd_buffer);
+            cmd_buffer.end();
+            m_batch.add(cmd_buffer);
+            m_batch.flush();
+            uint64_t submitted = trace::now();
+
+            vkQueueWaitIdle(m_queue.get_handle());
+            uint64_t end = trace::now();
+
+            if (frame < warmup) {
+                continue;
+            }
+            double gpu = 0;
+            for (const auto &t: m_graph.get_pass_timings()) {
+                gpu += t.ms;
+            }
+            r.cpu.add_frame(to_ms(submitted - begin));
+            r.gpu.add_frame(gpu);
+            r.frame.add_frame(to_ms(end - begin));
+        }
+        m_pipelines.clear();
+    }
+
+private:
+    uint64_t get_indices_offset() const
+    {
+        uint64_t alignment = m_indices.get_required_memory_alignment();
+        return (m_vertices.get_required_memory_size() + alignment - 1) / alignment * alignment;
+    }
+
+    const vk_device &m_device;
+    vk_queue m_queue;
+    vk_submit_batch m_batch;
+    vk_frame_command_pool m_cmd_pool;
+    vk_attachment m_color;
+    vk_attachment m_depth;
+    vk_renderpass m_renderpass;
+    vk_framebuffer m_framebuffer;
+    vk_vertex_buffer<vertex> m_vertices;
+    vk_buffer m_indices;
+    vk_device_memory m_memory;
+    vk_buffer m_draws;
+    vk_device_memory m_draws_memory;
+    vk_shader_module m_vertex_shader;
+    vk_shader_module m_fragment_shader;
+    vk_descriptor_set_layout m_descset_layout;
+    vk_descriptor_pool m_descpool;
+    std::vector<vk_descriptor_set> m_descsets;
+    std::unique_ptr<vk_bindless_set> m_bindless;
+    std::vector<uint32_t> m_draw_ids;
+    vk_pipeline_layout m_pipeline_layout;
+    vk_query_pool m_queries;
+    vk_render_graph m_graph;
+    const scene *m_scene;
+    push_constants m_constants;
+    std::vector<std::unique_ptr<vk_graphics_pipeline>> m_pipelines;
+};
+
+static void write_stats(FILE *f, const char *name, const frame_stats &stats)
+{
+    fmt::print(f, "      \"{}\": {{ \"mean\": {:.4f}, \"p50\": {:.4f}, \"p99\": {:.4f} }}", name,
+               stats.get_mean(), stats.get_percentile(0.5), stats.get_percentile(0.99));
+}
+
+static bool write_results(const std::string &path, stringview device, bool bindless, const options &opts, const std::vector<std::unique_ptr<result>> &results)
+{
+    FILE *f = fopen(path.c_str(), "w");
+    if (!f) {
+        log_error("Failed to open '{}': {}\n", path, strerror(errno));
+        return false;
+    }
+
+    fmt::print(f, "{{\n  \"device\": \"{}\",\n  \"bindless\": {},\n  \"width\": {},\n  \"height\": {},\n  \"frames\": {},\n  \"scenes\": [\n",
+               device, bindless ? "true" : "false", opts.width, opts.height, opts.frames);
+    for (size_t i = 0; i < results.size(); ++i) {
+        const result &r = *results[i];
+        uint64_t voxels = uint64_t(r.s->size) * r.s->size * r.s->size;
+        double seconds = r.frame.get_mean() / 1000.;
+
+        fmt::print(f, "    {{\n      \"name\": \"{}\",\n      \"voxels\": {},\n      \"pipelines\": {},\n", r.s->name, voxels, r.s->pipelines);
+        write_stats(f, "cpu_ms", r.cpu);
+        fmt::print(f, ",\n");
+        write_stats(f, "gpu_ms", r.gpu);
+        fmt::print(f, ",\n");
+        write_stats(f, "frame_ms", r.frame);
+        fmt::print(f, ",\n      \"voxels_per_second\": {:.0f},\n      \"triangles_per_second\": {:.0f}\n    }}{}\n",
+                   seconds > 0 ? voxels / seconds : 0., seconds > 0 ? voxels * 12 / seconds : 0., i + 1 < results.size() ? "," : "");
+    }
+    fmt::print(f, "  ]\n}}\n");
+    fclose(f);
+    return true;
+}
+
+static void print_usage(const char *name)
+{
+    fmt::print("Usage: {} [--frames N] [--warmup N] [--size WxH] [--output FILE] [--device DEVICE] [--no-bindless] [SCENE...]\n\nScenes:\n", name);
+    for (const scene &s: scenes) {
+        fmt::print("  {:16} {}^3 voxels, {} pipelines{}\n", s.name, s.size, s.pipelines, s.opt_in ? ", only run when named" : "");
+    }
+}
+
+static bool parse_options(int argc, char **argv, options &opts)
+{
+    for (int i = 1; i < argc; ++i) {
+        auto arg = stringview(argv[i]);
+        bool has_value = i + 1 < argc;
+        if (arg == "--frames" && has_value) {
+            opts.frames = strtoul(argv[++i], nullptr, 10);
+        } else if (arg == "--warmup" && has_value) {
+            opts.warmup = strtoul(argv[++i], nullptr, 10);
+        } else if (arg == "--size" && has_value) {
+            if (sscanf(argv[++i], "%ux%u", &opts.width, &opts.height) != 2) {
+                return false;
+            }
+        } else if (arg == "--output" && has_value) {
+            opts.output = argv[++i];
+        } else if (arg == "--device" && has_value) {
+            opts.device = argv[++i];
+        } else if (arg == "--no-bindless") {
+            opts.bindless = false;
+        } else if (argv[i][0] == '-') {
+            return false;
+        } else {
+            opts.scenes.push_back(arg.to_string());
+        }
+    }
+    return opts.frames > 0 && opts.width > 0 && opts.height > 0;
+}
+
+int main(int argc, char **argv)
+{
+    options opts;
+    if (!parse_options(argc, argv, opts)) {
+        print_usage(argv[0]);
+        return 1;
+    }
+    if (const char *file = getenv("VKTEST_LOG_FILE")) {
+        logger::get().set_file(file);
+    }
+    trace::set_thread_name("main");
+
+    auto instance = vk_instance({}, {});
+    auto selector = vk_device_selector(instance);
+    if (!opts.device.empty()) {
+        selector.set_override(opts.device);
+    } else if (const char *device = getenv("VKTEST_DEVICE")) {
+        selector.set_override(device);
+    }
+    const vk_physical_device &phys = selector.select();
+    auto device = phys.create_device<>(selector.find_queue_family(phys));
+    log_info("Running on {}\n", phys.get_device_name());
+
+    // Without the descriptor indexing features every draw binds its own descriptor set
+    bench b(device, opts.width, opts.height, opts.bindless && device.supports_bindless());
+    log_info("Per draw data {}\n", b.is_bindless() ? "indexed in the bindless set" : "in per draw descriptor sets");
+    auto results = std::vector<std::unique_ptr<result>>();
+    for (const scene &s: scenes) {
+        bool named = std::find(opts.scenes.begin(), opts.scenes.end(), s.name) != opts.scenes.end();
+        if (opts.scenes.empty() ? s.opt_in : !named) {
+            continue;
+        }
+
+        results.push_back(std::unique_ptr<result>(new result{ &s, frame_stats(opts.frames), frame_stats(opts.frames), frame_stats(opts.frames) }));
+        b.run(s, opts.frames, opts.warmup, *results.back());
+
+        const result &r = *results.back();
+        log_info("{}: frame {:.3f} ms, cpu {:.3f} ms, gpu {:.3f} ms\n", s.name, r.frame.get_mean(), r.cpu.get_mean(), r.gpu.get_mean());
+    }
+
+    if (results.empty()) {
+        print_usage(argv[0]);
+        return 1;
+    }
+    if (!write_results(opts.output, phys.get_device_name(), b.is_bindless(), opts, results)) {
+        return 1;
+    }
+#ifdef ENABLE_TRACING
+    trace::dump("vktest_bench-trace.json");
+#endif
+    return 0;
+}
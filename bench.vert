@@ -0,0 +1,27 @@
+#version 450
+#extension GL_ARB_separate_shader_objects : enable
+#extension GL_ARB_shading_language_420pack : enable
+
+layout (location = 0) in vec3 pos;
+
+layout (push_constant) uniform scene_block {
+    mat4 matrix;
+    uint size;
+} scene;
+
+// Bound per draw, see bench-bindless.vert for the bindless version
+layout (std430, set = 0, binding = 0) readonly buffer draw_block {
+    vec4 tint;
+} draw;
+
+layout (location = 0) out vec4 fragColor;
+
+// The voxels fill a size^3 grid, generated from the instance index so that
+// no instance data is needed however big the grid is.
+void main() {
+    uint i = gl_InstanceIndex;
+    uvec3 cell = uvec3(i % scene.size, (i / scene.size) % scene.size, i / (scene.size * scene.size));
+
+    fragColor = vec4(vec3(cell) / float(scene.size), 1) * draw.tint;
+    gl_Position = scene.matrix * vec4(pos + vec3(cell) * 2, 1);
+}
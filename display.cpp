@@ -14,6 +14,11 @@ vk_instance display::create_vk_instance(const std::vector<std::string> &extensio
     return m_platform_dpy.m_interface->create_vk_instance(extensions);
 }
 
+bool display::supports_present(const vk_physical_device &dev, uint32_t queue_family)
+{
+    return m_platform_dpy.m_interface->supports_present(dev, queue_family);
+}
+
 void display::run()
 {
     m_platform_dpy.m_interface->run();
@@ -24,6 +29,11 @@ void display::quit()
     m_platform_dpy.m_interface->quit();
 }
 
+event_loop &display::get_event_loop()
+{
+    return m_platform_dpy.m_interface->get_event_loop();
+}
+
 void display::register_platform(platform p, const platform_display_factory &factory)
 {
     s_factories[(int)p] = factory;
@@ -48,6 +58,12 @@ window::window(window &&w)
 {
 }
 
+void window::set_size(int width, int height)
+{
+    m_width = width;
+    m_height = height;
+}
+
 void window::show()
 {
     return m_platform_window.m_interface->show();
@@ -10,12 +10,14 @@
 #include <unordered_map>
 #include <vector>
 
+#include "input.h"
 #include "stringview.h"
 #include "vk.h"
 
 class display;
 class window;
 class platform_window;
+class event_loop;
 
 class vk_surface;
 class vk_instance;
@@ -90,6 +92,31 @@ private:
     friend class display;
 };
 
+// How a frame ended up on screen, as reported by the compositor. Times are
+// in nanoseconds, all in the clock the compositor uses for presentation.
+struct frame_presentation {
+    enum class kind {
+        vsync = 1,
+        hw_clock = 2,
+        hw_completion = 4,
+        zero_copy = 8,
+    };
+
+    // The frame was never shown, only swap_time and input_time are valid
+    bool discarded;
+    uint64_t presented;
+    // 0 if unknown
+    uint32_t refresh;
+    uint64_t sequence;
+    kind flags;
+    // When the frame was handed to the compositor
+    uint64_t swap_time;
+    // The first input event received since the previous frame, 0 if none
+    uint64_t input_time;
+};
+
+FLAGS(frame_presentation::kind)
+
 class window
 {
 public:
@@ -105,6 +132,11 @@ public:
         inline void mouse_motion(double x, double y) { m_interface->mouse_motion(x, y); }
         inline void mouse_button(bool pressed) { m_interface->mouse_button(pressed); }
         inline void key(uint32_t key, bool pressed) { m_interface->key(key, pressed); }
+        inline void input(const input_queue &events) { m_interface->input(events); }
+        inline void presented(const frame_presentation &p) { m_interface->presented(p); }
+        inline void resize(int width, int height) { m_interface->resize(width, height); }
+        // The user asked to close the window
+        inline void close() { m_interface->close(); }
 
     private:
         struct hnd_interface
@@ -114,6 +146,10 @@ public:
             virtual void mouse_motion(double x, double y) = 0;
             virtual void mouse_button(bool pressed) = 0;
             virtual void key(uint32_t key, bool pressed) = 0;
+            virtual void input(const input_queue &events) = 0;
+            virtual void presented(const frame_presentation &p) = 0;
+            virtual void resize(int width, int height) = 0;
+            virtual void close() = 0;
         };
         template<class T>
         struct hnd : hnd_interface
@@ -123,6 +159,10 @@ public:
             void mouse_motion(double x, double y) override { data.mouse_motion(x, y); }
             void mouse_button(bool pressed) override { data.mouse_button(pressed); }
             void key(uint32_t key, bool pressed) override { data.key(key, pressed); }
+            void input(const input_queue &events) override { data.input(events); }
+            void presented(const frame_presentation &p) override { data.presented(p); }
+            void resize(int width, int height) override { data.resize(width, height); }
+            void close() override { data.close(); }
 
             T &data;
         };
@@ -137,6 +177,8 @@ public:
 
     int get_width() const { return m_width; }
     int get_height() const { return m_height; }
+    // To be called by the handler when the platform asks it to resize
+    void set_size(int width, int height);
 
     void show();
     vk_surface create_vk_surface(const vk_instance &instance);
@@ -169,9 +211,11 @@ public:
             virtual ~dpy_interface() = default;
             virtual void init() = 0;
             virtual vk_instance create_vk_instance(const std::vector<std::string> &extensions) = 0;
+            virtual bool supports_present(const vk_physical_device &dev, uint32_t queue_family) = 0;
             virtual platform_window create_window(int width, int height, window::handler hnd) = 0;
             virtual void run() = 0;
             virtual void quit() = 0;
+            virtual event_loop &get_event_loop() = 0;
         };
 
         template<class T>
@@ -184,12 +228,17 @@ public:
             {
                 return data.create_vk_instance(extensions);
             }
+            bool supports_present(const vk_physical_device &dev, uint32_t queue_family) override
+            {
+                return data.supports_present(dev, queue_family);
+            }
             platform_window create_window(int width, int height, window::handler hnd) override
             {
                 return data.create_window(width, height, std::move(hnd));
             }
             void run() override { return data.run(); }
             void quit() override { return data.quit(); }
+            event_loop &get_event_loop() override { return data.get_event_loop(); }
 
             T data;
         };
@@ -205,10 +254,14 @@ public:
     display(platform p);
 
     vk_instance create_vk_instance(const std::vector<std::string> &extensions);
+    // Whether the queue family can present to the windows of this display
+    bool supports_present(const vk_physical_device &dev, uint32_t queue_family);
 
     void run();
     void quit();
 
+    event_loop &get_event_loop();
+
     static void register_platform(platform p, const platform_display_factory &factory);
 
 private:
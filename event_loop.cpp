@@ -35,13 +35,22 @@ event_loop::~event_loop()
 }
 
 void event_loop::loop_once()
+{
+    run_idles();
+    poll();
+}
+
+void event_loop::run_idles()
 {
     std::vector<idle_func> idles;
     idles.swap(m_idles);
     for (const auto &f: idles) {
         f();
     }
+}
 
+void event_loop::poll()
+{
     epoll_event events[32];
     int num_events = epoll_wait(m_fd, events, 32, m_idles.empty() ? -1 : 0);
 
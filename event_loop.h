@@ -29,6 +29,10 @@ public:
     ~event_loop();
 
     void loop_once();
+    // loop_once() is run_idles() followed by poll(). poll() waits for fd
+    // events, unless there are idles pending.
+    void run_idles();
+    void poll();
 
     void add_timer(int msecs, const timer_func &notify);
     fd_event *add_fd(int fd, type t, const notify_func &notify);
@@ -0,0 +1,64 @@
+
+#include <errno.h>
+#include <limits.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+
+#include "file_watcher.h"
+#include "display.h"
+#include "format.h"
+
+file_watcher::file_watcher(event_loop &loop, const notify_func &notify)
+            : m_loop(loop)
+            , m_fd(inotify_init1(IN_NONBLOCK | IN_CLOEXEC))
+            , m_notify(notify)
+{
+    if (m_fd < 0) {
+        throw platform_exception(fmt::format("Failed to create inotify fd: {}\n", strerror(errno)));
+    }
+    m_event = m_loop.add_fd(m_fd, event_loop::type::readable, [this](event_loop::type) { dispatch(); });
+}
+
+file_watcher::~file_watcher()
+{
+    m_loop.remove_fd(m_event);
+    close(m_fd);
+}
+
+void file_watcher::watch(stringview path)
+{
+    // Watch the directory rather than the file itself, since tools often replace
+    // files by renaming a new one over them, which would drop a watch on the file.
+    std::string file = path.to_string();
+    size_t slash = file.rfind('/');
+    std::string dir = slash == std::string::npos ? "." : file.substr(0, slash);
+    std::string name = slash == std::string::npos ? file : file.substr(slash + 1);
+
+    int wd = inotify_add_watch(m_fd, dir.data(), IN_CLOSE_WRITE | IN_MOVED_TO);
+    if (wd < 0) {
+        throw platform_exception(fmt::format("Failed to watch {}: {}\n", dir, strerror(errno)));
+    }
+    m_files.push_back({ wd, name, file });
+}
+
+void file_watcher::dispatch()
+{
+    alignas(inotify_event) char buffer[4096];
+    ssize_t len;
+    while ((len = read(m_fd, buffer, sizeof(buffer))) > 0) {
+        for (char *ptr = buffer; ptr < buffer + len;) {
+            const auto *event = reinterpret_cast<const inotify_event *>(ptr);
+            ptr += sizeof(inotify_event) + event->len;
+
+            if (!event->len) {
+                continue;
+            }
+            for (const watched_file &f: m_files) {
+                if (f.wd == event->wd && f.name == event->name) {
+                    m_notify(f.path);
+                }
+            }
+        }
+    }
+}
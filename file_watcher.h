@@ -0,0 +1,36 @@
+
+#pragma once
+
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "event_loop.h"
+#include "stringview.h"
+
+class file_watcher
+{
+public:
+    using notify_func = std::function<void (stringview path)>;
+
+    file_watcher(event_loop &loop, const notify_func &notify);
+    file_watcher(const file_watcher &) = delete;
+    ~file_watcher();
+
+    void watch(stringview path);
+
+private:
+    void dispatch();
+
+    struct watched_file {
+        int wd;
+        std::string name;
+        std::string path;
+    };
+
+    event_loop &m_loop;
+    int m_fd;
+    event_loop::fd_event *m_event;
+    notify_func m_notify;
+    std::vector<watched_file> m_files;
+};
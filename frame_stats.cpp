@@ -0,0 +1,54 @@
+
+#include <algorithm>
+
+#include "frame_stats.h"
+
+frame_stats::frame_stats(size_t history)
+           : m_frames(history)
+           , m_next(0)
+           , m_count(0)
+{
+}
+
+void frame_stats::add_frame(double ms)
+{
+    m_frames[m_next] = ms;
+    m_next = (m_next + 1) % m_frames.size();
+    m_count = std::min(m_count + 1, m_frames.size());
+}
+
+double frame_stats::get_frame(size_t index) const
+{
+    size_t first = m_count < m_frames.size() ? 0 : m_next;
+    return m_frames[(first + index) % m_frames.size()];
+}
+
+double frame_stats::get_last() const
+{
+    return m_count ? get_frame(m_count - 1) : 0;
+}
+
+double frame_stats::get_mean() const
+{
+    if (!m_count) {
+        return 0;
+    }
+
+    double sum = 0;
+    for (size_t i = 0; i < m_count; ++i) {
+        sum += m_frames[i];
+    }
+    return sum / m_count;
+}
+
+double frame_stats::get_percentile(double p) const
+{
+    if (!m_count) {
+        return 0;
+    }
+
+    auto sorted = std::vector<double>(m_frames.begin(), m_frames.begin() + m_count);
+    auto nth = sorted.begin() + std::min<size_t>(p * m_count, m_count - 1);
+    std::nth_element(sorted.begin(), nth, sorted.end());
+    return *nth;
+}
@@ -0,0 +1,28 @@
+
+#pragma once
+
+#include <stddef.h>
+
+#include <vector>
+
+class frame_stats
+{
+public:
+    explicit frame_stats(size_t history = 240);
+
+    void add_frame(double ms);
+
+    // The number of frames in the history, at most the history size
+    size_t get_count() const { return m_count; }
+    // index 0 is the oldest frame in the history
+    double get_frame(size_t index) const;
+    double get_last() const;
+    double get_mean() const;
+    // p in [0, 1]
+    double get_percentile(double p) const;
+
+private:
+    std::vector<double> m_frames;
+    size_t m_next;
+    size_t m_count;
+};
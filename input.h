@@ -0,0 +1,87 @@
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct input_event {
+    enum class type {
+        motion,
+        button,
+        key,
+    };
+
+    type t;
+    union {
+        struct {
+            double x, y;
+        } motion;
+        struct {
+            bool pressed;
+        } button;
+        struct {
+            uint32_t code;
+            bool pressed;
+        } key;
+    };
+};
+
+// The input events received since the last frame, in order. Consecutive motion
+// events are merged into the last one, as only the final position matters.
+class input_queue
+{
+public:
+    static const size_t capacity = 256;
+
+    input_queue() : m_count(0), m_dropped(0) {}
+
+    void push_motion(double x, double y)
+    {
+        if (m_count && m_events[m_count - 1].t == input_event::type::motion) {
+            m_events[m_count - 1].motion = { x, y };
+            return;
+        }
+        input_event e;
+        e.t = input_event::type::motion;
+        e.motion = { x, y };
+        push(e);
+    }
+    void push_button(bool pressed)
+    {
+        input_event e;
+        e.t = input_event::type::button;
+        e.button = { pressed };
+        push(e);
+    }
+    void push_key(uint32_t code, bool pressed)
+    {
+        input_event e;
+        e.t = input_event::type::key;
+        e.key = { code, pressed };
+        push(e);
+    }
+
+    void clear() { m_count = 0; }
+
+    bool empty() const { return m_count == 0; }
+    size_t size() const { return m_count; }
+    const input_event *begin() const { return m_events; }
+    const input_event *end() const { return m_events + m_count; }
+
+    // Events that didn't fit are dropped
+    uint64_t get_dropped() const { return m_dropped; }
+
+private:
+    void push(const input_event &e)
+    {
+        if (m_count == capacity) {
+            ++m_dropped;
+            return;
+        }
+        m_events[m_count++] = e;
+    }
+
+    input_event m_events[capacity];
+    size_t m_count;
+    uint64_t m_dropped;
+};
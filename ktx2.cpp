@@ -0,0 +1,175 @@
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <algorithm>
+
+#include "ktx2.h"
+#include "vk.h"
+#include "vk_texture.h"
+
+struct ktx2_file::header {
+    uint8_t identifier[12];
+    uint32_t format;
+    uint32_t type_size;
+    uint32_t width;
+    uint32_t height;
+    uint32_t depth;
+    uint32_t layer_count;
+    uint32_t face_count;
+    uint32_t level_count;
+    uint32_t supercompression_scheme;
+    uint32_t dfd_offset;
+    uint32_t dfd_length;
+    uint32_t kvd_offset;
+    uint32_t kvd_length;
+    uint64_t sgd_offset;
+    uint64_t sgd_length;
+};
+
+struct ktx2_file::level_index {
+    uint64_t offset;
+    uint64_t length;
+    uint64_t uncompressed_length;
+};
+
+static const uint8_t ktx2_identifier[12] = { 0xAB, 'K', 'T', 'X', ' ', '2', '0', 0xBB, '\r', '\n', 0x1A, '\n' };
+
+// Level offsets in the file are multiples of the texel block size and of 4,
+// keeping the same layout in the staging buffer satisfies vkCmdCopyBufferToImage
+// for every block size up to 16 bytes
+static const uint64_t staging_alignment = 48;
+
+ktx2_file::ktx2_file(stringview path)
+         : m_map(MAP_FAILED)
+         , m_size(0)
+{
+    static_assert(sizeof(header) == 80 && sizeof(level_index) == 24, "KTX2 layout mismatch");
+
+    int fd = open(path.to_string().data(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        throw vk_exception("Failed to open the texture file {}: {}\n", path, strerror(errno));
+    }
+    struct stat st;
+    if (fstat(fd, &st) == 0) {
+        m_size = st.st_size;
+        m_map = mmap(nullptr, m_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    int err = errno;
+    close(fd);
+    if (m_map == MAP_FAILED) {
+        throw vk_exception("Failed to map the texture file {}: {}\n", path, strerror(err));
+    }
+
+    // From here on the destructor won't run if anything throws
+    auto fail = [&](const char *reason) {
+        munmap(m_map, m_size);
+        throw vk_exception("Invalid KTX2 file {}: {}\n", path, reason);
+    };
+
+    m_header = (const header *)m_map;
+    if (m_size < sizeof(header) || memcmp(m_header->identifier, ktx2_identifier, sizeof(ktx2_identifier)) != 0) {
+        fail("bad identifier");
+    }
+    if (m_header->format == VK_FORMAT_UNDEFINED || m_header->supercompression_scheme != 0) {
+        fail("supercompressed data is not supported");
+    }
+    if (m_header->width == 0 || (m_header->face_count != 1 && m_header->face_count != 6)) {
+        fail("bad dimensions");
+    }
+    // The faces of a cube map are square 2D images
+    if (m_header->face_count == 6 && (m_header->width != m_header->height || m_header->depth > 1)) {
+        fail("cube map faces are not square");
+    }
+    // vk_texture makes a 3D image out of anything with depth, and those have no layers
+    if (m_header->depth > 1 && get_array_layers() > 1) {
+        fail("3D array textures are not supported");
+    }
+    const vk_texture::texel_block *block = vk_texture::find_texel_block(get_format());
+    if (!block) {
+        fail("unsupported format");
+    }
+
+    m_level_count = std::max(m_header->level_count, 1u);
+    if (m_level_count > vk_image::get_max_mip_levels(get_extent()) || sizeof(header) + m_level_count * sizeof(level_index) > m_size) {
+        fail("bad level count");
+    }
+    m_levels = (const level_index *)((const uint8_t *)m_map + sizeof(header));
+
+    m_data_offset = UINT64_MAX;
+    m_data_end = 0;
+    for (uint32_t i = 0; i < m_level_count; ++i) {
+        const level_index &l = m_levels[i];
+        if (l.offset > m_size || l.length > m_size - l.offset) {
+            fail("level data out of bounds");
+        }
+        if (l.length < vk_texture::get_level_size(*block, get_extent(), get_array_layers(), i)) {
+            fail("level data too short");
+        }
+        m_data_offset = std::min(m_data_offset, l.offset);
+        m_data_end = std::max(m_data_end, l.offset + l.length);
+    }
+
+    // The level data is read once, front to back
+    uint64_t page = getpagesize();
+    uint64_t start = m_data_offset / page * page;
+    madvise((uint8_t *)m_map + start, m_data_end - start, MADV_SEQUENTIAL);
+}
+
+ktx2_file::~ktx2_file()
+{
+    munmap(m_map, m_size);
+}
+
+VkFormat ktx2_file::get_format() const
+{
+    return (VkFormat)m_header->format;
+}
+
+VkExtent3D ktx2_file::get_extent() const
+{
+    return { m_header->width, std::max(m_header->height, 1u), std::max(m_header->depth, 1u) };
+}
+
+uint32_t ktx2_file::get_array_layers() const
+{
+    return std::max(m_header->layer_count, 1u) * m_header->face_count;
+}
+
+ktx2_file::level ktx2_file::get_level(uint32_t index) const
+{
+    const level_index &l = m_levels[index];
+    return { (const uint8_t *)m_map + l.offset, l.length };
+}
+
+uint64_t ktx2_file::get_data_size() const
+{
+    return m_data_end - m_data_offset + staging_alignment;
+}
+
+std::unique_ptr<vk_texture> ktx2_file::create_texture(const vk_device &device, const vk_command_buffer &cmd_buffer, vk_staging_buffer &staging) const
+{
+    // Without stored levels the chain is built on the GPU
+    bool generate = m_header->level_count == 0;
+    auto texture = std::make_unique<vk_texture>(device, get_format(), get_extent(), generate ? 0 : m_level_count, get_array_layers());
+
+    // All the levels are copied with a single memcpy straight from the mapping,
+    // keeping their relative offsets
+    auto alloc = staging.allocate(m_data_end - m_data_offset, staging_alignment);
+    memcpy(alloc.data, (const uint8_t *)m_map + m_data_offset, m_data_end - m_data_offset);
+
+    texture->begin_upload(cmd_buffer);
+    for (uint32_t i = 0; i < m_level_count; ++i) {
+        texture->copy_level(cmd_buffer, staging.get_buffer(), alloc.offset + m_levels[i].offset - m_data_offset, i);
+    }
+    if (generate) {
+        texture->generate_mipmaps(cmd_buffer);
+    } else {
+        texture->end_upload(cmd_buffer);
+    }
+    return texture;
+}
@@ -0,0 +1,60 @@
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <memory>
+
+#include <vulkan/vulkan.h>
+
+#include "stringview.h"
+
+class vk_device;
+class vk_command_buffer;
+class vk_staging_buffer;
+class vk_texture;
+
+// A KTX2 texture mapped in memory. The header and the level index are read in
+// place and the level data is only touched when it is copied out. Supercompressed
+// files and Basis Universal ones, which have no Vulkan format, are rejected, as are
+// formats whose block size is not known, so that every level can be checked to
+// hold all of its blocks.
+class ktx2_file
+{
+public:
+    struct level {
+        const uint8_t *data;
+        uint64_t size;
+    };
+
+    explicit ktx2_file(stringview path);
+    ktx2_file(const ktx2_file &) = delete;
+    ~ktx2_file();
+
+    VkFormat get_format() const;
+    VkExtent3D get_extent() const;
+    // Levels stored in the file, the texture gets a full chain if it has none
+    uint32_t get_mip_levels() const { return m_level_count; }
+    // Cube map faces are stored as consecutive layers
+    uint32_t get_array_layers() const;
+    level get_level(uint32_t index) const;
+
+    // Bytes of staging space create_texture() needs
+    uint64_t get_data_size() const;
+    // Records the copy of all the levels, the texture can be sampled once the
+    // command buffer has run. staging must not be reset before that.
+    std::unique_ptr<vk_texture> create_texture(const vk_device &device, const vk_command_buffer &cmd_buffer, vk_staging_buffer &staging) const;
+
+private:
+    struct header;
+    struct level_index;
+
+    void *m_map;
+    size_t m_size;
+    const header *m_header;
+    const level_index *m_levels;
+    uint32_t m_level_count;
+    uint64_t m_data_offset;
+    uint64_t m_data_end;
+};
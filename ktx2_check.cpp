@@ -0,0 +1,124 @@
+
+#include <stdio.h>
+#include <string.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "format.h"
+#include "ktx2.h"
+#include "vk.h"
+
+// Parses KTX2 files crafted to hit each check of ktx2_file, without a GPU.
+// Takes the directory to write them in.
+
+struct crafted_file {
+    const char *name;
+    std::vector<uint8_t> data;
+    // Part of the error, null if the file is valid
+    const char *error;
+};
+
+static void put32(std::vector<uint8_t> &data, size_t offset, uint32_t value)
+{
+    memcpy(data.data() + offset, &value, sizeof(value));
+}
+
+static void put64(std::vector<uint8_t> &data, size_t offset, uint64_t value)
+{
+    memcpy(data.data() + offset, &value, sizeof(value));
+}
+
+// An RGBA8 texture with 2 levels, level 1 is stored first as the format asks
+static std::vector<uint8_t> make_rgba8(uint32_t width, uint32_t height, uint32_t faces)
+{
+    static const uint8_t identifier[12] = { 0xAB, 'K', 'T', 'X', ' ', '2', '0', 0xBB, '\r', '\n', 0x1A, '\n' };
+    uint64_t level0 = uint64_t(width) * height * 4 * faces;
+    uint64_t level1 = uint64_t(std::max(width / 2, 1u)) * std::max(height / 2, 1u) * 4 * faces;
+
+    auto data = std::vector<uint8_t>(80 + 2 * 24 + level1 + level0);
+    memcpy(data.data(), identifier, sizeof(identifier));
+    put32(data, 12, VK_FORMAT_R8G8B8A8_UNORM);
+    put32(data, 16, 1); //type size
+    put32(data, 20, width);
+    put32(data, 24, height);
+    put32(data, 36, faces);
+    put32(data, 40, 2); //level count
+    put64(data, 80, 128 + level1);
+    put64(data, 88, level0);
+    put64(data, 96, level0);
+    put64(data, 104, 128);
+    put64(data, 112, level1);
+    put64(data, 120, level1);
+    for (size_t i = 128; i < data.size(); ++i) {
+        data[i] = uint8_t(i);
+    }
+    return data;
+}
+
+static int check(const std::string &dir, const crafted_file &f)
+{
+    std::string path = dir + "/" + f.name;
+    FILE *out = fopen(path.c_str(), "wb");
+    if (!out || fwrite(f.data.data(), 1, f.data.size(), out) != f.data.size()) {
+        fmt::print("{}: failed to write {}\n", f.name, path);
+        if (out) {
+            fclose(out);
+        }
+        return 1;
+    }
+    fclose(out);
+
+    try {
+        ktx2_file file(path);
+        if (f.error) {
+            fmt::print("{}: loaded, expected '{}'\n", f.name, f.error);
+            return 1;
+        }
+        ktx2_file::level level = file.get_level(1);
+        if (file.get_mip_levels() != 2 || level.size != 16 || level.data[0] != 128) {
+            fmt::print("{}: wrong levels\n", f.name);
+            return 1;
+        }
+    } catch (const vk_exception &e) {
+        if (!f.error || !strstr(e.what(), f.error)) {
+            fmt::print("{}: {}", f.name, e.what());
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    std::string dir = argc > 1 ? argv[1] : ".";
+
+    auto bad_identifier = make_rgba8(4, 4, 1);
+    bad_identifier[5] = '1';
+
+    auto truncated_index = make_rgba8(4, 4, 1);
+    truncated_index.resize(80 + 24);
+
+    auto short_level = make_rgba8(4, 4, 1);
+    put64(short_level, 88, 32);
+
+    const crafted_file files[] = {
+        { "valid.ktx2", make_rgba8(4, 4, 1), nullptr },
+        { "bad-identifier.ktx2", bad_identifier, "bad identifier" },
+        { "truncated-index.ktx2", truncated_index, "bad level count" },
+        { "short-level.ktx2", short_level, "level data too short" },
+        { "cube-not-square.ktx2", make_rgba8(4, 2, 6), "cube map faces are not square" },
+    };
+
+    int failures = 0;
+    for (const crafted_file &f: files) {
+        failures += check(dir, f);
+    }
+    if (failures) {
+        fmt::print("{} KTX2 checks failed\n", failures);
+        return 1;
+    }
+    fmt::print("All {} KTX2 files parsed as expected\n", sizeof(files) / sizeof(files[0]));
+    return 0;
+}
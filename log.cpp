@@ -0,0 +1,124 @@
+
+#include <errno.h>
+#include <string.h>
+
+#include <chrono>
+
+#include "log.h"
+
+namespace {
+
+const char *level_names[] = { "trace", "debug", "info", "warning", "error" };
+
+}
+
+logger &logger::get()
+{
+    static logger l;
+    return l;
+}
+
+logger::logger()
+      : m_records(new record[capacity])
+      , m_head(0)
+      , m_tail(0)
+      , m_dropped(0)
+      , m_running(true)
+      , m_file(stdout)
+{
+    for (size_t i = 0; i < capacity; ++i) {
+        m_records[i].sequence.store(i, std::memory_order_relaxed);
+    }
+    m_thread = std::thread([this]() { run(); });
+}
+
+logger::~logger()
+{
+    m_running = false;
+    m_thread.join();
+    while (write_one()) {
+    }
+    if (m_dropped) {
+        fmt::print(m_file, "{} log records were dropped\n", m_dropped);
+    }
+    fflush(m_file);
+    if (m_file != stdout) {
+        fclose(m_file);
+    }
+}
+
+void logger::set_file(const char *path)
+{
+    FILE *f = fopen(path, "w");
+    if (!f) {
+        log_error("Failed to open the log file '{}': {}\n", path, strerror(errno));
+        return;
+    }
+    m_file = f;
+}
+
+void logger::flush()
+{
+    size_t head = m_head.load(std::memory_order_relaxed);
+    while (m_tail.load(std::memory_order_acquire) < head) {
+        std::this_thread::yield();
+    }
+}
+
+// A bounded multi producer queue: a slot is free for position pos when its
+// sequence is pos, and holds a record when its sequence is pos + 1.
+logger::record *logger::acquire(size_t &pos)
+{
+    pos = m_head.load(std::memory_order_relaxed);
+    for (;;) {
+        record &r = m_records[pos % capacity];
+        size_t seq = r.sequence.load(std::memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+        if (diff == 0) {
+            if (m_head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                return &r;
+            }
+        } else if (diff < 0) {
+            return nullptr;
+        } else {
+            pos = m_head.load(std::memory_order_relaxed);
+        }
+    }
+}
+
+bool logger::write_one()
+{
+    size_t pos = m_tail.load(std::memory_order_relaxed);
+    record &r = m_records[pos % capacity];
+    if (r.sequence.load(std::memory_order_acquire) != pos + 1) {
+        return false;
+    }
+
+    fmt::print(m_file, "[{:10.6f}] {}: ", r.time / 1.e9, level_names[(int)r.level]);
+    r.write(m_file, r.format, r.args);
+
+    r.sequence.store(pos + capacity, std::memory_order_release);
+    m_tail.store(pos + 1, std::memory_order_release);
+    return true;
+}
+
+void logger::run()
+{
+    while (m_running) {
+        bool wrote = false;
+        while (write_one()) {
+            wrote = true;
+        }
+        if (wrote) {
+            fflush(m_file);
+        } else {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+    }
+}
+
+uint64_t logger::now()
+{
+    static const auto start = std::chrono::steady_clock::now();
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+}
@@ -0,0 +1,141 @@
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include <atomic>
+#include <memory>
+#include <new>
+#include <string>
+#include <thread>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+
+#include "format.h"
+#include "stringview.h"
+
+enum class log_level {
+    trace,
+    debug,
+    info,
+    warning,
+    error,
+};
+
+// Records with a lower level than this are compiled out
+#ifndef LOG_LEVEL
+#define LOG_LEVEL 1
+#endif
+
+// The format must be a string literal, the arguments are copied and formatted
+// later on the logging thread. Never blocks, records are dropped if the queue is full.
+#define LOG(level, ...) \
+    do { \
+        if ((int)log_level::level >= LOG_LEVEL) { \
+            logger::get().push(log_level::level, __VA_ARGS__); \
+        } \
+    } while (0)
+
+#define log_trace(...) LOG(trace, __VA_ARGS__)
+#define log_debug(...) LOG(debug, __VA_ARGS__)
+#define log_info(...) LOG(info, __VA_ARGS__)
+#define log_warning(...) LOG(warning, __VA_ARGS__)
+#define log_error(...) LOG(error, __VA_ARGS__)
+
+class logger
+{
+public:
+    static logger &get();
+
+    logger(const logger &) = delete;
+    ~logger();
+
+    template<class... types>
+    void push(log_level level, const char *format, types &&... a)
+    {
+        using tuple = std::tuple<typename stored_arg<types>::type...>;
+        static_assert(sizeof(tuple) <= args_size && alignof(tuple) <= args_align, "Log record arguments too big");
+
+        size_t pos;
+        record *r = acquire(pos);
+        if (!r) {
+            m_dropped.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+        r->level = level;
+        r->time = now();
+        r->format = format;
+        r->write = &write_args<tuple>;
+        new (r->args) tuple(store(std::forward<types>(a))...);
+        r->sequence.store(pos + 1, std::memory_order_release);
+    }
+
+    // Must be called before logging anything, stdout is used otherwise
+    void set_file(const char *path);
+    // Waits until all the records pushed so far are written
+    void flush();
+
+    uint64_t get_dropped() const { return m_dropped; }
+
+private:
+    static const size_t capacity = 4096;
+    static const size_t args_size = 112;
+    static const size_t args_align = 16;
+
+    // Pointers to strings may not outlive the record, so store a copy
+    template<class T, class D = typename std::decay<T>::type>
+    struct stored_arg { using type = D; };
+    template<class T>
+    struct stored_arg<T, const char *> { using type = std::string; };
+    template<class T>
+    struct stored_arg<T, char *> { using type = std::string; };
+    template<class T>
+    struct stored_arg<T, stringview> { using type = std::string; };
+    template<class T>
+    static T &&store(T &&a) { return std::forward<T>(a); }
+    static std::string store(stringview a) { return a.to_string(); }
+
+    struct record {
+        std::atomic<size_t> sequence;
+        log_level level;
+        uint64_t time;
+        const char *format;
+        void (*write)(FILE *f, const char *format, void *args);
+        alignas(args_align) unsigned char args[args_size];
+    };
+
+    template<class tuple, size_t... I>
+    static void write_tuple(FILE *f, const char *format, tuple &t, std::index_sequence<I...>)
+    {
+        fmt::print(f, format, std::get<I>(t)...);
+    }
+    template<class tuple>
+    static void write_args(FILE *f, const char *format, void *args)
+    {
+        tuple *t = static_cast<tuple *>(args);
+        try {
+            write_tuple(f, format, *t, std::make_index_sequence<std::tuple_size<tuple>::value>());
+        } catch (const fmt::FormatError &e) {
+            fmt::print(f, "Bad log format '{}': {}\n", format, e.what());
+        }
+        t->~tuple();
+    }
+
+    logger();
+
+    record *acquire(size_t &pos);
+    bool write_one();
+    void run();
+    static uint64_t now();
+
+    std::unique_ptr<record[]> m_records;
+    std::atomic<size_t> m_head;
+    std::atomic<size_t> m_tail;
+    std::atomic<uint64_t> m_dropped;
+    std::atomic<bool> m_running;
+    std::atomic<FILE *> m_file;
+    std::thread m_thread;
+};
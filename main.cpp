@@ -1,8 +1,12 @@
 
 #include <assert.h>
+#include <stdlib.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <array>
 #include <exception>
+#include <functional>
 #include <memory>
 #include <vector>
 
@@ -18,10 +22,19 @@
 
 #include "stringview.h"
 #include "display.h"
+#include "event_loop.h"
+#include "file_watcher.h"
 #include "format.h"
+#include "log.h"
+#include "trace.h"
 #include "vk.h"
 #include "vk_pipeline.h"
+#include "vk_render_graph.h"
+#include "sg_item.h"
+#include "frame_stats.h"
+#include "vk_submit.h"
 #include "vk_swapchain.h"
+#include "vk_timeline.h"
 
 using std::string;
 using std::weak_ptr;
@@ -30,7 +43,6 @@ using std::unique_ptr;
 using std::make_unique;
 using std::make_shared;
 using std::vector;
-using fmt::print;
 
 inline uint64_t align_offset(uint64_t &offset, const vk_buffer &buf)
 {
@@ -38,93 +50,302 @@ inline uint64_t align_offset(uint64_t &offset, const vk_buffer &buf)
     return offset;
 }
 
-class vk_window
+// The device and queue shared by all the windows. The frames queued during an
+// event loop iteration are submitted and presented together on the next one.
+class vk_context
 {
 public:
-    vk_window(display &dpy, const vk_instance &instance, int w, int h)
-        : m_window(dpy, w, h, *this)
+    // The device can be an index or part of a device name, the best one is picked otherwise
+    vk_context(display &dpy, const vk_instance &instance, stringview device = stringview())
+        : m_event_loop(dpy.get_event_loop())
         , m_instance(instance)
-        , m_phys_device(instance.get_physical_devices()[0])
-        , m_surface(m_window.create_vk_surface(instance))
-        , m_format(get_format(m_surface, &m_phys_device))
-        , m_family_queue_index(get_queue_family(&m_phys_device, m_surface))
+        , m_selector(create_selector(dpy, instance, device))
+        , m_phys_device(m_selector.select())
+        , m_family_queue_index(m_selector.find_queue_family(m_phys_device))
         , m_device(m_phys_device.create_device<vk_swapchain_extension>(m_family_queue_index))
         , m_swapchain_ext(m_device.get_extension_object<vk_swapchain_extension>())
-        , m_swapchain(m_swapchain_ext->create_swapchain(m_surface, m_format))
-        , m_depth({ vk_image(m_device, VK_FORMAT_D24_UNORM_S8_UINT, vk_image::usage::depth_stencil_attachment, vk_image::type::t2D, { (uint32_t)w, (uint32_t)h, 1u }),
-                    vk_device_memory(m_device, vk_device_memory::property::device_local, m_depth.image.get_required_memory_size(), m_depth.image.get_required_memory_type()),
-                    vk_image_view() })
-        , m_renderpass(m_device, m_format.format, m_depth.image.get_format())
-        , m_cmd_pool(get_device().create_command_pool())
-        , m_init_cmd_buf(m_cmd_pool.create_command_buffer())
+        , m_queue(m_device.get_queue())
+        , m_batch(m_device, m_queue)
+        , m_frames(m_device)
+        , m_submitted(0)
+        , m_flush_scheduled(false)
+        , m_submit_times()
     {
-        print("using queue index {}\n", m_family_queue_index);
+        log_info("using queue index {}\n", m_family_queue_index);
+        log_info("bindless descriptors {}available\n", m_device.supports_bindless() ? "" : "not ");
+    }
+    vk_context(const vk_context &) = delete;
 
-        m_depth.image.bind_memory(&m_depth.mem, 0);
-        m_depth.view = m_depth.image.create_image_view(vk_image::aspect::depth);
+    const vk_instance &get_instance() const { return m_instance; }
+    const vk_physical_device &get_physical_device() const { return m_phys_device; }
+    const vk_device &get_device() const { return m_device; }
+    vk_swapchain_extension &get_swapchain_extension() { return *m_swapchain_ext; }
+    const vk_queue &get_queue() const { return m_queue; }
+    uint32_t get_queue_family_index() const { return m_family_queue_index; }
 
-        const auto &imgs = m_swapchain.get_images();
-        print("{} images available\n", imgs.size());
+    // Returns the value the frames timeline reaches once the frame is done
+    uint64_t queue_frame(const vk_command_buffer &cmd_buffer, vk_swapchain &swapchain, uint32_t image_index)
+    {
+        // A swapchain can only appear once per present
+        for (const auto &p: m_presents) {
+            if (p.first == &swapchain) {
+                flush();
+                break;
+            }
+        }
 
-        m_framebuffers.reserve(imgs.size());
-        for (const vk_image &img: imgs) {
-            print("creating buffer {}\n",(void*)&img);
-            m_framebuffers.emplace_back(get_device(), img, m_depth.view, m_renderpass);
-        }
-
-        m_init_cmd_buf.begin();
-
-        VkImageMemoryBarrier image_memory_barrier = {
-            VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER, //type
-            nullptr, //next
-            0, //src access mask
-            VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT, //dst access mask
-            VK_IMAGE_LAYOUT_UNDEFINED, //old image layout
-            VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL, //new image layout
-            0, //src queue family index
-            0, //dst queue family index
-            m_depth.image.get_handle(), //image
-            { VK_IMAGE_ASPECT_DEPTH_BIT | VK_IMAGE_ASPECT_STENCIL_BIT, 0, 1, 0, 1 }, //subresource range
-        };
+        m_batch.wait(swapchain.get_acquire_semaphore(image_index), VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT);
+        m_batch.add(cmd_buffer);
+        m_batch.signal(swapchain.get_render_done_semaphore(image_index));
+        m_presents.push_back({ &swapchain, image_index });
+        if (!m_flush_scheduled) {
+            m_flush_scheduled = true;
+            m_event_loop.add_idle([this]() {
+                m_flush_scheduled = false;
+                flush();
+            });
+        }
+        return m_submitted + 1;
+    }
 
-        vkCmdPipelineBarrier(m_init_cmd_buf.get_handle(), VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, 0, 0, nullptr, 0,
-                            nullptr, 1, &image_memory_barrier);
+    // The value the frames timeline reached, all the frames up to it are done
+    uint64_t get_completed_frame() { return m_frames.get_value(); }
 
+    void wait_frame(uint64_t value)
+    {
+        if (value > m_submitted) {
+            flush();
+        }
+        m_frames.wait(value);
+    }
+
+    // When the submission signaling value was made, in the trace::now() clock.
+    // 0 if it was not submitted yet or too long ago.
+    uint64_t get_submit_time(uint64_t value) const
+    {
+        const auto &s = m_submit_times[value % m_submit_times.size()];
+        return s.value == value ? s.time : 0;
+    }
 
+    // Other work for the queue goes in the same submission as the frames
+    vk_submit_batch &get_submit_batch() { return m_batch; }
+
+    void flush()
+    {
+        if (m_batch.empty() && m_presents.empty()) {
+            return;
+        }
+
+        m_batch.signal(m_frames, ++m_submitted);
+        m_submit_times[m_submitted % m_submit_times.size()] = { m_submitted, trace::now() };
+        m_batch.flush();
+        if (!m_presents.empty()) {
+            TRACE_ZONE("present");
+            vk_swapchain::present(m_queue, m_presents);
+            m_presents.clear();
+        }
+    }
+
+private:
+    static vk_device_selector create_selector(display &dpy, const vk_instance &instance, stringview device)
+    {
+        vk_device_selector selector(instance);
+        selector.require_extension(vk_swapchain_extension::get_extension());
+        selector.require_present([&dpy](const vk_physical_device &dev, uint32_t queue_family) {
+            return dpy.supports_present(dev, queue_family);
+        });
+        if (!device.isNull()) {
+            selector.set_override(device);
+        }
+        return selector;
+    }
+
+    event_loop &m_event_loop;
+    const vk_instance &m_instance;
+    vk_device_selector m_selector;
+    const vk_physical_device &m_phys_device;
+    int m_family_queue_index;
+    vk_device m_device;
+    std::shared_ptr<vk_swapchain_extension> m_swapchain_ext;
+    vk_queue m_queue;
+    vk_submit_batch m_batch;
+    vk_timeline m_frames;
+    uint64_t m_submitted;
+    std::vector<std::pair<vk_swapchain *, uint32_t>> m_presents;
+    bool m_flush_scheduled;
+    struct submit_time {
+        uint64_t value;
+        uint64_t time;
+    };
+    std::array<submit_time, 16> m_submit_times;
+};
+
+class vk_window
+{
+public:
+    vk_window(display &dpy, vk_context &context, int w, int h, VkSampleCountFlagBits samples = VK_SAMPLE_COUNT_4_BIT)
+        : m_window(dpy, w, h, *this)
+        , m_context(context)
+        , m_surface(m_window.create_vk_surface(context.get_instance()))
+        , m_format(get_format(m_surface, context))
+        , m_swapchain(std::make_unique<vk_swapchain>(context.get_swapchain_extension().create_swapchain(m_surface, m_format)))
+        , m_samples(context.get_physical_device().get_max_sample_count(samples))
+        , m_renderpass(context.get_device(), m_format.format, depth_format, m_samples)
+        , m_last_frame(0)
+    {
+        log_info("using {} samples per pixel\n", (int)m_samples);
+
+        create_targets();
+        log_info("depth buffer is {}lazily allocated\n", m_depth->is_lazily_allocated() ? "" : "not ");
+    }
+
+    // Recreates the swapchain and everything sized after it
+    void resize(int width, int height)
+    {
+        if (width == m_window.get_width() && height == m_window.get_height() && !m_swapchain->is_out_of_date()) {
+            return;
+        }
+        log_debug("resizing to {}x{}\n", width, height);
+
+        // A queued frame may use the old swapchain
+        m_context.flush();
+        vkDeviceWaitIdle(get_device().get_handle());
+        m_window.set_size(width, height);
+        m_framebuffers.clear();
+        m_swapchain = std::make_unique<vk_swapchain>(m_context.get_swapchain_extension().create_swapchain(m_surface, m_format, m_swapchain.get()));
+        create_targets();
+        resized();
     }
 
     void show() { m_window.show(); }
     void schedule_update() { m_window.update(); }
+    // Called when the user closes the window, which stays open if there is no handler
+    void set_close_handler(std::function<void ()> handler) { m_close_handler = std::move(handler); }
+    void close()
+    {
+        if (m_close_handler) {
+            m_close_handler();
+        }
+    }
 
     uint32_t get_width() const { return m_window.get_width(); }
     uint32_t get_height() const { return m_window.get_height(); }
 
     const vk_surface &get_surface() const { return m_surface; }
-    const vk_device &get_device() const { return m_device; }
-    vk_command_buffer &get_init_command_buffer() { return m_init_cmd_buf; }
+    const vk_device &get_device() const { return m_context.get_device(); }
+    const vk_image &get_depth_image() const { return m_depth->get_image(); }
+    // The multisampled image rendered to and resolved into the framebuffer, if any
+    const vk_image *get_multisampled_color_image() const { return m_msaa_color ? &m_msaa_color->get_image() : nullptr; }
     vk_renderpass &get_renderpass() { return m_renderpass; }
-    const vk_framebuffer &acquire_next_framebuffer()
+    // Null if the swapchain was out of date, the frame must be skipped then
+    const vk_framebuffer *acquire_next_framebuffer()
     {
-        m_fb_index = m_swapchain.acquire_next_image_index();
-        return m_framebuffers[m_fb_index];
+        if (!m_swapchain->is_out_of_date() && m_swapchain->acquire_next_image_index(m_fb_index)) {
+            return &m_framebuffers[m_fb_index];
+        }
+        recreate_swapchain();
+        return nullptr;
     }
 
-    void present_current_framebuffer(const vk_queue &queue)
+    // Submitted and presented by the context together with the other windows' frames
+    void present_current_framebuffer(const vk_command_buffer &cmd_buffer)
+    {
+        m_last_frame = m_context.queue_frame(cmd_buffer, *m_swapchain, m_fb_index);
+    }
+    // The value of the frames timeline once the last frame of this window is done
+    uint64_t get_last_frame() const { return m_last_frame; }
+    uint64_t get_completed_frame() { return m_context.get_completed_frame(); }
+    // 0 until the context submitted the last frame
+    uint64_t get_last_frame_submit_time() const { return m_context.get_submit_time(m_last_frame); }
+    // Waits for the GPU to be done with the last frame of this window only
+    void wait_last_frame()
     {
-        m_swapchain.present(queue, m_fb_index);
+        TRACE_ZONE("wait");
+        m_context.wait_frame(m_last_frame);
     }
 
     virtual void update(double /*time*/) {}
+    // The swapchain and the attachments were recreated with a new size
+    virtual void resized() {}
     virtual void mouse_motion(double /*x*/, double /*y*/) {}
     virtual void mouse_button(bool /*pressed*/) {}
     virtual void key(uint32_t /*key*/, bool /*pressed*/) {}
+    // Only called by platforms that know when frames reach the screen
+    virtual void presented(const frame_presentation & /*p*/) {}
+    // Called before update() with the events received since the last frame
+    virtual void input(const input_queue &events)
+    {
+        for (const input_event &e: events) {
+            switch (e.t) {
+            case input_event::type::motion:
+                mouse_motion(e.motion.x, e.motion.y);
+                break;
+            case input_event::type::button:
+                mouse_button(e.button.pressed);
+                break;
+            case input_event::type::key:
+                key(e.key.code, e.key.pressed);
+                break;
+            }
+        }
+    }
 
 private:
-    static VkSurfaceFormatKHR get_format(const vk_surface &surface, vk_physical_device *dev)
+    static const VkFormat depth_format = VK_FORMAT_D24_UNORM_S8_UINT;
+
+    // The window may have been resized before the platform told us, e.g. on X11
+    // before the ConfigureNotify is handled, so ask the surface for its size
+    void recreate_swapchain()
+    {
+        int width = m_window.get_width();
+        int height = m_window.get_height();
+        VkSurfaceCapabilitiesKHR caps;
+        VkResult res = vkGetPhysicalDeviceSurfaceCapabilitiesKHR(m_context.get_physical_device().get_handle(), m_surface.get_handle(), &caps);
+        // Wayland surfaces have no size of their own
+        if (res == VK_SUCCESS && caps.currentExtent.width != UINT32_MAX) {
+            width = caps.currentExtent.width;
+            height = caps.currentExtent.height;
+        }
+        // Minimized, try again on the next frame
+        if (width == 0 || height == 0) {
+            return;
+        }
+        resize(width, height);
+    }
+
+    void create_targets()
+    {
+        auto extent = VkExtent3D{ (uint32_t)m_window.get_width(), (uint32_t)m_window.get_height(), 1u };
+        m_depth = std::make_unique<vk_attachment>(get_device(), depth_format, vk_image::usage::depth_stencil_attachment, vk_image::aspect::depth, extent, true, m_samples);
+        if (m_samples != VK_SAMPLE_COUNT_1_BIT) {
+            m_msaa_color = std::make_unique<vk_attachment>(get_device(), m_format.format, vk_image::usage::color_attachment, vk_image::aspect::color,
+                                                           extent, true, m_samples);
+        }
+
+        const auto &imgs = m_swapchain->get_images();
+        log_info("{} images available\n", imgs.size());
+
+        m_framebuffers.reserve(imgs.size());
+        for (const vk_image &img: imgs) {
+            log_debug("creating framebuffer for image {}\n", (void *)&img);
+            if (m_msaa_color) {
+                m_framebuffers.emplace_back(get_device(), img, m_depth->get_view(), m_msaa_color->get_view(), m_renderpass);
+            } else {
+                m_framebuffers.emplace_back(get_device(), img, m_depth->get_view(), m_renderpass);
+            }
+        }
+    }
+
+    static VkSurfaceFormatKHR get_format(const vk_surface &surface, vk_context &context)
     {
+        const vk_physical_device *dev = &context.get_physical_device();
+        if (!surface.supports_present(dev, context.get_queue_family_index())) {
+            throw vk_exception("The queue family {} cannot present to the window surface.\n", context.get_queue_family_index());
+        }
+
         auto formats = surface.get_formats(dev);
         auto format = formats.at(0);
-        print("Found {} formats, using {}\n", formats.size(), format.format);
+        log_info("Found {} formats, using {}\n", formats.size(), format.format);
 
         VkSurfaceCapabilitiesKHR surface_caps;
         VkResult res = vkGetPhysicalDeviceSurfaceCapabilitiesKHR(dev->get_handle(), surface.get_handle(), &surface_caps);
@@ -142,47 +363,24 @@ private:
         if (res != VK_SUCCESS) {
             throw vk_exception("Failed to get the physical device surface present modes: {}\n");
         }
-        print("Found {} present modes available\n", present_modes.size());
+        log_info("Found {} present modes available\n", present_modes.size());
 
         return format;
     }
 
-    static int get_queue_family(vk_physical_device *dev, const vk_surface &surface)
-    {
-        int family_queue_index = -1;
-        auto queues_props = dev->get_queue_family_properties();
-        for (size_t i = 0; i < queues_props.size(); ++i) {
-            if (queues_props.at(i).is_graphics_capable() && surface.supports_present(dev, i)) {
-                family_queue_index = i;
-                break;
-            }
-        }
-
-        if (family_queue_index < 0) {
-            throw vk_exception("Cannot find graphics queue.\n");
-        }
-        return family_queue_index;
-    }
-
     window m_window;
-    const vk_instance &m_instance;
-    vk_physical_device m_phys_device;
+    vk_context &m_context;
     vk_surface m_surface;
     VkSurfaceFormatKHR m_format;
-    int m_family_queue_index;
-    vk_device m_device;
-    std::shared_ptr<vk_swapchain_extension> m_swapchain_ext;
-    vk_swapchain m_swapchain;
+    std::unique_ptr<vk_swapchain> m_swapchain;
     std::vector<vk_framebuffer> m_framebuffers;
-    struct {
-        vk_image image;
-        vk_device_memory mem;
-        vk_image_view view;
-    } m_depth;
+    VkSampleCountFlagBits m_samples;
+    std::unique_ptr<vk_attachment> m_depth;
+    std::unique_ptr<vk_attachment> m_msaa_color;
     vk_renderpass m_renderpass;
-    vk_command_pool m_cmd_pool;
     uint32_t m_fb_index;
-    vk_command_buffer m_init_cmd_buf;
+    uint64_t m_last_frame;
+    std::function<void ()> m_close_handler;
 };
 
 inline std::ostream &operator<<(std::ostream &os, const glm::mat4x4 &m)
@@ -204,41 +402,6 @@ inline std::ostream &operator<<(std::ostream &os, const glm::vec3 &v)
 }
 
 
-class sg_item
-{
-public:
-    sg_item(const vk_device &device)
-        : m_device(device)
-        , m_pipeline(device)
-        , m_descset_layout(device, { })
-        , m_pipeline_layout(device, m_descset_layout)
-    {
-    }
-
-    void init(const vk_renderpass &rpass)
-    {
-        m_pipeline.add_stage(vk_shader_module::stage::vertex, "vert-ui.spv", "main");
-        m_pipeline.add_stage(vk_shader_module::stage::fragment, "frag-ui.spv", "main");
-
-        m_pipeline.set_primitive_mode(vk_graphics_pipeline::triangle_strip, false);
-        m_pipeline.set_blending(true);
-
-        m_pipeline.create(rpass, m_pipeline_layout);
-    }
-
-    void draw(vk_command_buffer &cmd_buffer)
-    {
-        cmd_buffer.set_parameter(m_pipeline);
-
-        vkCmdDraw(cmd_buffer.get_handle(), 4, 1, 0, 0);
-    }
-
-    const vk_device &m_device;
-    vk_graphics_pipeline m_pipeline;
-    vk_descriptor_set_layout m_descset_layout;
-    vk_pipeline_layout m_pipeline_layout;
-};
-
 static const int voxels[] = {
     0, 0, 0,
     1, 0, 0,
@@ -299,32 +462,35 @@ struct winhnd : public vk_window
         int x, y, z;
     };
 
-    winhnd(display &dpy, const vk_instance &instance, int w, int h)
-        : vk_window(dpy, instance, w, h)
+    winhnd(display &dpy, vk_context &context, int w, int h)
+        : vk_window(dpy, context, w, h)
         , m_display(dpy)
-        , queue(get_device().get_queue(0))
-        , cmd_pool(get_device().create_command_pool())
-        , cmd_buffer(cmd_pool.create_command_buffer())
+        , cmd_pool(get_device())
         , uniform_buffer(get_device(), vk_buffer::usage::uniform_buffer, sizeof(uniform_data), 0)
         , buf(get_device(), 8)
         , index_buffer(get_device(), vk_buffer::usage::index_buffer, 200, 0)
         , instances_buffer(get_device(), 128)
         , memory(get_device(), vk_device_memory::property::host_visible, 4096, uniform_buffer.get_required_memory_type())
-        , descset_layout(get_device(), { { 0, vk_descriptor::type::uniform_buffer, 1, vk_shader_module::stage::vertex } })
+        , vertex_shader(get_device(), vk_shader_module::stage::vertex, "vert.spv")
+        , fragment_shader(get_device(), vk_shader_module::stage::fragment, "frag.spv")
+        , descset_layout(get_device(), { vertex_shader, fragment_shader })
         , descpool(get_device(), { { vk_descriptor::type::uniform_buffer, 1 } })
         , descset(descpool.allocate_descriptor_set(descset_layout))
-        , pipeline_layout(get_device(), descset_layout)
+        , pipeline_layout(get_device(), descset_layout, { vertex_shader, fragment_shader })
         , pipeline(get_device())
         , m_time(0)
         , m_angle(0)
         , m_animate(true)
         , m_debug(false)
         , m_ui(get_device())
+        , m_refresh(0)
+        , m_queries(get_device(), 16)
+        , m_shader_watcher(dpy.get_event_loop(), [this](stringview path) { m_changed_shaders.push_back(path.to_string()); })
+        , m_graph(get_device())
+        , m_framebuffer(nullptr)
     {
-        VkResult res;
-
         uint64_t offset = 0;
-        print("mem size {}\n",buf.get_required_memory_size());
+        log_debug("mem size {}\n", buf.get_required_memory_size());
         buf.bind_memory(&memory, offset);
         buf.map([](void *data) {
             static const vertex vertices[] = {
@@ -386,8 +552,6 @@ struct winhnd : public vk_window
         uniform_buffer.bind_memory(&memory, align_offset(offset, uniform_buffer));
         offset += uniform_buffer.get_required_memory_size();
 
-        auto fence = vk_fence(get_device());
-
         struct {
             vk_descriptor::type type() const { return vk_descriptor::type::uniform_buffer; }
             const vk_buffer &buffer() const { return buf; }
@@ -402,12 +566,8 @@ struct winhnd : public vk_window
         pipeline.add_stage(vk_shader_module::stage::vertex, "vert.spv", "main");
         pipeline.add_stage(vk_shader_module::stage::fragment, "frag.spv", "main");
 
-        auto binding = pipeline.add_binding(buf, vk_graphics_pipeline::input_rate::vertex);
-        pipeline.add_attribute(binding, 0, VK_FORMAT_R32G32B32_SFLOAT, 0);
-        pipeline.add_attribute(binding, 1, VK_FORMAT_R32G32B32A32_SFLOAT, 12);
-
-        binding = pipeline.add_binding(instances_buffer, vk_graphics_pipeline::input_rate::instance);
-        pipeline.add_attribute(binding, 2, VK_FORMAT_R32G32B32_SINT, 0);
+        pipeline.add_binding(buf, vk_graphics_pipeline::input_rate::vertex, { 0, 1 });
+        pipeline.add_binding(instances_buffer, vk_graphics_pipeline::input_rate::instance, { 2 });
 
         pipeline.set_primitive_mode(vk_graphics_pipeline::triangle_list, false);
         pipeline.set_blending(true);
@@ -416,35 +576,13 @@ struct winhnd : public vk_window
 
         m_ui.init(get_renderpass());
 
-
-        get_init_command_buffer().end();
-
-        vkDeviceWaitIdle(get_device().get_handle());
-
-        const VkCommandBuffer cmd_bufs[] = { get_init_command_buffer().get_handle() };
-        VkSubmitInfo submit_info = {
-            VK_STRUCTURE_TYPE_SUBMIT_INFO, //type
-            nullptr, //next
-            0, //wait semaphores count
-            nullptr, //wait semaphores
-            nullptr, //wait dst stage mask
-            1, //command buffers count
-            cmd_bufs, //command buffers
-            0, //signal semaphores count
-            nullptr, //signal semaphores
-        };
-
-        res = vkQueueSubmit(queue.get_handle(), 1, &submit_info, VK_NULL_HANDLE);
-        if (res != VK_SUCCESS) {
-            throw vk_exception("Failed to submit queue: {}\n", res);
+        for (const char *file: { "vert.spv", "frag.spv", "vert-ui.spv", "frag-ui.spv" }) {
+            m_shader_watcher.watch(file);
         }
 
-        res = vkQueueWaitIdle(queue.get_handle());
-        if (res != VK_SUCCESS) {
-            throw vk_exception("Failed to wait queue: {}\n", res);
-        }
+        init_graph();
 
-        m_camera.projection = glm::perspective<double>(glm::radians(60.f), 1, 0.1f, 256.f);
+        update_projection();
 
         m_camera.pos = glm::vec3(-15, 0, -30);
         update_camera_orientation();
@@ -452,6 +590,74 @@ struct winhnd : public vk_window
         m_mouse_pressed = false;
     }
 
+    void init_graph()
+    {
+        using access = vk_render_graph::access;
+
+        auto color = m_graph.import_image(vk_image::aspect::color);
+        auto depth = m_graph.import_image(vk_image::aspect::depth | vk_image::aspect::stencil);
+        m_graph.set_image(depth, get_depth_image());
+        m_depth_resource = depth;
+
+        auto vertices = m_graph.import_buffer(buf);
+        auto indices = m_graph.import_buffer(index_buffer);
+        auto instances = m_graph.import_buffer(instances_buffer);
+        auto uniforms = m_graph.import_buffer(uniform_buffer);
+
+        auto &scene = m_graph.add_pass("scene", [this](const vk_command_buffer &cmd_buffer) {
+            VkClearValue color_clear, depth_clear;
+            color_clear.color = { .float32 = {1.0f, 1.f, 1.f, 1.f} };
+            depth_clear.depthStencil = { 1.f, 0 };
+
+            get_renderpass().set_clear_values({ color_clear, depth_clear });
+            vk_renderpass_record(get_renderpass(), cmd_buffer, *m_framebuffer) {
+                cmd_buffer.set_parameter(pipeline);
+                vkCmdBindIndexBuffer(cmd_buffer.get_handle(), index_buffer.get_handle(), 0, VK_INDEX_TYPE_UINT32);
+
+                VkDescriptorSet descsets[] = { descset.get_handle(), };
+                vkCmdBindDescriptorSets(cmd_buffer.get_handle(), VK_PIPELINE_BIND_POINT_GRAPHICS, pipeline_layout.get_handle(), 0, 1, descsets, 0, nullptr);
+
+                auto viewport = vk_viewport(0, 0, m_framebuffer->get_width(), m_framebuffer->get_height());
+                cmd_buffer.set_parameter(viewport);
+
+                vkCmdDrawIndexed(cmd_buffer.get_handle(), 36, sizeof(voxels) / 12, 0, 0, 0);
+
+                m_ui.draw(cmd_buffer, m_framebuffer->get_width(), m_framebuffer->get_height());
+            }
+        }).read(vertices, access::vertex_buffer)
+          .read(instances, access::vertex_buffer)
+          .read(indices, access::index_buffer)
+          .read(uniforms, access::uniform_buffer)
+          .write(color, access::color_attachment)
+          .write(depth, access::depth_attachment);
+
+        if (get_multisampled_color_image()) {
+            auto msaa_color = m_graph.import_image(vk_image::aspect::color);
+            m_graph.set_image(msaa_color, *get_multisampled_color_image());
+            scene.write(msaa_color, access::color_attachment);
+            m_msaa_resource = msaa_color;
+        }
+
+        m_graph.set_output(color, access::present);
+        m_graph.compile();
+        m_graph.set_timestamp_queries(&m_queries);
+        m_color = color;
+    }
+
+    void resized()
+    {
+        m_graph.set_image(m_depth_resource, get_depth_image());
+        if (get_multisampled_color_image()) {
+            m_graph.set_image(m_msaa_resource, *get_multisampled_color_image());
+        }
+        update_projection();
+    }
+
+    void update_projection()
+    {
+        m_camera.projection = glm::perspective<double>(glm::radians(60.f), (double)get_width() / get_height(), 0.1f, 256.f);
+    }
+
     void update_camera_orientation()
     {
         auto cy = cos(m_camera.angle.y);
@@ -498,17 +704,25 @@ struct winhnd : public vk_window
 
     void update(double time)
     {
+        TRACE_ZONE("update");
+
         double time_diff = m_time < 1 ? 0 : time - m_time;
         m_time = time;
 
-        if (m_debug) {
-            fmt::print("frame time: {}\n", time_diff);
+        if (time_diff > 0) {
+            m_stats.add_frame(time_diff * 1000.);
         }
 
-
 //             assert(time_diff<30);
 
-        vkDeviceWaitIdle(get_device().get_handle());
+        reload_shaders();
+
+        wait_last_frame();
+        cmd_pool.reset();
+
+        m_pass_timings = m_graph.get_pass_timings();
+        trace_gpu_passes();
+        update_overlay();
 
 //         m_angle += 0.5 * time_diff * m_animate;
 
@@ -527,84 +741,142 @@ struct winhnd : public vk_window
             memcpy(data->matrix, glm::value_ptr(matrix), sizeof(uniform_data::matrix));
         });
 
-        const auto &framebuffer = acquire_next_framebuffer();
-
-        cmd_buffer.begin();
-
-        VkImageMemoryBarrier image_memory_barrier = {
-            VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER, //type
-            nullptr, //next
-            0, //src access mask
-            VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT, //dst access mask
-            VK_IMAGE_LAYOUT_UNDEFINED, //old image layout
-            VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL, //new image layout
-            0, //src queue family index
-            0, //dst queue family index
-            framebuffer.get_image().get_handle(), //image
-            { VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1 }, //subresource range
-        };
-
-        vkCmdPipelineBarrier(cmd_buffer.get_handle(), VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, 0, 0, nullptr, 0,
-                            nullptr, 1, &image_memory_barrier);
+        m_framebuffer = acquire_next_framebuffer();
+        if (!m_framebuffer) {
+            schedule_update();
+            return;
+        }
+        m_graph.set_image(m_color, m_framebuffer->get_image());
+
+        auto cmd_buffer = cmd_pool.get_command_buffer();
+        {
+            TRACE_ZONE("record");
+            cmd_buffer.begin();
+            m_ui.prepare(cmd_buffer);
+            m_graph.execute(cmd_buffer);
+            cmd_buffer.end();
+        }
 
-        VkClearValue color_clear, depth_clear;
-        color_clear.color = { .float32 = {1.0f, 1.f, 1.f, 1.f} };
-        depth_clear.depthStencil = { 1.f, 0 };
+        present_current_framebuffer(cmd_buffer);
+        schedule_update();
+    }
 
-        get_renderpass().set_clear_values({ color_clear, depth_clear });
-        vk_renderpass_record(get_renderpass(), cmd_buffer, framebuffer) {
-            cmd_buffer.set_parameter(pipeline);
-            vkCmdBindIndexBuffer(cmd_buffer.get_handle(), index_buffer.get_handle(), 0, VK_INDEX_TYPE_UINT32);
+    void trace_gpu_passes()
+    {
+#ifdef ENABLE_TRACING
+        uint64_t submit_time = get_last_frame_submit_time();
+        if (m_pass_timings.empty() || !submit_time) {
+            return;
+        }
+        // The GPU clock has an unknown offset from ours, assume the first pass
+        // started right when the frame was submitted.
+        uint64_t offset = submit_time - m_pass_timings.front().begin;
+        for (const auto &t: m_pass_timings) {
+            trace::add_gpu_zone(t.name, t.begin + offset, t.end + offset);
+        }
+#endif
+    }
 
-            VkDescriptorSet descsets[] = { descset.get_handle(), };
-            vkCmdBindDescriptorSets(cmd_buffer.get_handle(), VK_PIPELINE_BIND_POINT_GRAPHICS, pipeline_layout.get_handle(), 0, 1, descsets, 0, nullptr);
+    void update_overlay()
+    {
+        m_ui.clear();
+        if (!m_debug) {
+            return;
+        }
 
-            auto viewport = vk_viewport(0, 0, framebuffer.get_width(), framebuffer.get_height());
-            cmd_buffer.set_parameter(viewport);
+        const sg_item::color white = { 1, 1, 1, 1 };
+        const float scale = 2;
+        const float line = 9 * scale + 2;
+        float y = 8;
+
+        m_ui.add_rect(0, 0, 300, 400, { 0, 0, 0, 0.6 });
+
+        double last = m_stats.get_last();
+        m_ui.add_text(8, y, fmt::format("frame {:.2f} ms {:.0f} fps", last, last > 0 ? 1000. / last : 0.), scale, white);
+        y += line;
+        m_ui.add_text(8, y, fmt::format("p50 {:.1f} p95 {:.1f} p99 {:.1f}", m_stats.get_percentile(0.5), m_stats.get_percentile(0.95), m_stats.get_percentile(0.99)),
+                      scale, white);
+        y += line;
+        for (const auto &t: m_pass_timings) {
+            m_ui.add_text(8, y, fmt::format("gpu {} {:.3f} ms", t.name, t.ms), scale, white);
+            y += line;
+        }
+        if (m_swap_latency.get_count()) {
+            m_ui.add_text(8, y, fmt::format("present {:.1f} ms refresh {:.1f} ms", m_swap_latency.get_percentile(0.5), m_refresh), scale, white);
+            y += line;
+        }
+        if (m_input_latency.get_count()) {
+            m_ui.add_text(8, y, fmt::format("input p50 {:.1f} p99 {:.1f} ms", m_input_latency.get_percentile(0.5), m_input_latency.get_percentile(0.99)),
+                          scale, white);
+            y += line;
+        }
+        m_ui.add_text(8, y, fmt::format("mem {:.1f} mb", get_device().get_allocated_memory() / (1024. * 1024.)), scale, white);
+        y += line + 4;
+
+        // One bar per frame, full height is 33ms
+        const float height = 60;
+        m_ui.add_rect(8, y + height / 2, m_stats.get_count(), 1, white);
+        for (size_t i = 0; i < m_stats.get_count(); ++i) {
+            double ms = m_stats.get_frame(i);
+            float h = std::min(ms / 33.3, 1.) * height;
+            sg_item::color c = ms < 17 ? sg_item::color{ 0.2, 0.9, 0.2, 1 } : ms < 34 ? sg_item::color{ 0.9, 0.9, 0.2, 1 } : sg_item::color{ 0.9, 0.2, 0.2, 1 };
+            m_ui.add_rect(8 + i, y + height - h, 1, h, c);
+        }
+    }
 
-            vkCmdDrawIndexed(cmd_buffer.get_handle(), 36, sizeof(voxels) / 12, 0, 0, 0);
+    // Doesn't wait for the GPU, a replaced pipeline lives until the frames that
+    // used it are done
+    void reload_shaders()
+    {
+        uint64_t completed = get_completed_frame();
+        pipeline.destroy_retired(completed);
+        m_ui.destroy_retired(completed);
 
-            m_ui.draw(cmd_buffer);
+        if (m_changed_shaders.empty()) {
+            return;
         }
 
-        VkImageMemoryBarrier present_image_memory_barrier = {
-            VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER, //type
-            nullptr, //next
-            VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT, //src access mask
-            VK_ACCESS_MEMORY_READ_BIT, //dst access mask
-            VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL, //old image layout
-            VK_IMAGE_LAYOUT_PRESENT_SRC_KHR, //new image layout
-            0, //src queue family index
-            0, //dst queue family index
-            framebuffer.get_image().get_handle(), //image
-            { VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1 }, //subresource range
-        };
-        vkCmdPipelineBarrier(cmd_buffer.get_handle(), VK_PIPELINE_STAGE_ALL_COMMANDS_BIT, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, 0, 0, nullptr, 0,
-                            nullptr, 1, &present_image_memory_barrier);
-
-
-        cmd_buffer.end();
-
-        VkPipelineStageFlags pipe_stage_flags = VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT;
-        VkCommandBuffer cmd_buf_raw = cmd_buffer.get_handle();
-        VkSubmitInfo submit_draw_info = {
-            VK_STRUCTURE_TYPE_SUBMIT_INFO, //type
-            nullptr, //next
-            0, //wait semaphore count
-            nullptr, //wait semaphores
-            &pipe_stage_flags, //wait dst stage mask
-            1, //command buffer count
-            &cmd_buf_raw, //command buffers
-            0, //signal semaphores count
-            nullptr, //signal semaphores
+        auto reload = [this](auto &item) {
+            bool changed = false;
+            for (const std::string &file: m_changed_shaders) {
+                changed = changed || item.uses_file(file);
+            }
+            if (!changed) {
+                return;
+            }
+
+            try {
+                item.reload(get_last_frame());
+            } catch (const vk_exception &e) {
+                log_error("Failed to reload the shaders: {}", e.what());
+            }
         };
-        VkResult res = vkQueueSubmit(queue.get_handle(), 1, &submit_draw_info, VK_NULL_HANDLE);
-        if (res != VK_SUCCESS) {
-            throw vk_exception("Failed to submit queue: {}\n", res);
+        reload(pipeline);
+        reload(m_ui);
+        m_changed_shaders.clear();
+    }
+
+    void presented(const frame_presentation &p)
+    {
+        if (p.discarded) {
+            return;
+        }
+        m_swap_latency.add_frame((p.presented - p.swap_time) / 1.e6);
+        if (p.input_time) {
+            m_input_latency.add_frame((p.presented - p.input_time) / 1.e6);
         }
+        m_refresh = p.refresh / 1.e6;
+    }
 
-        present_current_framebuffer(queue);
-        schedule_update();
+    static void dump_trace()
+    {
+#ifdef ENABLE_TRACING
+        if (trace::dump("vktest-trace.json")) {
+            log_info("Trace written to vktest-trace.json\n");
+        } else {
+            log_error("Failed to write vktest-trace.json\n");
+        }
+#endif
     }
 
     void mouse_motion(double x, double y)
@@ -620,7 +892,7 @@ struct winhnd : public vk_window
     void key(uint32_t k, bool pressed)
     {
         if (pressed) {
-            fmt::print("key {}\n",k);
+            log_debug("key {}\n", k);
             switch (k) {
                 case 57: {
                     m_animate = !m_animate;
@@ -634,6 +906,10 @@ struct winhnd : public vk_window
                     m_display.quit();
                     return;
                 }
+                case 20: {
+                    dump_trace();
+                    return;
+                }
             }
         }
 
@@ -657,14 +933,14 @@ struct winhnd : public vk_window
     }
 
     display &m_display;
-    vk_queue queue;
-    vk_command_pool cmd_pool;
-    vk_command_buffer cmd_buffer;
+    vk_frame_command_pool cmd_pool;
     vk_buffer uniform_buffer;
     vk_vertex_buffer<vertex> buf;
     vk_buffer index_buffer;
     vk_vertex_buffer<instance_data> instances_buffer;
     vk_device_memory memory;
+    vk_shader_module vertex_shader;
+    vk_shader_module fragment_shader;
     vk_descriptor_set_layout descset_layout;
     vk_descriptor_pool descpool;
     vk_descriptor_set descset;
@@ -685,33 +961,83 @@ struct winhnd : public vk_window
     glm::vec2 m_mouse_pos, m_cur_mouse_pos;
     bool m_mouse_pressed;
     sg_item m_ui;
+    frame_stats m_stats;
+    // Milliseconds from the swap and from the first input event to the frame being shown
+    frame_stats m_swap_latency;
+    frame_stats m_input_latency;
+    double m_refresh;
+    vk_query_pool m_queries;
+    std::vector<vk_render_graph::pass_timing> m_pass_timings;
+    file_watcher m_shader_watcher;
+    std::vector<std::string> m_changed_shaders;
+    vk_render_graph m_graph;
+    vk_render_graph::resource m_color;
+    vk_render_graph::resource m_depth_resource;
+    vk_render_graph::resource m_msaa_resource;
+    const vk_framebuffer *m_framebuffer;
 };
 
 
 
 int main(int argc, char **argv)
 {
+    if (const char *file = getenv("VKTEST_LOG_FILE")) {
+        logger::get().set_file(file);
+    }
+
     auto plat = platform::xcb;
-    if (argc > 1 && stringview(argv[1]) == "wl") {
-        plat = platform::wayland;
+    auto device = stringview(getenv("VKTEST_DEVICE"));
+    for (int i = 1; i < argc; ++i) {
+        auto arg = stringview(argv[i]);
+        if (arg == "wl") {
+            plat = platform::wayland;
+        } else if (arg == "--device" && i + 1 < argc) {
+            device = argv[++i];
+        }
     }
 
 
     auto layers = vk_instance::get_available_layers();
-    print("Found {} available layers\n", layers.size());
+    log_info("Found {} available layers\n", layers.size());
     int i = 0;
     for (vk_layer &layer: layers) {
-        print("{}: {} == {}\n", i++, layer.get_name(), layer.get_description());
+        log_info("{}: {} == {}\n", i++, layer.get_name(), layer.get_description());
     }
 
     auto dpy = display(plat);
 
     auto instance = dpy.create_vk_instance({ VK_EXT_DEBUG_REPORT_EXTENSION_NAME });
-    auto win = winhnd(dpy, instance, 600, 600);
-    win.show();
-    win.schedule_update();
+    vk_context context(dpy, instance, device);
+
+    int window_count = 1;
+    if (const char *count = getenv("VKTEST_WINDOWS")) {
+        window_count = std::max(atoi(count), 1);
+    }
+    vector<unique_ptr<winhnd>> windows;
+    for (int n = 0; n < window_count; ++n) {
+        windows.push_back(make_unique<winhnd>(dpy, context, 600, 600));
+        winhnd *w = windows.back().get();
+        // Not destroyed while the platform is dispatching its events
+        w->set_close_handler([&dpy, &windows, w]() {
+            dpy.get_event_loop().add_idle([&dpy, &windows, w]() {
+                auto it = std::find_if(windows.begin(), windows.end(), [w](const unique_ptr<winhnd> &p) { return p.get() == w; });
+                if (it == windows.end()) {
+                    return;
+                }
+                w->wait_last_frame();
+                windows.erase(it);
+                if (windows.empty()) {
+                    dpy.quit();
+                }
+            });
+        });
+        w->show();
+        w->schedule_update();
+    }
 
 
+    trace::set_thread_name("main");
     dpy.run();
+    winhnd::dump_trace();
     return 0;
 }
@@ -0,0 +1,177 @@
+
+#include <ctype.h>
+#include <string.h>
+
+#include <algorithm>
+
+#include "sg_item.h"
+
+namespace {
+
+// Glyph 0 is a filled quad, glyph i + 1 is characters[i]
+const char characters[] = " 0123456789.:%-/_abcdefghijklmnopqrstuvwxyz";
+const char *const font[][7] = {
+    { ".....", ".....", ".....", ".....", ".....", ".....", "....." }, // ' '
+    { ".###.", "#...#", "#..##", "#.#.#", "##..#", "#...#", ".###." }, // 0
+    { "..#..", ".##..", "..#..", "..#..", "..#..", "..#..", ".###." }, // 1
+    { ".###.", "#...#", "....#", "...#.", "..#..", ".#...", "#####" }, // 2
+    { "#####", "...#.", "..#..", "...#.", "....#", "#...#", ".###." }, // 3
+    { "...#.", "..##.", ".#.#.", "#..#.", "#####", "...#.", "...#." }, // 4
+    { "#####", "#....", "####.", "....#", "....#", "#...#", ".###." }, // 5
+    { "..##.", ".#...", "#....", "####.", "#...#", "#...#", ".###." }, // 6
+    { "#####", "....#", "...#.", "..#..", ".#...", ".#...", ".#..." }, // 7
+    { ".###.", "#...#", "#...#", ".###.", "#...#", "#...#", ".###." }, // 8
+    { ".###.", "#...#", "#...#", ".####", "....#", "...#.", ".##.." }, // 9
+    { ".....", ".....", ".....", ".....", ".....", ".##..", ".##.." }, // .
+    { ".....", ".##..", ".##..", ".....", ".##..", ".##..", "....." }, // :
+    { "##...", "##..#", "...#.", "..#..", ".#...", "#..##", "...##" }, // %
+    { ".....", ".....", ".....", "#####", ".....", ".....", "....." }, // -
+    { ".....", "....#", "...#.", "..#..", ".#...", "#....", "....." }, // /
+    { ".....", ".....", ".....", ".....", ".....", ".....", "#####" }, // _
+    { ".....", ".....", ".###.", "....#", ".####", "#...#", ".####" }, // a
+    { "#....", "#....", "#.##.", "##..#", "#...#", "#...#", "####." }, // b
+    { ".....", ".....", ".###.", "#....", "#....", "#...#", ".###." }, // c
+    { "....#", "....#", ".##.#", "#..##", "#...#", "#...#", ".####" }, // d
+    { ".....", ".....", ".###.", "#...#", "#####", "#....", ".###." }, // e
+    { "..##.", ".#..#", ".#...", "###..", ".#...", ".#...", ".#..." }, // f
+    { ".....", ".####", "#...#", "#...#", ".####", "....#", ".###." }, // g
+    { "#....", "#....", "#.##.", "##..#", "#...#", "#...#", "#...#" }, // h
+    { "..#..", ".....", ".##..", "..#..", "..#..", "..#..", ".###." }, // i
+    { "...#.", ".....", "..##.", "...#.", "...#.", "#..#.", ".##.." }, // j
+    { "#....", "#....", "#..#.", "#.#..", "##...", "#.#..", "#..#." }, // k
+    { ".##..", "..#..", "..#..", "..#..", "..#..", "..#..", ".###." }, // l
+    { ".....", ".....", "##.#.", "#.#.#", "#.#.#", "#...#", "#...#" }, // m
+    { ".....", ".....", "#.##.", "##..#", "#...#", "#...#", "#...#" }, // n
+    { ".....", ".....", ".###.", "#...#", "#...#", "#...#", ".###." }, // o
+    { ".....", ".....", "####.", "#...#", "####.", "#....", "#...." }, // p
+    { ".....", ".....", ".##.#", "#..##", ".####", "....#", "....#" }, // q
+    { ".....", ".....", "#.##.", "##..#", "#....", "#....", "#...." }, // r
+    { ".....", ".....", ".###.", "#....", ".###.", "....#", "####." }, // s
+    { ".#...", ".#...", "###..", ".#...", ".#...", ".#..#", "..##." }, // t
+    { ".....", ".....", "#...#", "#...#", "#...#", "#..##", ".##.#" }, // u
+    { ".....", ".....", "#...#", "#...#", "#...#", ".#.#.", "..#.." }, // v
+    { ".....", ".....", "#...#", "#...#", "#.#.#", "#.#.#", ".#.#." }, // w
+    { ".....", ".....", "#...#", ".#.#.", "..#..", ".#.#.", "#...#" }, // x
+    { ".....", ".....", "#...#", "#...#", ".####", "....#", ".###." }, // y
+    { ".....", ".....", "#####", "...#.", "..#..", ".#...", "#####" }, // z
+};
+const uint32_t glyph_count = sizeof(font) / sizeof(font[0]) + 1;
+
+static_assert(sizeof(font) / sizeof(font[0]) == sizeof(characters) - 1, "Every character needs a glyph");
+
+const uint32_t atlas_width = glyph_count * 5;
+const uint32_t atlas_height = 7;
+
+// Glyph g takes the columns g * 5 to g * 5 + 4 of the atlas
+void rasterize_font(uint8_t *texels)
+{
+    for (uint32_t row = 0; row < atlas_height; ++row) {
+        uint8_t *line = texels + row * atlas_width;
+        memset(line, 0xff, 5);
+        for (uint32_t g = 1; g < glyph_count; ++g) {
+            for (int col = 0; col < 5; ++col) {
+                line[g * 5 + col] = font[g - 1][row][col] == '#' ? 0xff : 0;
+            }
+        }
+    }
+}
+
+uint32_t get_glyph(char c)
+{
+    const char *p = strchr(characters, tolower(c));
+    return p && c ? p - characters + 1 : 1;
+}
+
+}
+
+sg_item::sg_item(const vk_device &device, uint32_t max_quads)
+       : m_device(device)
+       , m_vertex_shader(device, vk_shader_module::stage::vertex, "vert-ui.spv")
+       , m_fragment_shader(device, vk_shader_module::stage::fragment, "frag-ui.spv")
+       , m_descset_layout(device, { m_vertex_shader, m_fragment_shader })
+       , m_pipeline_layout(device, m_descset_layout, { m_vertex_shader, m_fragment_shader })
+       , m_descpool(device, { { vk_descriptor::type::combined_image_sampler, 1 } })
+       , m_descset(m_descpool.allocate_descriptor_set(m_descset_layout))
+       , m_atlas(device, VK_FORMAT_R8_UNORM, { atlas_width, atlas_height, 1 }, 1)
+       , m_sampler(device, vk_sampler::filter::nearest, vk_sampler::filter::nearest, vk_sampler::filter::nearest, vk_sampler::address_mode::clamp_to_edge)
+       , m_staging(device, atlas_width * atlas_height)
+       , m_atlas_uploaded(false)
+       , m_quads(device, max_quads)
+       , m_memory(device, vk_device_memory::property::host_visible | vk_device_memory::property::host_coherent,
+                  m_quads.get_required_memory_size(), m_quads.get_required_memory_type())
+       , m_pipeline(device)
+       , m_max_quads(max_quads)
+{
+    m_quads.bind_memory(&m_memory, 0);
+    m_descset.update(m_atlas.get_view(), m_sampler);
+}
+
+void sg_item::init(const vk_renderpass &rpass)
+{
+    m_pipeline.add_stage(vk_shader_module::stage::vertex, "vert-ui.spv", "main");
+    m_pipeline.add_stage(vk_shader_module::stage::fragment, "frag-ui.spv", "main");
+    m_pipeline.add_binding(m_quads, vk_graphics_pipeline::input_rate::instance, { 0, 1, 2 });
+
+    m_pipeline.set_primitive_mode(vk_graphics_pipeline::triangle_strip, false);
+    m_pipeline.set_blending(true);
+
+    m_pipeline.create(rpass, m_pipeline_layout);
+}
+
+void sg_item::prepare(const vk_command_buffer &cmd_buffer)
+{
+    if (m_atlas_uploaded) {
+        return;
+    }
+    auto texels = std::vector<uint8_t>(atlas_width * atlas_height);
+    rasterize_font(texels.data());
+    m_atlas.upload(cmd_buffer, m_staging, texels.data(), texels.size());
+    m_atlas_uploaded = true;
+}
+
+void sg_item::clear()
+{
+    m_pending.clear();
+}
+
+void sg_item::add_rect(float x, float y, float width, float height, const color &c)
+{
+    m_pending.push_back({ { x, y, width, height }, 0, { c.r, c.g, c.b, c.a } });
+}
+
+float sg_item::add_text(float x, float y, const std::string &text, float scale, const color &c)
+{
+    for (size_t i = 0; i < text.size(); ++i) {
+        if (text[i] != ' ') {
+            m_pending.push_back({ { x, y, 5 * scale, 7 * scale }, get_glyph(text[i]), { c.r, c.g, c.b, c.a } });
+        }
+        x += 6 * scale;
+    }
+    return x;
+}
+
+void sg_item::draw(const vk_command_buffer &cmd_buffer, uint32_t width, uint32_t height)
+{
+    if (m_pending.empty()) {
+        return;
+    }
+    if (!m_atlas_uploaded) {
+        throw vk_exception("The font atlas must be uploaded with prepare() before drawing.\n");
+    }
+
+    // Everything is drawn with a single instanced draw, whatever doesn't fit is dropped
+    uint32_t count = std::min<size_t>(m_pending.size(), m_max_quads);
+    m_quads.map([&](void *data) {
+        memcpy(data, m_pending.data(), count * sizeof(quad));
+    });
+
+    cmd_buffer.set_parameter(m_pipeline);
+
+    VkDescriptorSet descsets[] = { m_descset.get_handle(), };
+    vkCmdBindDescriptorSets(cmd_buffer.get_handle(), VK_PIPELINE_BIND_POINT_GRAPHICS, m_pipeline_layout.get_handle(), 0, 1, descsets, 0, nullptr);
+
+    const float screen_size[] = { (float)width, (float)height };
+    vkCmdPushConstants(cmd_buffer.get_handle(), m_pipeline_layout.get_handle(), VK_SHADER_STAGE_VERTEX_BIT, 0, sizeof(screen_size), screen_size);
+
+    vkCmdDraw(cmd_buffer.get_handle(), 4, count, 0, 0);
+}
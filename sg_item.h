@@ -0,0 +1,64 @@
+
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include "vk.h"
+#include "vk_pipeline.h"
+#include "vk_texture.h"
+
+// Draws batches of instanced, screen aligned quads, either filled or textured
+// with a glyph of the built in 5x7 bitmap font.
+class sg_item
+{
+public:
+    struct color {
+        float r, g, b, a;
+    };
+
+    sg_item(const vk_device &device, uint32_t max_quads = 4096);
+    sg_item(const sg_item &) = delete;
+
+    void init(const vk_renderpass &rpass);
+    // Records the upload of the font atlas the first time, outside of a render
+    // pass and before the first draw()
+    void prepare(const vk_command_buffer &cmd_buffer);
+
+    void clear();
+    // Coordinates are in pixels from the top left corner
+    void add_rect(float x, float y, float width, float height, const color &c);
+    // Each character is 6x9 pixels times scale, including the spacing.
+    // Returns the x coordinate after the last character
+    float add_text(float x, float y, const std::string &text, float scale, const color &c);
+
+    void draw(const vk_command_buffer &cmd_buffer, uint32_t width, uint32_t height);
+
+    bool uses_file(stringview filename) const { return m_pipeline.uses_file(filename); }
+    void reload(uint64_t last_use) { m_pipeline.reload(last_use); }
+    void destroy_retired(uint64_t completed) { m_pipeline.destroy_retired(completed); }
+
+private:
+    struct quad {
+        float rect[4];
+        uint32_t glyph;
+        float color[4];
+    };
+
+    const vk_device &m_device;
+    vk_shader_module m_vertex_shader;
+    vk_shader_module m_fragment_shader;
+    vk_descriptor_set_layout m_descset_layout;
+    vk_pipeline_layout m_pipeline_layout;
+    vk_descriptor_pool m_descpool;
+    vk_descriptor_set m_descset;
+    vk_texture m_atlas;
+    vk_sampler m_sampler;
+    vk_staging_buffer m_staging;
+    bool m_atlas_uploaded;
+    vk_vertex_buffer<quad> m_quads;
+    vk_device_memory m_memory;
+    vk_graphics_pipeline m_pipeline;
+    uint32_t m_max_quads;
+    std::vector<quad> m_pending;
+};
@@ -0,0 +1,405 @@
+
+#include <algorithm>
+
+#include "spirv.h"
+#include "vk.h"
+
+namespace {
+
+const uint32_t magic = 0x07230203;
+
+enum op {
+    op_decorate = 71,
+    op_member_decorate = 72,
+    op_type_bool = 20,
+    op_type_int = 21,
+    op_type_float = 22,
+    op_type_vector = 23,
+    op_type_matrix = 24,
+    op_type_image = 25,
+    op_type_sampler = 26,
+    op_type_sampled_image = 27,
+    op_type_array = 28,
+    op_type_runtime_array = 29,
+    op_type_struct = 30,
+    op_type_pointer = 32,
+    op_constant = 43,
+    op_variable = 59,
+};
+
+enum decoration {
+    decoration_block = 2,
+    decoration_buffer_block = 3,
+    decoration_array_stride = 6,
+    decoration_matrix_stride = 7,
+    decoration_builtin = 11,
+    decoration_location = 30,
+    decoration_binding = 33,
+    decoration_descriptor_set = 34,
+    decoration_offset = 35,
+};
+
+enum storage_class {
+    storage_uniform_constant = 0,
+    storage_input = 1,
+    storage_uniform = 2,
+    storage_push_constant = 9,
+    storage_storage_buffer = 12,
+};
+
+enum image_dim {
+    dim_buffer = 5,
+    dim_subpass_data = 6,
+};
+
+struct member
+{
+    uint32_t offset = 0;
+    uint32_t matrix_stride = 0;
+};
+
+struct id_info
+{
+    uint32_t op = 0;
+    std::vector<uint32_t> operands;
+
+    bool has_location = false;
+    bool has_binding = false;
+    bool builtin = false;
+    bool block = false;
+    bool buffer_block = false;
+    uint32_t location = 0;
+    uint32_t binding = 0;
+    uint32_t set = 0;
+    uint32_t array_stride = 0;
+    std::vector<member> members;
+};
+
+class parser
+{
+public:
+    parser(const uint32_t *code, size_t word_count)
+    {
+        if (word_count < 5 || code[0] != magic) {
+            throw vk_exception("Invalid SPIR-V module: bad header.\n");
+        }
+
+        m_ids.resize(code[3]);
+        size_t i = 5;
+        while (i < word_count) {
+            uint32_t count = code[i] >> 16;
+            uint32_t opcode = code[i] & 0xffff;
+            if (count == 0 || i + count > word_count) {
+                throw vk_exception("Invalid SPIR-V module: truncated instruction at word {}.\n", i);
+            }
+            parse(opcode, code + i + 1, count - 1);
+            i += count;
+        }
+    }
+
+    id_info &get(uint32_t id)
+    {
+        if (id >= m_ids.size()) {
+            throw vk_exception("Invalid SPIR-V module: id {} out of bounds.\n", id);
+        }
+        return m_ids[id];
+    }
+
+    uint32_t constant(uint32_t id)
+    {
+        const id_info &c = get(id);
+        if (c.op != op_constant || c.operands.size() < 2) {
+            throw vk_exception("Invalid SPIR-V module: id {} is not a constant.\n", id);
+        }
+        return c.operands[1];
+    }
+
+    uint32_t size_of(uint32_t type_id)
+    {
+        const id_info &t = get(type_id);
+        switch (t.op) {
+        case op_type_bool:
+        case op_type_int:
+        case op_type_float:
+            return t.op == op_type_bool ? 4 : t.operands[0] / 8;
+        case op_type_vector:
+            return size_of(t.operands[0]) * t.operands[1];
+        case op_type_matrix:
+            return size_of(t.operands[0]) * t.operands[1];
+        case op_type_array: {
+            uint32_t len = constant(t.operands[1]);
+            uint32_t stride = t.array_stride ? t.array_stride : size_of(t.operands[0]);
+            return stride * len;
+        }
+        case op_type_runtime_array:
+            return 0;
+        case op_type_struct: {
+            uint32_t size = 0;
+            for (size_t i = 0; i < t.operands.size(); ++i) {
+                const id_info &mt = get(t.operands[i]);
+                uint32_t offset = i < t.members.size() ? t.members[i].offset : size;
+                uint32_t msize = size_of(t.operands[i]);
+                if (mt.op == op_type_matrix && i < t.members.size() && t.members[i].matrix_stride) {
+                    msize = t.members[i].matrix_stride * mt.operands[1];
+                }
+                size = std::max(size, offset + msize);
+            }
+            return size;
+        }
+        default:
+            throw vk_exception("Cannot compute the size of SPIR-V type with opcode {}.\n", t.op);
+        }
+    }
+
+    VkFormat format_of(uint32_t type_id)
+    {
+        const id_info &t = get(type_id);
+        uint32_t components = 1;
+        const id_info *scalar = &t;
+        if (t.op == op_type_vector) {
+            components = t.operands[1];
+            scalar = &get(t.operands[0]);
+        }
+
+        static const VkFormat float32[] = { VK_FORMAT_R32_SFLOAT, VK_FORMAT_R32G32_SFLOAT, VK_FORMAT_R32G32B32_SFLOAT, VK_FORMAT_R32G32B32A32_SFLOAT };
+        static const VkFormat float64[] = { VK_FORMAT_R64_SFLOAT, VK_FORMAT_R64G64_SFLOAT, VK_FORMAT_R64G64B64_SFLOAT, VK_FORMAT_R64G64B64A64_SFLOAT };
+        static const VkFormat float16[] = { VK_FORMAT_R16_SFLOAT, VK_FORMAT_R16G16_SFLOAT, VK_FORMAT_R16G16B16_SFLOAT, VK_FORMAT_R16G16B16A16_SFLOAT };
+        static const VkFormat sint32[] = { VK_FORMAT_R32_SINT, VK_FORMAT_R32G32_SINT, VK_FORMAT_R32G32B32_SINT, VK_FORMAT_R32G32B32A32_SINT };
+        static const VkFormat uint32[] = { VK_FORMAT_R32_UINT, VK_FORMAT_R32G32_UINT, VK_FORMAT_R32G32B32_UINT, VK_FORMAT_R32G32B32A32_UINT };
+
+        if (components < 1 || components > 4) {
+            throw vk_exception("Unsupported SPIR-V vector size {}.\n", components);
+        }
+        if (scalar->op == op_type_float) {
+            switch (scalar->operands[0]) {
+            case 16: return float16[components - 1];
+            case 32: return float32[components - 1];
+            case 64: return float64[components - 1];
+            }
+        } else if (scalar->op == op_type_int && scalar->operands[0] == 32) {
+            return scalar->operands[1] ? sint32[components - 1] : uint32[components - 1];
+        }
+        throw vk_exception("Unsupported SPIR-V input type with opcode {}.\n", scalar->op);
+    }
+
+    struct variable
+    {
+        uint32_t id;
+        uint32_t type;
+        uint32_t storage;
+    };
+    std::vector<variable> variables;
+
+private:
+    // The operands after the result id that the reflection reads
+    static uint32_t get_min_operands(uint32_t opcode)
+    {
+        switch (opcode) {
+        case op_type_int: return 2;
+        case op_type_float: return 1;
+        case op_type_vector: return 2;
+        case op_type_matrix: return 2;
+        case op_type_image: return 7;
+        case op_type_sampled_image: return 1;
+        case op_type_array: return 2;
+        case op_type_runtime_array: return 1;
+        case op_type_pointer: return 2;
+        // The result type is kept, the value follows
+        case op_constant: return 2;
+        default: return 0;
+        }
+    }
+
+    void parse(uint32_t opcode, const uint32_t *ops, uint32_t count)
+    {
+        switch (opcode) {
+        case op_decorate: {
+            if (count < 2) {
+                break;
+            }
+            id_info &info = get(ops[0]);
+            uint32_t value = count > 2 ? ops[2] : 0;
+            switch (ops[1]) {
+            case decoration_block: info.block = true; break;
+            case decoration_buffer_block: info.buffer_block = true; break;
+            case decoration_array_stride: info.array_stride = value; break;
+            case decoration_builtin: info.builtin = true; break;
+            case decoration_location: info.location = value; info.has_location = true; break;
+            case decoration_binding: info.binding = value; info.has_binding = true; break;
+            case decoration_descriptor_set: info.set = value; break;
+            }
+            break;
+        }
+        case op_member_decorate: {
+            if (count < 4) {
+                break;
+            }
+            id_info &info = get(ops[0]);
+            if (info.members.size() <= ops[1]) {
+                info.members.resize(ops[1] + 1);
+            }
+            if (ops[2] == decoration_offset) {
+                info.members[ops[1]].offset = ops[3];
+            } else if (ops[2] == decoration_matrix_stride) {
+                info.members[ops[1]].matrix_stride = ops[3];
+            }
+            break;
+        }
+        case op_type_bool:
+        case op_type_int:
+        case op_type_float:
+        case op_type_vector:
+        case op_type_matrix:
+        case op_type_image:
+        case op_type_sampler:
+        case op_type_sampled_image:
+        case op_type_array:
+        case op_type_runtime_array:
+        case op_type_struct:
+        case op_type_pointer: {
+            if (count < 1 + get_min_operands(opcode)) {
+                throw vk_exception("Invalid SPIR-V module: type with opcode {} has {} operands.\n", opcode, count);
+            }
+            id_info &info = get(ops[0]);
+            info.op = opcode;
+            info.operands.assign(ops + 1, ops + count);
+            break;
+        }
+        case op_constant: {
+            if (count < 1 + get_min_operands(opcode)) {
+                throw vk_exception("Invalid SPIR-V module: constant with {} operands.\n", count);
+            }
+            id_info &info = get(ops[1]);
+            info.op = opcode;
+            info.operands.assign(ops, ops + count);
+            info.operands.erase(info.operands.begin() + 1);
+            break;
+        }
+        case op_variable:
+            if (count < 3) {
+                throw vk_exception("Invalid SPIR-V module: variable with {} operands.\n", count);
+            }
+            variables.push_back({ ops[1], ops[0], ops[2] });
+            break;
+        }
+    }
+
+    std::vector<id_info> m_ids;
+};
+
+}
+
+spirv_reflection::spirv_reflection()
+                : m_push_constants({ 0, 0 })
+{
+}
+
+spirv_reflection::spirv_reflection(const uint32_t *code, size_t word_count)
+                : m_push_constants({ 0, 0 })
+{
+    parser p(code, word_count);
+
+    for (const auto &var: p.variables) {
+        const id_info &var_info = p.get(var.id);
+        const id_info &ptr = p.get(var.type);
+        if (ptr.op != op_type_pointer) {
+            throw vk_exception("Invalid SPIR-V module: variable {} is not a pointer.\n", var.id);
+        }
+        uint32_t type_id = ptr.operands[1];
+
+        switch (var.storage) {
+        case storage_input: {
+            if (var_info.builtin || !var_info.has_location) {
+                break;
+            }
+            uint32_t location = var_info.location;
+            uint32_t array_len = 1;
+            if (p.get(type_id).op == op_type_array) {
+                array_len = p.constant(p.get(type_id).operands[1]);
+                type_id = p.get(type_id).operands[0];
+            }
+            const id_info &t = p.get(type_id);
+            if (t.op == op_type_struct) {
+                break;
+            }
+            uint32_t columns = 1;
+            if (t.op == op_type_matrix) {
+                columns = t.operands[1];
+                type_id = t.operands[0];
+            }
+            uint32_t size = p.size_of(type_id);
+            for (uint32_t i = 0; i < array_len * columns; ++i) {
+                m_inputs.push_back({ location, p.format_of(type_id), size });
+                // 64 bit vectors of three and four components take two locations
+                location += size > 16 ? 2 : 1;
+            }
+            break;
+        }
+        case storage_uniform_constant:
+        case storage_uniform:
+        case storage_storage_buffer: {
+            uint32_t count = 1;
+            const id_info *t = &p.get(type_id);
+            if (t->op == op_type_array) {
+                count = p.constant(t->operands[1]);
+                t = &p.get(t->operands[0]);
+            } else if (t->op == op_type_runtime_array) {
+                count = 0;
+                t = &p.get(t->operands[0]);
+            }
+
+            VkDescriptorType type;
+            if (var.storage == storage_storage_buffer) {
+                type = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+            } else if (var.storage == storage_uniform) {
+                type = t->buffer_block ? VK_DESCRIPTOR_TYPE_STORAGE_BUFFER : VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+            } else if (t->op == op_type_sampler) {
+                type = VK_DESCRIPTOR_TYPE_SAMPLER;
+            } else if (t->op == op_type_sampled_image) {
+                type = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+            } else if (t->op == op_type_image) {
+                uint32_t dim = t->operands[1];
+                uint32_t sampled = t->operands[5];
+                if (dim == dim_subpass_data) {
+                    type = VK_DESCRIPTOR_TYPE_INPUT_ATTACHMENT;
+                } else if (dim == dim_buffer) {
+                    type = sampled == 2 ? VK_DESCRIPTOR_TYPE_STORAGE_TEXEL_BUFFER : VK_DESCRIPTOR_TYPE_UNIFORM_TEXEL_BUFFER;
+                } else {
+                    type = sampled == 2 ? VK_DESCRIPTOR_TYPE_STORAGE_IMAGE : VK_DESCRIPTOR_TYPE_SAMPLED_IMAGE;
+                }
+            } else {
+                break;
+            }
+            m_descriptors.push_back({ var_info.set, var_info.binding, type, count });
+            break;
+        }
+        case storage_push_constant: {
+            const id_info &t = p.get(type_id);
+            uint32_t begin = UINT32_MAX;
+            for (const member &m: t.members) {
+                begin = std::min(begin, m.offset);
+            }
+            if (begin == UINT32_MAX) {
+                begin = 0;
+            }
+            m_push_constants = { begin, p.size_of(type_id) - begin };
+            break;
+        }
+        }
+    }
+
+    std::sort(m_inputs.begin(), m_inputs.end(), [](const input &a, const input &b) { return a.location < b.location; });
+    std::sort(m_descriptors.begin(), m_descriptors.end(), [](const descriptor &a, const descriptor &b) {
+        return a.set < b.set || (a.set == b.set && a.binding < b.binding);
+    });
+}
+
+const spirv_reflection::input *spirv_reflection::find_input(uint32_t location) const
+{
+    for (const input &in: m_inputs) {
+        if (in.location == location) {
+            return &in;
+        }
+    }
+    return nullptr;
+}
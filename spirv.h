@@ -0,0 +1,46 @@
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <vector>
+
+#include <vulkan/vulkan.h>
+
+class spirv_reflection
+{
+public:
+    struct input
+    {
+        uint32_t location;
+        VkFormat format;
+        uint32_t size;
+    };
+    struct descriptor
+    {
+        uint32_t set;
+        uint32_t binding;
+        VkDescriptorType type;
+        uint32_t count;
+    };
+    struct push_constant_block
+    {
+        uint32_t offset;
+        uint32_t size;
+    };
+
+    spirv_reflection();
+    spirv_reflection(const uint32_t *code, size_t word_count);
+
+    const std::vector<input> &get_inputs() const { return m_inputs; }
+    const std::vector<descriptor> &get_descriptors() const { return m_descriptors; }
+    const push_constant_block &get_push_constant_block() const { return m_push_constants; }
+
+    const input *find_input(uint32_t location) const;
+
+private:
+    std::vector<input> m_inputs;
+    std::vector<descriptor> m_descriptors;
+    push_constant_block m_push_constants;
+};
@@ -0,0 +1,146 @@
+
+#include <stdio.h>
+
+#include <string>
+#include <vector>
+
+#include "format.h"
+#include "spirv.h"
+#include "vk.h"
+
+// Checks the reflection of the repo's shaders against what their GLSL
+// declares, without a GPU. Takes the directory with the built .spv files.
+
+struct expected_shader {
+    const char *file;
+    std::vector<spirv_reflection::descriptor> descriptors;
+    spirv_reflection::push_constant_block push_constants;
+};
+
+static std::vector<uint32_t> read_spirv(const std::string &path)
+{
+    FILE *f = fopen(path.c_str(), "rb");
+    if (!f) {
+        throw vk_exception("Failed to open {}.\n", path);
+    }
+    std::vector<uint32_t> code;
+    uint32_t word;
+    while (fread(&word, sizeof(word), 1, f) == 1) {
+        code.push_back(word);
+    }
+    fclose(f);
+    return code;
+}
+
+static int check(const std::string &dir, const expected_shader &e)
+{
+    auto code = read_spirv(dir + "/" + e.file);
+    auto r = spirv_reflection(code.data(), code.size());
+
+    int failures = 0;
+    auto fail = [&](const std::string &what) {
+        fmt::print("{}: {}\n", e.file, what);
+        ++failures;
+    };
+
+    const auto &descriptors = r.get_descriptors();
+    if (descriptors.size() != e.descriptors.size()) {
+        fail(fmt::format("{} descriptors, expected {}", descriptors.size(), e.descriptors.size()));
+    }
+    for (const auto &want: e.descriptors) {
+        bool found = false;
+        for (const auto &d: descriptors) {
+            if (d.set == want.set && d.binding == want.binding) {
+                found = true;
+                if (d.type != want.type || d.count != want.count) {
+                    fail(fmt::format("set {} binding {} is type {} count {}, expected type {} count {}",
+                                     d.set, d.binding, d.type, d.count, want.type, want.count));
+                }
+            }
+        }
+        if (!found) {
+            fail(fmt::format("no descriptor at set {} binding {}", want.set, want.binding));
+        }
+    }
+
+    const auto &block = r.get_push_constant_block();
+    if (block.offset != e.push_constants.offset || block.size != e.push_constants.size) {
+        fail(fmt::format("push constants at {} size {}, expected at {} size {}",
+                         block.offset, block.size, e.push_constants.offset, e.push_constants.size));
+    }
+    return failures;
+}
+
+// Modules built by hand for what the shaders above don't have
+static int check_crafted()
+{
+    auto op = [](uint32_t opcode, std::vector<uint32_t> operands) {
+        operands.insert(operands.begin(), uint32_t(operands.size() + 1) << 16 | opcode);
+        return operands;
+    };
+    auto module = [](const std::vector<std::vector<uint32_t>> &instructions) {
+        std::vector<uint32_t> code = { 0x07230203, 0x00010000, 0, 16, 0 };
+        for (const auto &i: instructions) {
+            code.insert(code.end(), i.begin(), i.end());
+        }
+        return code;
+    };
+
+    int failures = 0;
+    // Each dvec3 of an array at location 0 takes two locations, a vec4 follows at 4
+    auto code = module({
+        op(71, { 5, 30, 0 }), op(71, { 9, 30, 4 }),
+        op(22, { 1, 64 }), op(23, { 2, 1, 3 }), op(21, { 10, 32, 0 }), op(43, { 10, 11, 2 }), op(28, { 12, 2, 11 }),
+        op(32, { 3, 1, 12 }), op(59, { 3, 5, 1 }),
+        op(22, { 6, 32 }), op(23, { 7, 6, 4 }), op(32, { 8, 1, 7 }), op(59, { 8, 9, 1 }),
+    });
+    auto r = spirv_reflection(code.data(), code.size());
+    const auto &inputs = r.get_inputs();
+    if (inputs.size() != 3 || inputs[0].location != 0 || inputs[1].location != 2 || inputs[2].location != 4) {
+        fmt::print("dvec3 array input: wrong locations\n");
+        ++failures;
+    }
+
+    // A vector without its component count
+    code = module({ op(22, { 1, 32 }), op(23, { 2, 1 }) });
+    try {
+        spirv_reflection(code.data(), code.size());
+        fmt::print("truncated vector: not rejected\n");
+        ++failures;
+    } catch (const vk_exception &) {
+    }
+    return failures;
+}
+
+int main(int argc, char **argv)
+{
+    std::string dir = argc > 1 ? argv[1] : ".";
+
+    const expected_shader shaders[] = {
+        { "vert.spv", { { 0, 0, VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, 1 } }, { 0, 0 } },
+        { "frag.spv", {}, { 0, 0 } },
+        // vec2 size
+        { "vert-ui.spv", {}, { 0, 8 } },
+        { "frag-ui.spv", { { 0, 0, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, 1 } }, { 0, 0 } },
+        // mat4 matrix, uint size
+        { "vert-bench.spv", { { 0, 0, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1 } }, { 0, 68 } },
+        // The runtime array of the bindless set, plus uint draw
+        { "vert-bench-bindless.spv", { { 0, 1, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 0 } }, { 0, 72 } },
+    };
+
+    int failures = check_crafted();
+    for (const expected_shader &s: shaders) {
+        try {
+            failures += check(dir, s);
+        } catch (const vk_exception &e) {
+            fmt::print("{}: {}", s.file, e.what());
+            ++failures;
+        }
+    }
+    if (failures) {
+        fmt::print("{} reflection checks failed\n", failures);
+        return 1;
+    }
+    fmt::print("All {} shaders reflected as expected\n", sizeof(shaders) / sizeof(shaders[0]));
+    return 0;
+}
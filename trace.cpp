@@ -0,0 +1,175 @@
+
+#include <stdio.h>
+
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <vector>
+
+#include "trace.h"
+#include "format.h"
+
+namespace {
+
+struct event {
+    const char *name;
+    uint64_t begin;
+    uint64_t end;
+};
+
+// A ring, once full the oldest zones are overwritten so that a dump always
+// has the most recent ones
+struct thread_buffer {
+    static const size_t capacity = 1 << 16;
+
+    thread_buffer(uint32_t id, const std::string &n)
+        : tid(id)
+        , name(n)
+        , events(new event[capacity])
+        , count(0)
+    {}
+
+    uint32_t tid;
+    std::string name;
+    std::unique_ptr<event[]> events;
+    // Zones ever appended, the ring holds the last capacity of them
+    std::atomic<uint64_t> count;
+};
+
+// Buffers are never freed, so that the zones of threads which exited are
+// still part of the dump.
+struct registry {
+    registry() : gpu(0, "gpu") {}
+
+    std::mutex mutex;
+    std::vector<std::unique_ptr<thread_buffer>> buffers;
+    thread_buffer gpu;
+    std::set<std::string> gpu_names;
+};
+
+registry &get_registry()
+{
+    static registry r;
+    return r;
+}
+
+thread_buffer &get_thread_buffer()
+{
+    thread_local thread_buffer *buffer = nullptr;
+    if (!buffer) {
+        registry &r = get_registry();
+        std::lock_guard<std::mutex> lock(r.mutex);
+        uint32_t id = r.buffers.size() + 1;
+        r.buffers.push_back(std::make_unique<thread_buffer>(id, fmt::format("thread {}", id)));
+        buffer = r.buffers.back().get();
+    }
+    return *buffer;
+}
+
+static_assert((thread_buffer::capacity & (thread_buffer::capacity - 1)) == 0, "The ring capacity must be a power of two");
+
+// Only the owning thread appends, so the count is the only synchronization
+// needed with dump().
+void append(thread_buffer &b, const char *name, uint64_t begin, uint64_t end)
+{
+    uint64_t n = b.count.load(std::memory_order_relaxed);
+    b.events[n & (thread_buffer::capacity - 1)] = { name, begin, end };
+    b.count.store(n + 1, std::memory_order_release);
+}
+
+// The owner may keep appending while the ring is copied, so whatever it could
+// have overwritten in the meantime is left out
+std::vector<event> copy_events(const thread_buffer &b, uint64_t &overwritten)
+{
+    uint64_t end = b.count.load(std::memory_order_acquire);
+    uint64_t begin = end > thread_buffer::capacity ? end - thread_buffer::capacity : 0;
+    std::vector<event> events;
+    events.reserve(end - begin);
+    for (uint64_t i = begin; i < end; ++i) {
+        events.push_back(b.events[i & (thread_buffer::capacity - 1)]);
+    }
+
+    // The slot of zone n + 1 may be being written while count is still n
+    std::atomic_thread_fence(std::memory_order_acquire);
+    uint64_t now = b.count.load(std::memory_order_relaxed) + 1;
+    uint64_t valid = now > thread_buffer::capacity ? now - thread_buffer::capacity : 0;
+    if (valid > begin) {
+        events.erase(events.begin(), events.begin() + std::min(valid - begin, (uint64_t)events.size()));
+        begin = valid;
+    }
+    overwritten = std::min(begin, end);
+    return events;
+}
+
+std::string escape(const std::string &str)
+{
+    std::string out;
+    for (char c: str) {
+        if (c == '"' || c == '\\') {
+            out += '\\';
+        }
+        out += c;
+    }
+    return out;
+}
+
+void write_buffer(FILE *f, const thread_buffer &b, bool &first)
+{
+    fmt::print(f, "{}{{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":{},\"args\":{{\"name\":\"{}\"}}}}", first ? "" : ",\n", b.tid, escape(b.name));
+    first = false;
+
+    uint64_t overwritten;
+    auto events = copy_events(b, overwritten);
+    if (overwritten) {
+        fmt::print(f, ",\n{{\"name\":\"{} older zones overwritten\",\"ph\":\"i\",\"s\":\"t\",\"pid\":1,\"tid\":{},\"ts\":{:.3f}}}",
+                   overwritten, b.tid, events.empty() ? 0. : events.front().begin / 1.e3);
+    }
+    for (const event &e: events) {
+        fmt::print(f, ",\n{{\"name\":\"{}\",\"ph\":\"X\",\"pid\":1,\"tid\":{},\"ts\":{:.3f},\"dur\":{:.3f}}}",
+                   escape(e.name), b.tid, e.begin / 1.e3, (e.end - e.begin) / 1.e3);
+    }
+}
+
+}
+
+void trace::add_cpu_zone(const char *name, uint64_t begin, uint64_t end)
+{
+    append(get_thread_buffer(), name, begin, end);
+}
+
+void trace::add_gpu_zone(const std::string &name, uint64_t begin, uint64_t end)
+{
+    registry &r = get_registry();
+    std::lock_guard<std::mutex> lock(r.mutex);
+    append(r.gpu, r.gpu_names.insert(name).first->c_str(), begin, end);
+}
+
+void trace::set_thread_name(const std::string &name)
+{
+    thread_buffer &b = get_thread_buffer();
+    std::lock_guard<std::mutex> lock(get_registry().mutex);
+    b.name = name;
+}
+
+bool trace::dump(const char *path)
+{
+    FILE *f = fopen(path, "w");
+    if (!f) {
+        return false;
+    }
+
+    registry &r = get_registry();
+    std::lock_guard<std::mutex> lock(r.mutex);
+
+    bool first = true;
+    fmt::print(f, "{{\"traceEvents\":[\n");
+    for (const auto &b: r.buffers) {
+        write_buffer(f, *b, first);
+    }
+    write_buffer(f, r.gpu, first);
+    fmt::print(f, "\n]}}\n");
+
+    return fclose(f) == 0;
+}
@@ -0,0 +1,46 @@
+
+#pragma once
+
+#include <stdint.h>
+
+#include <chrono>
+#include <string>
+
+class trace
+{
+public:
+    class zone
+    {
+    public:
+        // name must be a string literal
+        explicit zone(const char *name) : m_name(name), m_begin(now()) {}
+        zone(const zone &) = delete;
+        ~zone() { add_cpu_zone(m_name, m_begin, now()); }
+
+    private:
+        const char *m_name;
+        uint64_t m_begin;
+    };
+
+    static uint64_t now()
+    {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    // Times are in the now() clock. Zones of a thread are written into a
+    // buffer owned by that thread, without locking.
+    static void add_cpu_zone(const char *name, uint64_t begin, uint64_t end);
+    static void add_gpu_zone(const std::string &name, uint64_t begin, uint64_t end);
+    static void set_thread_name(const std::string &name);
+
+    // Writes everything recorded so far as Chrome trace event JSON
+    static bool dump(const char *path);
+};
+
+#ifdef ENABLE_TRACING
+#define TRACE_CONCAT_(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_(a, b)
+#define TRACE_ZONE(name) trace::zone TRACE_CONCAT(trace_zone_, __LINE__)(name)
+#else
+#define TRACE_ZONE(name) do { } while (0)
+#endif
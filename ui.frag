@@ -1,7 +1,21 @@
-#version 400
+#version 450
 #extension GL_ARB_separate_shader_objects : enable
+
+// Glyph i takes the texels from i * 5 to i * 5 + 4 of each row
+layout (set = 0, binding = 0) uniform sampler2D atlas;
+
+layout (location = 0) in vec2 uv;
+layout (location = 1) flat in uint glyph;
+layout (location = 2) in vec4 color;
+
 layout (location = 0) out vec4 uFragColor;
 
 void main() {
-   uFragColor = vec4(0.8,0.0,0.8,0.6);
+    if (glyph != 0) {
+        ivec2 cell = min(ivec2(uv * vec2(5, 7)), ivec2(4, 6));
+        if (texelFetch(atlas, ivec2(int(glyph) * 5 + cell.x, cell.y), 0).r < 0.5) {
+            discard;
+        }
+    }
+    uFragColor = color;
 }
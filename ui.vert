@@ -1,14 +1,25 @@
-#version 400
+#version 450
 #extension GL_ARB_separate_shader_objects : enable
 #extension GL_ARB_shading_language_420pack : enable
 
-const vec3 vertices[] = {
-    vec3( 0, -1.0, 0),
-    vec3(-1, -1.0, 0),
-    vec3( 0, -0.5, 0),
-    vec3(-1, -0.5, 0),
-};
+layout (location = 0) in vec4 rect;
+layout (location = 1) in uint glyph;
+layout (location = 2) in vec4 color;
+
+layout (push_constant) uniform screen_block {
+    vec2 size;
+} screen;
+
+layout (location = 0) out vec2 uv;
+layout (location = 1) flat out uint out_glyph;
+layout (location = 2) out vec4 out_color;
 
 void main() {
-    gl_Position = vec4(vertices[gl_VertexIndex], 1) ;
+    vec2 corner = vec2(gl_VertexIndex & 1, gl_VertexIndex >> 1);
+    vec2 p = rect.xy + corner * rect.zw;
+
+    uv = corner;
+    out_glyph = glyph;
+    out_color = color;
+    gl_Position = vec4(p / screen.size * 2 - 1, 0, 1);
 }
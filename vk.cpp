@@ -1,5 +1,18 @@
 
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <atomic>
+#include <map>
+#include <tuple>
+#include <unordered_map>
+
 #include "vk.h"
+#include "spirv.h"
+#include "log.h"
 
 using std::string;
 using std::weak_ptr;
@@ -8,9 +21,24 @@ using std::unique_ptr;
 using std::make_unique;
 using std::make_shared;
 using std::vector;
-using fmt::print;
 
 
+static bool is_instance_extension_available(stringview name)
+{
+    uint32_t count = 0;
+    vkEnumerateInstanceExtensionProperties(nullptr, &count, nullptr);
+    auto props = vector<VkExtensionProperties>(count);
+    if (vkEnumerateInstanceExtensionProperties(nullptr, &count, props.data()) != VK_SUCCESS) {
+        return false;
+    }
+    for (const VkExtensionProperties &p: props) {
+        if (name == p.extensionName) {
+            return true;
+        }
+    }
+    return false;
+}
+
 vk_instance::vk_instance(const vector<string> &layer_names, const vector<string> &extension_names)
 {
     vector<const char *> layers(layer_names.size());
@@ -22,6 +50,13 @@ vk_instance::vk_instance(const vector<string> &layer_names, const vector<string>
     for (size_t i = 0; i < extension_names.size(); ++i) {
         extensions[i] = extension_names[i].data();
     }
+    // Required by the optional device extensions on a 1.0 instance
+    auto props2 = stringview(VK_KHR_GET_PHYSICAL_DEVICE_PROPERTIES_2_EXTENSION_NAME);
+    bool has_props2 = std::find(extension_names.begin(), extension_names.end(), props2) != extension_names.end();
+    if (!has_props2 && is_instance_extension_available(props2)) {
+        extensions.push_back(VK_KHR_GET_PHYSICAL_DEVICE_PROPERTIES_2_EXTENSION_NAME);
+        has_props2 = true;
+    }
 
     VkApplicationInfo app_info = {
         VK_STRUCTURE_TYPE_APPLICATION_INFO, nullptr,
@@ -45,15 +80,22 @@ vk_instance::vk_instance(const vector<string> &layer_names, const vector<string>
     auto devices = vector<VkPhysicalDevice>(count);
     vkEnumeratePhysicalDevices(m_instance, &count, devices.data());
 
+    PFN_vkGetPhysicalDeviceFeatures2KHR get_features2 = nullptr;
+    PFN_vkGetPhysicalDeviceProperties2KHR get_properties2 = nullptr;
+    if (has_props2) {
+        get_features2 = (PFN_vkGetPhysicalDeviceFeatures2KHR)vkGetInstanceProcAddr(m_instance, "vkGetPhysicalDeviceFeatures2KHR");
+        get_properties2 = (PFN_vkGetPhysicalDeviceProperties2KHR)vkGetInstanceProcAddr(m_instance, "vkGetPhysicalDeviceProperties2KHR");
+    }
+
     m_physical_devices.resize(count);
     for (uint32_t i = 0; i < count; ++i) {
-        m_physical_devices.at(i).set(devices.at(i));
+        m_physical_devices.at(i).set(devices.at(i), get_features2, get_properties2);
     }
 
-    print("Found {} physical devices:\n", count);
+    log_info("Found {} physical devices:\n", count);
     int i = 0;
     for (vk_physical_device &dev: m_physical_devices) {
-        print("{}: vendor id {}, device name {}\n", i, dev.get_vendor_id(), dev.get_device_name());
+        log_info("{}: vendor id {}, device name {}\n", i++, dev.get_vendor_id(), dev.get_device_name());
     }
 }
 
@@ -61,7 +103,7 @@ vk_instance::vk_instance(vk_instance &&i)
            : m_instance(i.m_instance)
            , m_physical_devices(std::move(i.m_physical_devices))
 {
-    fmt::print("!!! MOVE instance !!!\n");
+    log_debug("!!! MOVE instance !!!\n");
 }
 
 
@@ -110,12 +152,19 @@ vk_command_buffer::vk_command_buffer(VkCommandBuffer buf)
 {
 }
 
+vk_command_buffer::vk_command_buffer(vk_command_buffer &&b)
+                 : m_handle(b.m_handle)
+{
+    b.m_handle = VK_NULL_HANDLE;
+}
+
+// Every command buffer is recorded again before being submitted
 void vk_command_buffer::begin()
 {
     VkCommandBufferBeginInfo info = {
         VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO, //type
         nullptr, //next
-        0, //flags
+        VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT, //flags
         nullptr, //inheritance info
     };
     VkResult res = vkBeginCommandBuffer(m_handle, &info);
@@ -156,15 +205,103 @@ vk_command_buffer vk_command_pool::create_command_buffer()
     return vk_command_buffer(cmd_buf);
 }
 
+//--
+
+vk_frame_command_pool::vk_frame_command_pool(const vk_device &device, vk_device::queue_role role)
+                     : m_device(device)
+                     , m_used(0)
+{
+    VkCommandPoolCreateInfo info = {
+        VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO, //type
+        nullptr, //next
+        VK_COMMAND_POOL_CREATE_TRANSIENT_BIT, //flags
+        device.get_queue_family_index(role), //queue family index
+    };
+    VkResult res = vkCreateCommandPool(device.get_handle(), &info, nullptr, &m_handle);
+    if (res != VK_SUCCESS) {
+        throw vk_exception("Failed to create command pool: {}\n", res);
+    }
+}
+
+vk_frame_command_pool::~vk_frame_command_pool()
+{
+    vkDestroyCommandPool(m_device.get_handle(), m_handle, nullptr);
+}
+
+vk_command_buffer vk_frame_command_pool::get_command_buffer()
+{
+    static const uint32_t batch_size = 4;
+
+    if (m_used == m_command_buffers.size()) {
+        VkCommandBufferAllocateInfo info = {
+            VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO, //type
+            nullptr, //next
+            m_handle, //command pool
+            VK_COMMAND_BUFFER_LEVEL_PRIMARY, //level
+            batch_size, //cmd buffer count
+        };
+        m_command_buffers.resize(m_used + batch_size);
+        VkResult res = vkAllocateCommandBuffers(m_device.get_handle(), &info, m_command_buffers.data() + m_used);
+        if (res != VK_SUCCESS) {
+            m_command_buffers.resize(m_used);
+            throw vk_exception("Failed to allocate command buffers: {}\n", res);
+        }
+    }
+    return vk_command_buffer(m_command_buffers[m_used++]);
+}
+
+void vk_frame_command_pool::reset()
+{
+    if (m_used == 0) {
+        return;
+    }
+    VkResult res = vkResetCommandPool(m_device.get_handle(), m_handle, 0);
+    if (res != VK_SUCCESS) {
+        throw vk_exception("Failed to reset command pool: {}\n", res);
+    }
+    m_used = 0;
+}
+
+//--
+
+
+class vk_shader_cache
+{
+public:
+    std::shared_ptr<const vk_shader_module::state> load(const vk_device &device, vk_shader_module::stage s, stringview file);
+
+private:
+    using key = std::tuple<uint64_t, size_t, int>;
+
+    std::shared_ptr<const vk_shader_module::state> find(const key &k, const std::vector<char> &code) const;
+
+    struct file_info {
+        timespec mtime;
+        off_t size;
+        // Made from the contents the file had at mtime
+        std::weak_ptr<const vk_shader_module::state> module;
+    };
+    // The hash only narrows the search, a hit must have the same code
+    struct module_info {
+        std::vector<char> code;
+        std::weak_ptr<const vk_shader_module::state> state;
+    };
+    std::unordered_map<std::string, file_info> m_files;
+    std::multimap<key, module_info> m_modules;
+};
+
+
 //--
 
 
 struct vk_device::data {
-    data(const vk_physical_device &dev, VkDevice h, uint32_t qfi, const std::vector<std::string> &exts)
+    data(const vk_physical_device &dev, VkDevice h, const std::array<queue_location, 3> &q, const std::vector<std::string> &exts)
         : handle(h)
         , extensions(exts)
         , physical_device(dev)
-        , queue_family_index(qfi)
+        , queues(q)
+        , shader_cache(std::make_unique<vk_shader_cache>())
+        , allocated_memory(0)
     {}
     ~data()
     {
@@ -174,30 +311,39 @@ struct vk_device::data {
     VkDevice handle;
     std::vector<std::string> extensions;
     const vk_physical_device &physical_device;
-    uint32_t queue_family_index;
+    // Indexed by queue_role
+    std::array<queue_location, 3> queues;
+    std::unique_ptr<vk_shader_cache> shader_cache;
+    mutable std::atomic<uint64_t> allocated_memory;
 };
 
 vk_device::vk_device()
 {
 }
 
-vk_device::vk_device(const vk_physical_device &phys, VkDevice handle, uint32_t qfi, const std::vector<std::string> &exts)
-         : m_data(std::make_shared<data>(phys, handle, qfi, exts))
+vk_device::vk_device(const vk_physical_device &phys, VkDevice handle, const std::array<queue_location, 3> &queues, const std::vector<std::string> &exts)
+         : m_data(std::make_shared<data>(phys, handle, queues, exts))
 {
 }
 
-vk_queue vk_device::get_queue(uint32_t index) const
+vk_queue vk_device::get_queue(queue_role role) const
 {
+    const queue_location &q = m_data->queues[(int)role];
     VkQueue queue;
-    vkGetDeviceQueue(m_data->handle, m_data->queue_family_index, index, &queue);
-    return vk_queue(queue, m_data->queue_family_index, index);
+    vkGetDeviceQueue(m_data->handle, q.family, q.index, &queue);
+    return vk_queue(queue, q.family, q.index);
 }
 
-vk_command_pool vk_device::create_command_pool() const
+uint32_t vk_device::get_queue_family_index(queue_role role) const
+{
+    return m_data->queues[(int)role].family;
+}
+
+vk_command_pool vk_device::create_command_pool(queue_role role) const
 {
     VkCommandPoolCreateInfo command_pool_info = {
-        VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO, nullptr, VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT,
-        m_data->queue_family_index, //queue family index
+        VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO, nullptr, 0,
+        get_queue_family_index(role), //queue family index
     };
     VkCommandPool cmd_pool;
     VkResult res = vkCreateCommandPool(get_handle(), &command_pool_info, nullptr, &cmd_pool);
@@ -207,6 +353,11 @@ vk_command_pool vk_device::create_command_pool() const
     return vk_command_pool(*this, cmd_pool);
 }
 
+bool vk_device::supports_bindless() const
+{
+    return is_extension_enabled(VK_EXT_DESCRIPTOR_INDEXING_EXTENSION_NAME);
+}
+
 bool vk_device::is_extension_enabled(stringview extension) const
 {
     for (const string &ext: m_data->extensions) {
@@ -222,6 +373,11 @@ const vk_physical_device &vk_device::get_physical_device() const
     return m_data->physical_device;
 }
 
+uint64_t vk_device::get_allocated_memory() const
+{
+    return m_data->allocated_memory;
+}
+
 VkDevice vk_device::get_handle() const
 {
     return m_data->handle;
@@ -250,35 +406,132 @@ uint32_t vk_queue_family_properties::queue_count() const
     return m_handle.queueCount;
 }
 
+uint32_t vk_queue_family_properties::timestamp_valid_bits() const
+{
+    return m_handle.timestampValidBits;
+}
+
 //--
 
 vk_physical_device::vk_physical_device()
 {
 }
 
-vk_device vk_physical_device::do_create_device(uint32_t queue_family_index, const std::vector<std::string> &extension_names)
-{
-    float queue_priorities[1] = { 0.0 };
-    VkDeviceQueueCreateInfo queue_info = {
-        VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO, //type
+vk_device vk_physical_device::do_create_device(uint32_t graphics_family, const vk_queue_priorities &priorities,
+                                               const std::vector<std::string> &extension_names) const
+{
+    // Compute wants a family without graphics so that it runs asynchronously,
+    // transfer one with neither, usually backed by a DMA engine. Graphics and
+    // compute families can always do transfers too.
+    int compute_family = -1, transfer_family = -1;
+    for (size_t i = 0; i < m_queue_properties.size(); ++i) {
+        const vk_queue_family_properties &f = m_queue_properties[i];
+        if (f.is_graphics_capable()) {
+            continue;
+        }
+        if (f.is_compute_capable() && compute_family < 0) {
+            compute_family = i;
+        } else if (!f.is_compute_capable() && f.is_transfer_capable() && transfer_family < 0) {
+            transfer_family = i;
+        }
+    }
+    if (compute_family < 0) {
+        compute_family = graphics_family;
+    }
+    if (transfer_family < 0) {
+        transfer_family = compute_family;
+    }
+
+    // Roles sharing a family get their own queue while the family has enough
+    auto family_priorities = vector<vector<float>>(m_queue_properties.size());
+    auto add_queue = [&](uint32_t family, float priority) {
+        vector<float> &p = family_priorities[family];
+        if (p.size() < m_queue_properties[family].queue_count()) {
+            p.push_back(priority);
+        } else {
+            p.back() = std::max(p.back(), priority);
+        }
+        return vk_device::queue_location{ family, (uint32_t)p.size() - 1 };
+    };
+    std::array<vk_device::queue_location, 3> queues = { {
+        add_queue(graphics_family, priorities.graphics),
+        add_queue(compute_family, priorities.compute),
+        add_queue(transfer_family, priorities.transfer),
+    } };
+
+    vector<VkDeviceQueueCreateInfo> queue_infos;
+    for (size_t i = 0; i < family_priorities.size(); ++i) {
+        if (family_priorities[i].empty()) {
+            continue;
+        }
+        queue_infos.push_back({
+            VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO, //type
+            nullptr, //next
+            0, //flags
+            (uint32_t)i, //queue family index
+            (uint32_t)family_priorities[i].size(), //queue count
+            family_priorities[i].data(), //queue priorities
+        });
+    }
+    log_info("queues: graphics {}.{}, compute {}.{}, transfer {}.{}\n", queues[0].family, queues[0].index,
+             queues[1].family, queues[1].index, queues[2].family, queues[2].index);
+
+    // Extensions the wrappers make use of when the device has them
+    static const char *const optional_extensions[] = {
+        VK_KHR_TIMELINE_SEMAPHORE_EXTENSION_NAME,
+    };
+    vector<string> enabled = extension_names;
+    auto enable = [&enabled](const char *ext) {
+        if (std::find(enabled.begin(), enabled.end(), stringview(ext)) == enabled.end()) {
+            enabled.push_back(ext);
+        }
+    };
+    for (const char *ext: optional_extensions) {
+        if (has_extension(ext)) {
+            enable(ext);
+        }
+    }
+    // Only the features vk_bindless_set needs, and only if the device has all of them
+    bool bindless = supports_bindless();
+    if (bindless) {
+        enable(VK_KHR_MAINTENANCE3_EXTENSION_NAME);
+        enable(VK_EXT_DESCRIPTOR_INDEXING_EXTENSION_NAME);
+    }
+
+    // Every device exposing the extension supports the feature
+    VkPhysicalDeviceTimelineSemaphoreFeaturesKHR timeline_features = {
+        VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_TIMELINE_SEMAPHORE_FEATURES_KHR, //type
         nullptr, //next
-        0, //flags
-        (uint32_t)queue_family_index, //queue family index
-        1, //queue count
-        queue_priorities, //queue properties
+        VK_TRUE, //timeline semaphore
     };
+    void *features = nullptr;
+    if (std::find(enabled.begin(), enabled.end(), stringview(VK_KHR_TIMELINE_SEMAPHORE_EXTENSION_NAME)) != enabled.end()) {
+        features = &timeline_features;
+    }
+    VkPhysicalDeviceDescriptorIndexingFeaturesEXT indexing_features = {};
+    if (bindless) {
+        indexing_features.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_DESCRIPTOR_INDEXING_FEATURES_EXT;
+        indexing_features.pNext = features;
+        indexing_features.shaderSampledImageArrayNonUniformIndexing = VK_TRUE;
+        indexing_features.descriptorBindingSampledImageUpdateAfterBind = VK_TRUE;
+        indexing_features.descriptorBindingStorageBufferUpdateAfterBind = VK_TRUE;
+        indexing_features.descriptorBindingPartiallyBound = VK_TRUE;
+        indexing_features.runtimeDescriptorArray = VK_TRUE;
+        features = &indexing_features;
+    }
+
     vector<const char *> layers = {  };
-    vector<const char *> extensions(extension_names.size());
-    for (size_t i = 0; i < extension_names.size(); ++i) {
-        extensions[i] = extension_names[i].data();
+    vector<const char *> extensions(enabled.size());
+    for (size_t i = 0; i < enabled.size(); ++i) {
+        extensions[i] = enabled[i].data();
     }
 
     VkDeviceCreateInfo dev_info = {
         VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO, //type
-        nullptr, //next
+        features, //next
         0, //flags
-        1, //queue create info count
-        &queue_info, //queue create info
+        (uint32_t)queue_infos.size(), //queue create info count
+        queue_infos.data(), //queue create info
         (uint32_t)layers.size(), //layers count
         layers.data(), //layers names
         (uint32_t)extensions.size(), //extensions count
@@ -292,10 +545,10 @@ vk_device vk_physical_device::do_create_device(uint32_t queue_family_index, cons
         throw vk_exception("Failed to create a Vulkan device: {}\n", res);
     }
 
-    return vk_device(*this, dev, queue_family_index, extension_names);
+    return vk_device(*this, dev, queues, enabled);
 }
 
-void vk_physical_device::set(VkPhysicalDevice dev)
+void vk_physical_device::set(VkPhysicalDevice dev, PFN_vkGetPhysicalDeviceFeatures2KHR get_features2, PFN_vkGetPhysicalDeviceProperties2KHR get_properties2)
 {
     m_handle = dev;
     vkGetPhysicalDeviceProperties(dev, &m_props);
@@ -305,6 +558,64 @@ void vk_physical_device::set(VkPhysicalDevice dev)
     vkGetPhysicalDeviceQueueFamilyProperties(dev, &count, nullptr);
     m_queue_properties.resize(count);
     vkGetPhysicalDeviceQueueFamilyProperties(dev, &count, (VkQueueFamilyProperties *)m_queue_properties.data());
+
+    VkResult res = vkEnumerateDeviceExtensionProperties(dev, nullptr, &count, nullptr);
+    if (res == VK_SUCCESS) {
+        m_extensions.resize(count);
+        res = vkEnumerateDeviceExtensionProperties(dev, nullptr, &count, m_extensions.data());
+    }
+    if (res != VK_SUCCESS) {
+        throw vk_exception("Failed to enumerate the device extensions: {}\n", res);
+    }
+
+    m_indexing_features = {};
+    m_indexing_features.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_DESCRIPTOR_INDEXING_FEATURES_EXT;
+    if (get_features2 && has_extension(VK_EXT_DESCRIPTOR_INDEXING_EXTENSION_NAME)) {
+        VkPhysicalDeviceFeatures2KHR features = {
+            VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2_KHR, //type
+            &m_indexing_features, //next
+        };
+        get_features2(dev, &features);
+    }
+
+    m_indexing_properties = {};
+    m_indexing_properties.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_DESCRIPTOR_INDEXING_PROPERTIES_EXT;
+    if (get_properties2 && has_extension(VK_EXT_DESCRIPTOR_INDEXING_EXTENSION_NAME)) {
+        VkPhysicalDeviceProperties2KHR properties = {
+            VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PROPERTIES_2_KHR, //type
+            &m_indexing_properties, //next
+        };
+        get_properties2(dev, &properties);
+    }
+}
+
+bool vk_physical_device::supports_bindless() const
+{
+    const auto &f = m_indexing_features;
+    return has_extension(VK_KHR_MAINTENANCE3_EXTENSION_NAME) && f.runtimeDescriptorArray && f.descriptorBindingPartiallyBound &&
+           f.shaderSampledImageArrayNonUniformIndexing && f.descriptorBindingSampledImageUpdateAfterBind &&
+           f.descriptorBindingStorageBufferUpdateAfterBind;
+}
+
+bool vk_physical_device::has_extension(stringview name) const
+{
+    for (const VkExtensionProperties &ext: m_extensions) {
+        if (name == ext.extensionName) {
+            return true;
+        }
+    }
+    return false;
+}
+
+uint64_t vk_physical_device::get_device_local_memory() const
+{
+    uint64_t size = 0;
+    for (uint32_t i = 0; i < m_memprops.memoryHeapCount; ++i) {
+        if (m_memprops.memoryHeaps[i].flags & VK_MEMORY_HEAP_DEVICE_LOCAL_BIT) {
+            size = std::max<uint64_t>(size, m_memprops.memoryHeaps[i].size);
+        }
+    }
+    return size;
 }
 
 uint32_t vk_physical_device::get_memory_types_count() const
@@ -317,6 +628,141 @@ VkMemoryType vk_physical_device::get_memory_type(uint32_t index) const
     return m_memprops.memoryTypes[index];
 }
 
+VkSampleCountFlags vk_physical_device::get_framebuffer_sample_counts() const
+{
+    return m_props.limits.framebufferColorSampleCounts & m_props.limits.framebufferDepthSampleCounts;
+}
+
+VkSampleCountFlagBits vk_physical_device::get_max_sample_count(VkSampleCountFlagBits wanted) const
+{
+    VkSampleCountFlags counts = get_framebuffer_sample_counts();
+    for (uint32_t s = wanted; s > VK_SAMPLE_COUNT_1_BIT; s >>= 1) {
+        if (counts & s) {
+            return (VkSampleCountFlagBits)s;
+        }
+    }
+    return VK_SAMPLE_COUNT_1_BIT;
+}
+
+//--
+
+vk_device_selector::vk_device_selector(const vk_instance &instance)
+                  : m_instance(instance)
+{
+}
+
+void vk_device_selector::require_extension(stringview name)
+{
+    m_extensions.push_back(name.to_string());
+}
+
+void vk_device_selector::require_present(const present_func &func)
+{
+    m_present = func;
+}
+
+void vk_device_selector::set_override(stringview device)
+{
+    m_override = device.to_string();
+}
+
+const vk_physical_device &vk_device_selector::select() const
+{
+    const auto &devices = m_instance.get_physical_devices();
+
+    if (!m_override.empty()) {
+        char *end;
+        size_t index = strtoul(m_override.c_str(), &end, 10);
+        for (size_t i = 0; i < devices.size(); ++i) {
+            const vk_physical_device &dev = devices[i];
+            bool match = *end ? dev.get_device_name().to_string().find(m_override) != string::npos : i == index;
+            if (!match) {
+                continue;
+            }
+            if (!is_suitable(dev)) {
+                throw vk_exception("The requested device '{}' is not suitable.\n", dev.get_device_name());
+            }
+            log_info("Using the requested device {}\n", dev.get_device_name());
+            return dev;
+        }
+        throw vk_exception("No device matches '{}'.\n", m_override);
+    }
+
+    const vk_physical_device *best = nullptr;
+    uint64_t best_score = 0;
+    for (const vk_physical_device &dev: devices) {
+        if (!is_suitable(dev)) {
+            continue;
+        }
+        uint64_t s = score(dev);
+        log_debug("device {} scores {:#x}\n", dev.get_device_name(), s);
+        if (!best || s > best_score) {
+            best = &dev;
+            best_score = s;
+        }
+    }
+    if (!best) {
+        throw vk_exception("None of the {} devices is suitable.\n", devices.size());
+    }
+    log_info("Selected device {}\n", best->get_device_name());
+    return *best;
+}
+
+int vk_device_selector::find_queue_family(const vk_physical_device &dev) const
+{
+    const auto &families = dev.get_queue_family_properties();
+    for (size_t i = 0; i < families.size(); ++i) {
+        if (families[i].is_graphics_capable() && (!m_present || m_present(dev, i))) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// The device type in the top byte, the device local megabytes in the middle
+// and the dedicated queue families in the low byte
+uint64_t vk_device_selector::score(const vk_physical_device &dev)
+{
+    uint64_t type = 0;
+    switch (dev.get_type()) {
+    case VK_PHYSICAL_DEVICE_TYPE_DISCRETE_GPU:
+        type = 4;
+        break;
+    case VK_PHYSICAL_DEVICE_TYPE_INTEGRATED_GPU:
+        type = 3;
+        break;
+    case VK_PHYSICAL_DEVICE_TYPE_VIRTUAL_GPU:
+        type = 2;
+        break;
+    case VK_PHYSICAL_DEVICE_TYPE_CPU:
+        type = 1;
+        break;
+    default:
+        break;
+    }
+
+    uint64_t families = 0;
+    for (const vk_queue_family_properties &f: dev.get_queue_family_properties()) {
+        if (!f.is_graphics_capable() && (f.is_compute_capable() || f.is_transfer_capable())) {
+            ++families;
+        }
+    }
+
+    uint64_t memory = std::min<uint64_t>(dev.get_device_local_memory() >> 20, (1ull << 48) - 1);
+    return type << 56 | memory << 8 | std::min<uint64_t>(families, 255);
+}
+
+bool vk_device_selector::is_suitable(const vk_physical_device &dev) const
+{
+    for (const string &ext: m_extensions) {
+        if (!dev.has_extension(ext)) {
+            log_debug("device {} lacks {}\n", dev.get_device_name(), ext);
+            return false;
+        }
+    }
+    return find_queue_family(dev) >= 0;
+}
+
 
 //--
 
@@ -341,7 +787,7 @@ vk_surface::vk_surface(vk_surface &&s)
           , m_window(s.m_window)
           , m_handle(s.m_handle)
 {
-    fmt::print("!!! MOVE surf !!!!\n");
+    log_debug("!!! MOVE surf !!!!\n");
 }
 
 vk_surface::~vk_surface()
@@ -349,7 +795,7 @@ vk_surface::~vk_surface()
     vkDestroySurfaceKHR(m_instance.get_handle(), m_handle, nullptr);
 }
 
-bool vk_surface::supports_present(vk_physical_device *device, int queue_family) const
+bool vk_surface::supports_present(const vk_physical_device *device, int queue_family) const
 {
     VkBool32 supports_present = false;
     if (vkGetPhysicalDeviceSurfaceSupportKHR(device->get_handle(), queue_family, m_handle, &supports_present) == VK_SUCCESS) {
@@ -358,7 +804,7 @@ bool vk_surface::supports_present(vk_physical_device *device, int queue_family)
     return false;
 }
 
-std::vector<VkSurfaceFormatKHR> vk_surface::get_formats(vk_physical_device *dev) const
+std::vector<VkSurfaceFormatKHR> vk_surface::get_formats(const vk_physical_device *dev) const
 {
     uint32_t format_count;
     VkResult res = vkGetPhysicalDeviceSurfaceFormatsKHR(dev->get_handle(), m_handle, &format_count, nullptr);
@@ -413,19 +859,31 @@ vk_image::vk_image(const vk_device &device, VkImage img, const VkExtent3D &exten
         : m_device(device)
         , m_handle(img)
         , m_extent(extent)
+        , m_mip_levels(1)
+        , m_array_layers(1)
         , m_owns_handle(false)
         , m_type(type::t2D)
         , m_format(VK_FORMAT_B8G8R8A8_SRGB)
+        , m_samples(VK_SAMPLE_COUNT_1_BIT)
 {
     vkGetImageMemoryRequirements(device.get_handle(), img, &m_mem_reqs);
 }
 
-vk_image::vk_image(const vk_device &device, VkFormat format, usage u, type t, const VkExtent3D &extent)
+vk_image::vk_image(const vk_device &device, VkFormat format, usage u, type t, const VkExtent3D &extent, VkSampleCountFlagBits samples)
+        : vk_image(device, format, u, t, extent, 1, 1, samples)
+{
+}
+
+vk_image::vk_image(const vk_device &device, VkFormat format, usage u, type t, const VkExtent3D &extent, uint32_t mip_levels, uint32_t array_layers,
+                   VkSampleCountFlagBits samples)
         : m_device(device)
         , m_extent(extent)
+        , m_mip_levels(mip_levels)
+        , m_array_layers(array_layers)
         , m_owns_handle(true)
         , m_type(t)
         , m_format(format)
+        , m_samples(samples)
 {
     const VkImageCreateInfo image_info = {
         VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO, //type
@@ -434,9 +892,9 @@ vk_image::vk_image(const vk_device &device, VkFormat format, usage u, type t, co
         (VkImageType)t, //image type
         format, //format
         extent, //extent
-        1, //mip levels
-        1, //array layers
-        VK_SAMPLE_COUNT_1_BIT, //samples
+        mip_levels, //mip levels
+        array_layers, //array layers
+        samples, //samples
         VK_IMAGE_TILING_OPTIMAL, //tiling
         (VkImageUsageFlagBits)u, //usage
         VK_SHARING_MODE_EXCLUSIVE, //sharing mode
@@ -459,6 +917,21 @@ vk_image::~vk_image()
     }
 }
 
+VkExtent3D vk_image::get_mip_extent(uint32_t level) const
+{
+    return { std::max(m_extent.width >> level, 1u), std::max(m_extent.height >> level, 1u), std::max(m_extent.depth >> level, 1u) };
+}
+
+uint32_t vk_image::get_max_mip_levels(const VkExtent3D &extent)
+{
+    uint32_t size = std::max(std::max(extent.width, extent.height), extent.depth);
+    uint32_t levels = 1;
+    while (size >>= 1) {
+        ++levels;
+    }
+    return levels;
+}
+
 void vk_image::bind_memory(vk_device_memory *mem, uint64_t offset)
 {
     VkResult res = vkBindImageMemory(m_device.get_handle(), m_handle, mem->get_handle(), offset);
@@ -469,13 +942,20 @@ void vk_image::bind_memory(vk_device_memory *mem, uint64_t offset)
 
 vk_image_view vk_image::create_image_view(aspect a) const
 {
+    auto view_type = (VkImageViewType)m_type;
+    if (m_array_layers > 1 && m_type == type::t1D) {
+        view_type = VK_IMAGE_VIEW_TYPE_1D_ARRAY;
+    } else if (m_array_layers > 1 && m_type == type::t2D) {
+        view_type = VK_IMAGE_VIEW_TYPE_2D_ARRAY;
+    }
+
     VkImageView view;
     VkImageViewCreateInfo info = {
         VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO, //type
         nullptr, //next
         0, //flags
         m_handle, //image
-        (VkImageViewType)m_type, //view type
+        view_type, //view type
         (VkFormat)m_format, //format
         { //components
             VK_COMPONENT_SWIZZLE_R, //r
@@ -486,9 +966,9 @@ vk_image_view vk_image::create_image_view(aspect a) const
         { //sub resource range
             (VkImageAspectFlagBits)a, //aspect mask
             0, //base mip level
-            1, //level count
+            m_mip_levels, //level count
             0, //base array layer
-            1, //layer count
+            m_array_layers, //layer count
         },
     };
     VkResult res = vkCreateImageView(m_device.get_handle(), &info, nullptr, &view);
@@ -503,6 +983,44 @@ vk_image_view vk_image::create_image_view(aspect a) const
 //--
 
 
+vk_sampler::vk_sampler(const vk_device &device, filter mag, filter min, filter mip, address_mode mode)
+          : m_device(device)
+{
+    const VkSamplerCreateInfo info = {
+        VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO, //type
+        nullptr, //next
+        0, //flags
+        (VkFilter)mag, //mag filter
+        (VkFilter)min, //min filter
+        mip == filter::linear ? VK_SAMPLER_MIPMAP_MODE_LINEAR : VK_SAMPLER_MIPMAP_MODE_NEAREST, //mipmap mode
+        (VkSamplerAddressMode)mode, //address mode u
+        (VkSamplerAddressMode)mode, //address mode v
+        (VkSamplerAddressMode)mode, //address mode w
+        0.f, //mip lod bias
+        VK_FALSE, //anisotropy enable
+        1.f, //max anisotropy
+        VK_FALSE, //compare enable
+        VK_COMPARE_OP_NEVER, //compare op
+        0.f, //min lod
+        VK_LOD_CLAMP_NONE, //max lod
+        VK_BORDER_COLOR_FLOAT_TRANSPARENT_BLACK, //border color
+        VK_FALSE, //unnormalized coordinates
+    };
+    VkResult res = vkCreateSampler(device.get_handle(), &info, nullptr, &m_handle);
+    if (res != VK_SUCCESS) {
+        throw vk_exception("Failed to create sampler: {}\n", res);
+    }
+}
+
+vk_sampler::~vk_sampler()
+{
+    vkDestroySampler(m_device.get_handle(), m_handle, nullptr);
+}
+
+
+//--
+
+
 vk_device_memory::vk_device_memory(const vk_device &device, property props, uint64_t size, uint32_t type_bits)
                 : m_device(device)
                 , m_size(size)
@@ -522,6 +1040,12 @@ vk_device_memory::vk_device_memory(const vk_device &device, property props, uint
     if (res != VK_SUCCESS) {
         throw vk_exception("Failed to create vulkan device memory: {}\n", res);
     }
+    m_device.m_data->allocated_memory += m_size;
+}
+
+vk_device_memory::vk_device_memory(const vk_device &device, std::initializer_list<property> props, uint64_t size, uint32_t type_bits)
+                : vk_device_memory(device, select_properties(device, props, type_bits), size, type_bits)
+{
 }
 
 vk_device_memory::vk_device_memory(vk_device_memory &&mem)
@@ -530,11 +1054,16 @@ vk_device_memory::vk_device_memory(vk_device_memory &&mem)
                 , m_size(mem.m_size)
                 , m_props(std::move(mem.m_props))
 {
+    mem.m_handle = VK_NULL_HANDLE;
+    mem.m_size = 0;
 }
 
 vk_device_memory::~vk_device_memory()
 {
-    vkFreeMemory(m_device.get_handle(), m_handle, nullptr);
+    if (m_handle != VK_NULL_HANDLE) {
+        vkFreeMemory(m_device.get_handle(), m_handle, nullptr);
+        m_device.m_data->allocated_memory -= m_size;
+    }
 }
 
 void *vk_device_memory::map(uint64_t offset)
@@ -555,12 +1084,17 @@ void vk_device_memory::unmap()
     vkUnmapMemory(m_device.get_handle(), m_handle);
 }
 
-uint32_t vk_device_memory::get_mem_index(property props, uint32_t type_bits)
+bool vk_device_memory::is_supported(const vk_device &device, property props, uint32_t type_bits)
 {
-    const vk_physical_device &phys = m_device.get_physical_device();
+    return find_mem_index(device, props, type_bits) >= 0;
+}
+
+int vk_device_memory::find_mem_index(const vk_device &device, property props, uint32_t type_bits)
+{
+    const vk_physical_device &phys = device.get_physical_device();
 
     // Search memtypes to find first index with those properties
-    for (uint32_t i = 0; i < 32; i++) {
+    for (int i = 0; i < 32; i++) {
         if ((type_bits & 1) == 1) {
             // Type is available, does it match user properties?
             if ((phys.get_memory_type(i).propertyFlags & (uint32_t)props) == (uint32_t)props) {
@@ -569,13 +1103,51 @@ uint32_t vk_device_memory::get_mem_index(property props, uint32_t type_bits)
         }
         type_bits >>= 1;
     }
-    throw vk_exception("No suitable memory type found with the requested properties: {}\n", (int)props);
+    return -1;
+}
+
+vk_device_memory::property vk_device_memory::select_properties(const vk_device &device, std::initializer_list<property> props, uint32_t type_bits)
+{
+    for (property p: props) {
+        if (is_supported(device, p, type_bits)) {
+            return p;
+        }
+    }
+    throw vk_exception("No suitable memory type found with any of the {} requested sets of properties\n", props.size());
+}
+
+uint32_t vk_device_memory::get_mem_index(property props, uint32_t type_bits)
+{
+    int index = find_mem_index(m_device, props, type_bits);
+    if (index < 0) {
+        throw vk_exception("No suitable memory type found with the requested properties: {}\n", (int)props);
+    }
+    return index;
 }
 
 
 //--
 
 
+vk_attachment::vk_attachment(const vk_device &device, VkFormat format, vk_image::usage u, vk_image::aspect a, const VkExtent3D &extent, bool transient,
+                             VkSampleCountFlagBits samples)
+             : m_image(device, format, get_usage(u, transient), vk_image::type::t2D, extent, samples)
+             , m_memory(device, { transient ? vk_device_memory::property::lazily_allocated | vk_device_memory::property::device_local : vk_device_memory::property::device_local,
+                                  vk_device_memory::property::device_local },
+                        m_image.get_required_memory_size(), m_image.get_required_memory_type())
+{
+    m_image.bind_memory(&m_memory, 0);
+    m_view = m_image.create_image_view(a);
+}
+
+vk_image::usage vk_attachment::get_usage(vk_image::usage u, bool transient)
+{
+    return transient ? u | vk_image::usage::transient_attachment : u;
+}
+
+//--
+
+
 vk_buffer::vk_buffer(const vk_device &device, usage u, uint64_t size, uint32_t stride)
          : m_device(device)
          , m_mem(nullptr)
@@ -636,10 +1208,11 @@ void vk_buffer::map(const std::function<void (void *)> &cb)
 
 struct vk_shader_module::state
 {
-    state(const vk_device &dev, stage s, VkShaderModule h)
+    state(const vk_device &dev, stage s, VkShaderModule h, const spirv_reflection &r)
         : device(dev)
         , stg(s)
         , handle(h)
+        , reflection(r)
     {
     }
 
@@ -648,43 +1221,20 @@ struct vk_shader_module::state
         vkDestroyShaderModule(device.get_handle(), handle, nullptr);
     }
 
-    const vk_device &device;
+    vk_device device;
     vk_shader_module::stage stg;
     VkShaderModule handle;
+    spirv_reflection reflection;
 };
 
 vk_shader_module::vk_shader_module(const vk_device &dev, stage s, const char *code, size_t size)
+                : m_state(create(dev, s, code, size))
 {
-    create(dev, s, code, size);
 }
 
 vk_shader_module::vk_shader_module(const vk_device &dev, stage s, stringview file)
+                : m_state(dev.m_data->shader_cache->load(dev, s, file))
 {
-    FILE *fp = fopen(file.to_string().data(), "rb");
-    if (!fp) {
-        throw vk_exception("Failed to open the shader file for read: {}\n", file);
-    }
-
-    fseek(fp, 0L, SEEK_END);
-    size_t size = ftell(fp);
-
-    fseek(fp, 0L, SEEK_SET);
-
-    char *code = new char[size];
-    if (!fread(code, size, 1, fp)) {
-        delete[] code;
-        throw vk_exception("Failed to read the shader file: {}\n", file);
-    }
-    fclose(fp);
-
-    try {
-        create(dev, s, code, size);
-    } catch (...) {
-        delete[] code;
-        throw;
-    }
-
-    delete[] code;
 }
 
 vk_shader_module::~vk_shader_module()
@@ -706,8 +1256,15 @@ VkShaderModule vk_shader_module::get_handle() const
     return m_state->handle;
 }
 
-void vk_shader_module::create(const vk_device &dev, stage s, const char *code, size_t size)
+const spirv_reflection &vk_shader_module::get_reflection() const
 {
+    return m_state->reflection;
+}
+
+std::shared_ptr<const vk_shader_module::state> vk_shader_module::create(const vk_device &dev, stage s, const char *code, size_t size)
+{
+    auto reflection = spirv_reflection((const uint32_t *)code, size / sizeof(uint32_t));
+
     VkShaderModuleCreateInfo info = {
         VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO, //type
         nullptr, //next
@@ -721,7 +1278,89 @@ void vk_shader_module::create(const vk_device &dev, stage s, const char *code, s
         throw vk_exception("Failed to create shader module: {}\n", res);
     }
 
-    m_state = std::make_shared<state>(dev, s, handle);
+    return std::make_shared<state>(dev, s, handle, reflection);
+}
+
+
+//--
+
+
+static vector<char> read_file(stringview file)
+{
+    FILE *fp = fopen(file.to_string().data(), "rb");
+    if (!fp) {
+        throw vk_exception("Failed to open the shader file for read: {}\n", file);
+    }
+
+    fseek(fp, 0L, SEEK_END);
+    size_t size = ftell(fp);
+
+    fseek(fp, 0L, SEEK_SET);
+
+    auto code = vector<char>(size);
+    bool ok = fread(code.data(), size, 1, fp) == 1;
+    fclose(fp);
+    if (!ok) {
+        throw vk_exception("Failed to read the shader file: {}\n", file);
+    }
+    return code;
+}
+
+static uint64_t hash_code(const vector<char> &code)
+{
+    // FNV-1a
+    uint64_t hash = 14695981039346656037ull;
+    for (char c: code) {
+        hash ^= (uint8_t)c;
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+std::shared_ptr<const vk_shader_module::state> vk_shader_cache::load(const vk_device &device, vk_shader_module::stage s, stringview file)
+{
+    string path = file.to_string();
+    struct stat st;
+    if (stat(path.data(), &st) < 0) {
+        throw vk_exception("Failed to stat the shader file {}: {}\n", file, strerror(errno));
+    }
+
+    // If the file did not change since we last read it the module made from it can be reused without any I/O
+    auto it = m_files.find(path);
+    if (it != m_files.end() && it->second.size == st.st_size &&
+        it->second.mtime.tv_sec == st.st_mtim.tv_sec && it->second.mtime.tv_nsec == st.st_mtim.tv_nsec) {
+        auto state = it->second.module.lock();
+        if (state && state->stg == s) {
+            return state;
+        }
+    }
+
+    auto code = read_file(file);
+    auto k = key(hash_code(code), code.size(), (int)s);
+    auto state = find(k, code);
+    if (!state) {
+        for (auto i = m_modules.begin(); i != m_modules.end();) {
+            i = i->second.state.expired() ? m_modules.erase(i) : std::next(i);
+        }
+
+        state = vk_shader_module::create(device, s, code.data(), code.size());
+        m_modules.insert({ k, { code, state } });
+    }
+    m_files[path] = { st.st_mtim, st.st_size, state };
+    return state;
+}
+
+std::shared_ptr<const vk_shader_module::state> vk_shader_cache::find(const key &k, const std::vector<char> &code) const
+{
+    auto range = m_modules.equal_range(k);
+    for (auto it = range.first; it != range.second; ++it) {
+        if (it->second.code == code) {
+            if (auto state = it->second.state.lock()) {
+                return state;
+            }
+        }
+    }
+    return nullptr;
 }
 
 
@@ -766,6 +1405,114 @@ vk_fence::~vk_fence()
     vkDestroyFence(m_device.get_handle(), m_handle, nullptr);
 }
 
+bool vk_fence::wait(uint64_t timeout_ns) const
+{
+    VkResult res = vkWaitForFences(m_device.get_handle(), 1, &m_handle, VK_TRUE, timeout_ns);
+    if (res == VK_TIMEOUT) {
+        return false;
+    } else if (res != VK_SUCCESS) {
+        throw vk_exception("Failed to wait for fence: {}\n", res);
+    }
+    return true;
+}
+
+bool vk_fence::is_signalled() const
+{
+    VkResult res = vkGetFenceStatus(m_device.get_handle(), m_handle);
+    if (res != VK_SUCCESS && res != VK_NOT_READY) {
+        throw vk_exception("Failed to get the fence status: {}\n", res);
+    }
+    return res == VK_SUCCESS;
+}
+
+void vk_fence::reset()
+{
+    VkResult res = vkResetFences(m_device.get_handle(), 1, &m_handle);
+    if (res != VK_SUCCESS) {
+        throw vk_exception("Failed to reset fence: {}\n", res);
+    }
+}
+
+
+//--
+
+
+vk_semaphore::vk_semaphore(const vk_device &device)
+            : m_device(device)
+{
+    VkSemaphoreCreateInfo info = {
+        VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO, //type
+        nullptr, //next
+        0, //flags
+    };
+    VkResult res = vkCreateSemaphore(device.get_handle(), &info, nullptr, &m_handle);
+    if (res != VK_SUCCESS) {
+        throw vk_exception("Failed to create semaphore: {}\n", res);
+    }
+}
+
+vk_semaphore::vk_semaphore(vk_semaphore &&s)
+            : m_handle(s.m_handle)
+            , m_device(s.m_device)
+{
+    s.m_handle = VK_NULL_HANDLE;
+}
+
+vk_semaphore::~vk_semaphore()
+{
+    vkDestroySemaphore(m_device.get_handle(), m_handle, nullptr);
+}
+
+
+//--
+
+
+vk_query_pool::vk_query_pool(const vk_device &device, uint32_t count)
+             : m_device(device)
+             , m_count(count)
+{
+    VkQueryPoolCreateInfo info = {
+        VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO, //type
+        nullptr, //next
+        0, //flags
+        VK_QUERY_TYPE_TIMESTAMP, //query type
+        count, //query count
+        0, //pipeline statistics
+    };
+    VkResult res = vkCreateQueryPool(device.get_handle(), &info, nullptr, &m_handle);
+    if (res != VK_SUCCESS) {
+        throw vk_exception("Failed to create query pool: {}\n", res);
+    }
+}
+
+vk_query_pool::~vk_query_pool()
+{
+    vkDestroyQueryPool(m_device.get_handle(), m_handle, nullptr);
+}
+
+void vk_query_pool::reset(const vk_command_buffer &cmd_buffer, uint32_t first, uint32_t count) const
+{
+    vkCmdResetQueryPool(cmd_buffer.get_handle(), m_handle, first, count);
+}
+
+void vk_query_pool::write_timestamp(const vk_command_buffer &cmd_buffer, VkPipelineStageFlagBits stage, uint32_t query) const
+{
+    vkCmdWriteTimestamp(cmd_buffer.get_handle(), stage, m_handle, query);
+}
+
+bool vk_query_pool::get_timestamps(uint32_t first, uint32_t count, std::vector<uint64_t> &timestamps) const
+{
+    timestamps.resize(count);
+    VkResult res = vkGetQueryPoolResults(m_device.get_handle(), m_handle, first, count, count * sizeof(uint64_t), timestamps.data(),
+                                         sizeof(uint64_t), VK_QUERY_RESULT_64_BIT);
+    if (res == VK_NOT_READY) {
+        return false;
+    } else if (res != VK_SUCCESS) {
+        throw vk_exception("Failed to get the query pool results: {}\n", res);
+    }
+    return true;
+}
+
 
 //--
 
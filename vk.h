@@ -1,7 +1,10 @@
 
 #pragma once
 
+#include <array>
+#include <functional>
 #include <memory>
+#include <type_traits>
 #include <vector>
 
 #include <vulkan/vulkan.h>
@@ -12,8 +15,10 @@
 
 class window;
 class vk_device;
+class vk_instance;
 class vk_physical_device;
 class vk_device_memory;
+class spirv_reflection;
 
 class vk_exception : public std::exception
 {
@@ -63,7 +68,7 @@ public:
     void end();
 
     template<class T>
-    void set_parameter(const T &parameter)
+    void set_parameter(const T &parameter) const
     {
         parameter.set_in_command_buffer(*this);
     }
@@ -90,13 +95,33 @@ private:
     VkCommandPool m_handle;
 };
 
+// Priorities, from 0 to 1, of the queues created for each role
+struct vk_queue_priorities {
+    float graphics = 1.f;
+    float compute = 0.5f;
+    float transfer = 0.5f;
+};
+
 class vk_device
 {
 public:
+    enum class queue_role {
+        graphics,
+        compute,
+        transfer,
+    };
+    struct queue_location {
+        uint32_t family;
+        uint32_t index;
+    };
+
     vk_device();
 
-    vk_queue get_queue(uint32_t index) const;
-    vk_command_pool create_command_pool() const;
+    // When the device lacks a dedicated family the compute and transfer
+    // queues fall back to another role's family, possibly the same queue.
+    vk_queue get_queue(queue_role role = queue_role::graphics) const;
+    uint32_t get_queue_family_index(queue_role role = queue_role::graphics) const;
+    vk_command_pool create_command_pool(queue_role role = queue_role::graphics) const;
 
     template<class T>
     std::shared_ptr<T> get_extension_object() const {
@@ -106,22 +131,49 @@ public:
         return std::make_shared<T>(*this);
     }
     bool is_extension_enabled(stringview extension) const;
+    // Descriptor indexing was enabled, see vk_bindless_set
+    bool supports_bindless() const;
 
     const vk_physical_device &get_physical_device() const;
+    // Total size of the vk_device_memory objects currently allocated on this device
+    uint64_t get_allocated_memory() const;
 
     VkDevice get_handle() const;
 
 private:
-    vk_device(const vk_physical_device &phys, VkDevice handle, uint32_t qfi, const std::vector<std::string> &exts);
+    vk_device(const vk_physical_device &phys, VkDevice handle, const std::array<queue_location, 3> &queues, const std::vector<std::string> &exts);
 
     struct data;
     std::shared_ptr<const data> m_data;
     friend class vk_physical_device;
+    friend class vk_shader_module;
+    friend class vk_device_memory;
 };
 
 inline bool operator==(const vk_device &a, const vk_device &b) { return a.get_handle() == b.get_handle(); }
 inline bool operator!=(const vk_device &a, const vk_device &b) { return a.get_handle() != b.get_handle(); }
 
+// The command buffers recorded for one frame. They are allocated in batches and
+// recycled all at once by reset(), which must only be called once the GPU is
+// done with the frame.
+class vk_frame_command_pool
+{
+public:
+    explicit vk_frame_command_pool(const vk_device &device, vk_device::queue_role role = vk_device::queue_role::graphics);
+    vk_frame_command_pool(const vk_frame_command_pool &) = delete;
+    ~vk_frame_command_pool();
+
+    // Valid until the next reset()
+    vk_command_buffer get_command_buffer();
+    void reset();
+
+private:
+    const vk_device &m_device;
+    VkCommandPool m_handle;
+    std::vector<VkCommandBuffer> m_command_buffers;
+    size_t m_used;
+};
+
 class vk_queue_family_properties
 {
 public:
@@ -129,6 +181,8 @@ public:
     bool is_compute_capable() const;
     bool is_transfer_capable() const;
     uint32_t queue_count() const;
+    // 0 if the family doesn't support timestamps
+    uint32_t timestamp_valid_bits() const;
 
 private:
     VkQueueFamilyProperties m_handle;
@@ -139,32 +193,50 @@ class vk_physical_device
 public:
     vk_physical_device();
 
+    // The compute and transfer queues are taken from the families best suited
+    // to run alongside the graphics one
     template<class... types>
-    vk_device create_device(uint32_t queue_family_index) {
+    vk_device create_device(uint32_t graphics_family, const vk_queue_priorities &priorities = vk_queue_priorities()) const {
         std::vector<std::string> extensions;
         populate_extensions<types...>(extensions);
-        return do_create_device(queue_family_index, extensions);
+        return do_create_device(graphics_family, priorities, extensions);
     }
 
     uint32_t get_vendor_id() const { return m_props.vendorID; }
     stringview get_device_name() const { return m_props.deviceName; }
+    VkPhysicalDeviceType get_type() const { return m_props.deviceType; }
     const std::vector<vk_queue_family_properties> &get_queue_family_properties() const { return m_queue_properties; }
+    bool has_extension(stringview name) const;
+    // Size of the largest device local heap
+    uint64_t get_device_local_memory() const;
+    // Has the descriptor indexing features used by vk_bindless_set
+    bool supports_bindless() const;
+    // All zero without VK_EXT_descriptor_indexing
+    const VkPhysicalDeviceDescriptorIndexingPropertiesEXT &get_descriptor_indexing_properties() const { return m_indexing_properties; }
 
     uint32_t get_memory_types_count() const;
     VkMemoryType get_memory_type(uint32_t index) const;
 
-    VkPhysicalDevice get_handle() { return m_handle; }
+    // Sample counts usable by framebuffers with both a color and a depth attachment
+    VkSampleCountFlags get_framebuffer_sample_counts() const;
+    VkSampleCountFlagBits get_max_sample_count(VkSampleCountFlagBits wanted) const;
+    // Nanoseconds per timestamp query tick
+    float get_timestamp_period() const { return m_props.limits.timestampPeriod; }
+
+    VkPhysicalDevice get_handle() const { return m_handle; }
 
 private:
-    void set(VkPhysicalDevice dev);
-    vk_device do_create_device(uint32_t queue_family_index, const std::vector<std::string> &extensions);
+    void set(VkPhysicalDevice dev, PFN_vkGetPhysicalDeviceFeatures2KHR get_features2, PFN_vkGetPhysicalDeviceProperties2KHR get_properties2);
+    vk_device do_create_device(uint32_t graphics_family, const vk_queue_priorities &priorities, const std::vector<std::string> &extensions) const;
+    template<class... none>
+    typename std::enable_if<sizeof...(none) == 0>::type populate_extensions(std::vector<std::string> &) const {}
     template<class first, class second, class... others>
-    void populate_extensions(std::vector<std::string> &extensions) {
+    void populate_extensions(std::vector<std::string> &extensions) const {
         extensions.emplace_back(first::get_extension().to_string());
         populate_extensions<second, others...>(extensions);
     }
     template<class first>
-    void populate_extensions(std::vector<std::string> &extensions) {
+    void populate_extensions(std::vector<std::string> &extensions) const {
         extensions.emplace_back(first::get_extension().to_string());
     }
 
@@ -172,10 +244,44 @@ private:
     VkPhysicalDeviceProperties m_props;
     VkPhysicalDeviceMemoryProperties m_memprops;
     std::vector<vk_queue_family_properties> m_queue_properties;
+    std::vector<VkExtensionProperties> m_extensions;
+    VkPhysicalDeviceDescriptorIndexingFeaturesEXT m_indexing_features;
+    VkPhysicalDeviceDescriptorIndexingPropertiesEXT m_indexing_properties;
 
     friend class vk_instance;
 };
 
+// Picks the physical device to use. Devices lacking a required extension or a
+// graphics queue family that can present are skipped, the others are ranked
+// by type, then by device local memory, then by their compute and transfer only
+// queue families.
+class vk_device_selector
+{
+public:
+    using present_func = std::function<bool (const vk_physical_device &dev, uint32_t queue_family)>;
+
+    explicit vk_device_selector(const vk_instance &instance);
+
+    void require_extension(stringview name);
+    void require_present(const present_func &func);
+    // A device index or part of a device name, bypassing the ranking
+    void set_override(stringview device);
+
+    const vk_physical_device &select() const;
+    // The first graphics queue family passing the present check, or -1
+    int find_queue_family(const vk_physical_device &dev) const;
+
+    static uint64_t score(const vk_physical_device &dev);
+
+private:
+    bool is_suitable(const vk_physical_device &dev) const;
+
+    const vk_instance &m_instance;
+    std::vector<std::string> m_extensions;
+    present_func m_present;
+    std::string m_override;
+};
+
 class vk_layer
 {
 public:
@@ -198,7 +304,7 @@ public:
     ~vk_instance();
 
     VkInstance get_handle() const { return m_instance; }
-    std::vector<vk_physical_device> get_physical_devices() const { return m_physical_devices; }
+    const std::vector<vk_physical_device> &get_physical_devices() const { return m_physical_devices; }
     static std::vector<vk_layer> get_available_layers();
 
 private:
@@ -214,8 +320,8 @@ public:
     vk_surface(vk_surface &&s);
     ~vk_surface();
 
-    bool supports_present(vk_physical_device *device, int queue_family) const;
-    std::vector<VkSurfaceFormatKHR> get_formats(vk_physical_device *device) const;
+    bool supports_present(const vk_physical_device *device, int queue_family) const;
+    std::vector<VkSurfaceFormatKHR> get_formats(const vk_physical_device *device) const;
 
     const window &get_window() const { return m_window; }
     VkSurfaceKHR get_handle() const { return m_handle; }
@@ -267,7 +373,9 @@ public:
     };
 
     vk_image(const vk_device &device, VkImage img, const VkExtent3D &extent);
-    vk_image(const vk_device &device, VkFormat format, usage u, type t, const VkExtent3D &extent);
+    vk_image(const vk_device &device, VkFormat format, usage u, type t, const VkExtent3D &extent, VkSampleCountFlagBits samples = VK_SAMPLE_COUNT_1_BIT);
+    vk_image(const vk_device &device, VkFormat format, usage u, type t, const VkExtent3D &extent, uint32_t mip_levels, uint32_t array_layers,
+             VkSampleCountFlagBits samples = VK_SAMPLE_COUNT_1_BIT);
     vk_image(const vk_image &) = delete;
     vk_image(vk_image &&) = default;
     ~vk_image();
@@ -275,8 +383,15 @@ public:
     uint32_t get_width() const { return m_extent.width; }
     uint32_t get_height() const { return m_extent.height; }
     uint32_t get_depth() const { return m_extent.depth; }
+    const VkExtent3D &get_extent() const { return m_extent; }
+    VkExtent3D get_mip_extent(uint32_t level) const;
+    uint32_t get_mip_levels() const { return m_mip_levels; }
+    uint32_t get_array_layers() const { return m_array_layers; }
+    // Number of levels of a full mip chain, down to 1x1x1
+    static uint32_t get_max_mip_levels(const VkExtent3D &extent);
 
     VkFormat get_format() const { return m_format; }
+    VkSampleCountFlagBits get_samples() const { return m_samples; }
 
     uint64_t get_required_memory_size() const { return m_mem_reqs.size; }
     uint64_t get_required_memory_alignment() const { return m_mem_reqs.alignment; }
@@ -286,16 +401,49 @@ public:
 
     VkImage get_handle() const { return m_handle; }
 
+    // Covers all the mip levels and array layers
     vk_image_view create_image_view(aspect a) const;
 
 private:
     const vk_device &m_device;
     VkImage m_handle;
     VkExtent3D m_extent;
+    uint32_t m_mip_levels;
+    uint32_t m_array_layers;
     bool m_owns_handle;
     VkMemoryRequirements m_mem_reqs;
     type m_type;
     VkFormat m_format;
+    VkSampleCountFlagBits m_samples;
+};
+
+FLAGS(vk_image::usage)
+FLAGS(vk_image::aspect)
+
+class vk_sampler
+{
+public:
+    enum class filter {
+        nearest = VK_FILTER_NEAREST,
+        linear = VK_FILTER_LINEAR,
+    };
+    enum class address_mode {
+        repeat = VK_SAMPLER_ADDRESS_MODE_REPEAT,
+        mirrored_repeat = VK_SAMPLER_ADDRESS_MODE_MIRRORED_REPEAT,
+        clamp_to_edge = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE,
+        clamp_to_border = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_BORDER,
+    };
+
+    // mip selects how levels are blended, all the levels are used
+    vk_sampler(const vk_device &device, filter mag, filter min, filter mip, address_mode mode = address_mode::repeat);
+    vk_sampler(const vk_sampler &) = delete;
+    ~vk_sampler();
+
+    VkSampler get_handle() const { return m_handle; }
+
+private:
+    const vk_device &m_device;
+    VkSampler m_handle;
 };
 
 class vk_device_memory
@@ -309,6 +457,8 @@ public:
         lazily_allocated = VK_MEMORY_PROPERTY_LAZILY_ALLOCATED_BIT,
     };
     vk_device_memory(const vk_device &device, property props, uint64_t size, uint32_t type_bits);
+    // Uses the first set of properties in the list which the device supports for type_bits
+    vk_device_memory(const vk_device &device, std::initializer_list<property> props, uint64_t size, uint32_t type_bits);
     vk_device_memory(const vk_device_memory &) = delete;
     vk_device_memory(vk_device_memory &&mem);
     ~vk_device_memory();
@@ -317,8 +467,13 @@ public:
     void unmap();
 
     VkDeviceMemory get_handle() const { return m_handle; }
+    property get_properties() const { return m_props; }
+
+    static bool is_supported(const vk_device &device, property props, uint32_t type_bits);
 
 private:
+    static int find_mem_index(const vk_device &device, property props, uint32_t type_bits);
+    static property select_properties(const vk_device &device, std::initializer_list<property> props, uint32_t type_bits);
     uint32_t get_mem_index(property props, uint32_t type_bits);
 
     const vk_device &m_device;
@@ -329,6 +484,28 @@ private:
 
 FLAGS(vk_device_memory::property)
 
+class vk_attachment
+{
+public:
+    // A transient attachment is never loaded from or stored to memory, so it
+    // is backed by lazily allocated memory when the device has it.
+    vk_attachment(const vk_device &device, VkFormat format, vk_image::usage u, vk_image::aspect a, const VkExtent3D &extent, bool transient,
+                  VkSampleCountFlagBits samples = VK_SAMPLE_COUNT_1_BIT);
+    vk_attachment(const vk_attachment &) = delete;
+
+    const vk_image &get_image() const { return m_image; }
+    const vk_image_view &get_view() const { return m_view; }
+
+    bool is_lazily_allocated() const { return m_memory.get_properties() & vk_device_memory::property::lazily_allocated; }
+
+private:
+    static vk_image::usage get_usage(vk_image::usage u, bool transient);
+
+    vk_image m_image;
+    vk_device_memory m_memory;
+    vk_image_view m_view;
+};
+
 class vk_buffer
 {
 public:
@@ -388,6 +565,7 @@ public:
         tessellation_control = VK_SHADER_STAGE_TESSELLATION_CONTROL_BIT,
         tessellation_evaluation = VK_SHADER_STAGE_TESSELLATION_EVALUATION_BIT,
         compute = VK_SHADER_STAGE_COMPUTE_BIT,
+        all = VK_SHADER_STAGE_ALL,
     };
 
     vk_shader_module(const vk_device &device, stage s, const char *code, size_t size);
@@ -397,14 +575,18 @@ public:
     const vk_device &get_device() const;
     stage get_stage() const;
     VkShaderModule get_handle() const;
+    const spirv_reflection &get_reflection() const;
 
 private:
-    void create(const vk_device &dev, stage s, const char *code, size_t size);
-
     struct state;
+    static std::shared_ptr<const state> create(const vk_device &dev, stage s, const char *code, size_t size);
+
     std::shared_ptr<const state> m_state;
+    friend class vk_shader_cache;
 };
 
+FLAGS(vk_shader_module::stage)
+
 class vk_viewport
 {
 public:
@@ -422,11 +604,54 @@ class vk_fence
 {
 public:
     explicit vk_fence(const vk_device &device);
+    vk_fence(const vk_fence &) = delete;
     ~vk_fence();
 
+    // Returns false on timeout
+    bool wait(uint64_t timeout_ns = UINT64_MAX) const;
+    bool is_signalled() const;
+    void reset();
+
     VkFence get_handle() const { return m_handle; }
 
 private:
     VkFence m_handle;
     const vk_device &m_device;
 };
+
+class vk_semaphore
+{
+public:
+    explicit vk_semaphore(const vk_device &device);
+    vk_semaphore(const vk_semaphore &) = delete;
+    vk_semaphore(vk_semaphore &&s);
+    ~vk_semaphore();
+
+    VkSemaphore get_handle() const { return m_handle; }
+
+private:
+    VkSemaphore m_handle;
+    const vk_device &m_device;
+};
+
+class vk_query_pool
+{
+public:
+    // A pool of timestamp queries
+    vk_query_pool(const vk_device &device, uint32_t count);
+    vk_query_pool(const vk_query_pool &) = delete;
+    ~vk_query_pool();
+
+    void reset(const vk_command_buffer &cmd_buffer, uint32_t first, uint32_t count) const;
+    void write_timestamp(const vk_command_buffer &cmd_buffer, VkPipelineStageFlagBits stage, uint32_t query) const;
+    // Returns false without waiting if any of the queries is not available yet
+    bool get_timestamps(uint32_t first, uint32_t count, std::vector<uint64_t> &timestamps) const;
+
+    uint32_t get_count() const { return m_count; }
+    VkQueryPool get_handle() const { return m_handle; }
+
+private:
+    VkQueryPool m_handle;
+    const vk_device &m_device;
+    uint32_t m_count;
+};
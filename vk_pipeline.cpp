@@ -1,5 +1,9 @@
 
+#include <algorithm>
+
 #include "vk_pipeline.h"
+#include "spirv.h"
+#include "log.h"
 
 
 vk_descriptor_set::vk_descriptor_set(const vk_device &device, VkDescriptorSet handle)
@@ -8,11 +12,34 @@ vk_descriptor_set::vk_descriptor_set(const vk_device &device, VkDescriptorSet ha
 {
 }
 
+void vk_descriptor_set::update(const vk_image_view &view, const vk_sampler &sampler, VkImageLayout layout)
+{
+    VkDescriptorImageInfo descset_image_info = {
+        sampler.get_handle(), //sampler
+        view.get_handle(), //image view
+        layout, //image layout
+    };
+
+    VkWriteDescriptorSet descset_write = {
+        VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET, //type
+        nullptr, //next
+        m_handle, //descriptor set
+        0, //binding
+        0, //starting array element
+        1, //descriptor count
+        VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, //descriptor type
+        &descset_image_info, //image info
+        nullptr, //buffer info
+        nullptr, //texel buffer view
+    };
+    vkUpdateDescriptorSets(m_device.get_handle(), 1, &descset_write, 0, nullptr);
+}
+
 
 //--
 
 
-vk_descriptor_set_layout::vk_descriptor_set_layout(const vk_device &device, const std::vector<binding> &bindings)
+vk_descriptor_set_layout::vk_descriptor_set_layout(const vk_device &device, const std::vector<binding> &bindings, bool update_after_bind)
 {
     auto layout_bindings = std::vector<VkDescriptorSetLayoutBinding>();
     layout_bindings.reserve(bindings.size());
@@ -24,10 +51,22 @@ vk_descriptor_set_layout::vk_descriptor_set_layout(const vk_device &device, cons
                                     nullptr, //TODO FIXME immutable samplers
                                     });
     }
+    auto binding_flags = std::vector<VkDescriptorBindingFlagsEXT>(bindings.size(), VK_DESCRIPTOR_BINDING_UPDATE_AFTER_BIND_BIT_EXT |
+                                                                                   VK_DESCRIPTOR_BINDING_PARTIALLY_BOUND_BIT_EXT);
+    const VkDescriptorSetLayoutBindingFlagsCreateInfoEXT binding_flags_info = {
+        VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_BINDING_FLAGS_CREATE_INFO_EXT, //type
+        nullptr, //next
+        (uint32_t)binding_flags.size(), //binding count
+        binding_flags.data(), //binding flags
+    };
+    if (update_after_bind && !device.supports_bindless()) {
+        throw vk_exception("Update after bind descriptor set layouts need the descriptor indexing extension.\n");
+    }
+
     const VkDescriptorSetLayoutCreateInfo descriptor_layout_info = {
         VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO, //type
-        nullptr, //next
-        0, //flags
+        update_after_bind ? &binding_flags_info : nullptr, //next
+        update_after_bind ? (VkDescriptorSetLayoutCreateFlags)VK_DESCRIPTOR_SET_LAYOUT_CREATE_UPDATE_AFTER_BIND_POOL_BIT_EXT : 0, //flags
         (uint32_t)layout_bindings.size(), //bindings count
         layout_bindings.data(), //bindings
     };
@@ -37,25 +76,69 @@ vk_descriptor_set_layout::vk_descriptor_set_layout(const vk_device &device, cons
     }
 }
 
+vk_descriptor_set_layout::vk_descriptor_set_layout(const vk_device &device, const std::vector<vk_shader_module> &modules, uint32_t set)
+                        : vk_descriptor_set_layout(device, get_bindings(modules, set))
+{
+}
+
+std::vector<vk_descriptor_set_layout::binding> vk_descriptor_set_layout::get_bindings(const std::vector<vk_shader_module> &modules, uint32_t set)
+{
+    auto bindings = std::vector<binding>();
+    for (const vk_shader_module &module: modules) {
+        for (const auto &desc: module.get_reflection().get_descriptors()) {
+            if (desc.set != set) {
+                continue;
+            }
+
+            auto it = std::find_if(bindings.begin(), bindings.end(), [&](const binding &b) { return b.binding_id == desc.binding; });
+            if (it == bindings.end()) {
+                bindings.push_back({ desc.binding, (vk_descriptor::type)desc.type, desc.count, module.get_stage() });
+                continue;
+            }
+            if (it->type != (vk_descriptor::type)desc.type || it->descriptor_count != desc.count) {
+                throw vk_exception("Shader stages disagree on the descriptor at set {} binding {}.\n", set, desc.binding);
+            }
+            it->shader_stages |= module.get_stage();
+        }
+    }
+    return bindings;
+}
+
 
 //--
 
 
+static uint32_t count_descriptors(const std::vector<std::pair<vk_descriptor::type, uint32_t>> &sizes)
+{
+    uint32_t count = 0;
+    for (const auto &s: sizes) {
+        count += s.second;
+    }
+    return count;
+}
+
 vk_descriptor_pool::vk_descriptor_pool(const vk_device &device, const std::vector<std::pair<vk_descriptor::type, uint32_t>> &sizes)
+                  : vk_descriptor_pool(device, sizes, count_descriptors(sizes), false)
+{
+}
+
+vk_descriptor_pool::vk_descriptor_pool(const vk_device &device, const std::vector<std::pair<vk_descriptor::type, uint32_t>> &sizes, uint32_t max_sets, bool update_after_bind)
                   : m_device(device)
 {
-    uint32_t max = 0;
-    auto descpool_sizes = std::vector<VkDescriptorPoolSize>(sizes.size());
+    auto descpool_sizes = std::vector<VkDescriptorPoolSize>();
+    descpool_sizes.reserve(sizes.size());
     for (const auto &s: sizes) {
-        descpool_sizes.push_back({ (VkDescriptorType)s.first, s.second });
-        max += s.second;
+        // Pool sizes cannot be empty, e.g. a bindless set without images
+        if (s.second) {
+            descpool_sizes.push_back({ (VkDescriptorType)s.first, s.second });
+        }
     }
 
     const VkDescriptorPoolCreateInfo descriptor_pool_info = {
         VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO, //type
         nullptr, //next
-        0, //flags
-        max, //max sets
+        update_after_bind ? (VkDescriptorPoolCreateFlags)VK_DESCRIPTOR_POOL_CREATE_UPDATE_AFTER_BIND_BIT_EXT : 0, //flags
+        max_sets, //max sets
         (uint32_t)descpool_sizes.size(), //poolsizecount
         descpool_sizes.data(), //pool sizes
     };
@@ -99,19 +182,54 @@ vk_descriptor_set vk_descriptor_pool::allocate_descriptor_set(const vk_descripto
 vk_pipeline_layout::vk_pipeline_layout(const vk_device &device, const vk_descriptor_set_layout &descset_layout)
                   : m_device(device)
 {
-    VkDescriptorSetLayout descset_layouts[] = {
-        descset_layout.get_handle(),
-    };
+    create({ &descset_layout }, {});
+}
+
+vk_pipeline_layout::vk_pipeline_layout(const vk_device &device, const vk_descriptor_set_layout &descset_layout, const std::vector<vk_shader_module> &modules)
+                  : vk_pipeline_layout(device, std::vector<const vk_descriptor_set_layout *>{ &descset_layout }, modules)
+{
+}
+
+vk_pipeline_layout::vk_pipeline_layout(const vk_device &device, const std::vector<const vk_descriptor_set_layout *> &descset_layouts, const std::vector<vk_shader_module> &modules)
+                  : m_device(device)
+{
+    VkShaderStageFlags stages = 0;
+    uint32_t begin = UINT32_MAX;
+    uint32_t end = 0;
+    for (const vk_shader_module &module: modules) {
+        const auto &block = module.get_reflection().get_push_constant_block();
+        if (block.size == 0) {
+            continue;
+        }
+        stages |= (VkShaderStageFlags)module.get_stage();
+        begin = std::min(begin, block.offset);
+        end = std::max(end, block.offset + block.size);
+    }
+
+    if (!stages) {
+        create(descset_layouts, {});
+        return;
+    }
+    create(descset_layouts, { { stages, begin, end - begin } });
+}
+
+void vk_pipeline_layout::create(const std::vector<const vk_descriptor_set_layout *> &descset_layouts, const std::vector<VkPushConstantRange> &push_constants)
+{
+    auto handles = std::vector<VkDescriptorSetLayout>();
+    handles.reserve(descset_layouts.size());
+    for (const vk_descriptor_set_layout *l: descset_layouts) {
+        handles.push_back(l->get_handle());
+    }
     const VkPipelineLayoutCreateInfo pipeline_layout_create_info = {
         VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO, //type
         nullptr, //next
         0, //flags
-        1, //descriptor set layout count
-        descset_layouts, //descriptor set layouts
-        0, //push constant range count
-        nullptr, //push constant ranges
+        (uint32_t)handles.size(), //descriptor set layout count
+        handles.data(), //descriptor set layouts
+        (uint32_t)push_constants.size(), //push constant range count
+        push_constants.data(), //push constant ranges
     };
-    VkResult res = vkCreatePipelineLayout(device.get_handle(), &pipeline_layout_create_info, nullptr, &m_handle);
+    VkResult res = vkCreatePipelineLayout(m_device.get_handle(), &pipeline_layout_create_info, nullptr, &m_handle);
     if (res != VK_SUCCESS) {
         throw vk_exception("Failed to create pipeline layout: {}\n", res);
     }
@@ -126,6 +244,139 @@ vk_pipeline_layout::~vk_pipeline_layout()
 //--
 
 
+// Every stage sees the whole arrays, so both the per set and the per stage
+// limits apply. The resources a stage can access are split between images and
+// buffers in proportion to what was asked.
+static uint32_t get_bindless_max_images(const vk_device &device, uint32_t wanted, uint32_t wanted_buffers)
+{
+    const auto &props = device.get_physical_device().get_descriptor_indexing_properties();
+    uint64_t resources = props.maxPerStageUpdateAfterBindResources;
+    uint64_t share = wanted;
+    if (wanted + uint64_t(wanted_buffers) > resources) {
+        share = std::max<uint64_t>(resources * wanted / (wanted + uint64_t(wanted_buffers)), 1);
+    }
+    uint32_t max = std::min({ props.maxDescriptorSetUpdateAfterBindSampledImages, props.maxPerStageDescriptorUpdateAfterBindSampledImages,
+                              props.maxDescriptorSetUpdateAfterBindSamplers, props.maxPerStageDescriptorUpdateAfterBindSamplers,
+                              (uint32_t)std::min<uint64_t>(share, UINT32_MAX) });
+    if (wanted && max == 0) {
+        throw vk_exception("The device has no room for bindless images.\n");
+    }
+    if (wanted > max) {
+        log_warning("The bindless set is limited to {} images, {} were asked.\n", max, wanted);
+    }
+    return std::min(wanted, max);
+}
+
+static uint32_t get_bindless_max_buffers(const vk_device &device, uint32_t images, uint32_t wanted)
+{
+    const auto &props = device.get_physical_device().get_descriptor_indexing_properties();
+    uint32_t left = props.maxPerStageUpdateAfterBindResources - images;
+    uint32_t max = std::min({ props.maxDescriptorSetUpdateAfterBindStorageBuffers, props.maxPerStageDescriptorUpdateAfterBindStorageBuffers, left });
+    if (wanted && max == 0) {
+        throw vk_exception("The device has no room for bindless buffers next to {} images.\n", images);
+    }
+    if (wanted > max) {
+        log_warning("The bindless set is limited to {} buffers, {} were asked.\n", max, wanted);
+    }
+    return std::min(wanted, max);
+}
+
+vk_bindless_set::vk_bindless_set(const vk_device &device, uint32_t max_images, uint32_t max_buffers)
+               : m_device(device)
+               , m_max_images(get_bindless_max_images(device, max_images, max_buffers))
+               , m_max_buffers(get_bindless_max_buffers(device, m_max_images, max_buffers))
+               , m_layout(device, { { 0, vk_descriptor::type::combined_image_sampler, m_max_images, vk_shader_module::stage::all },
+                                    { 1, vk_descriptor::type::storage_buffer, m_max_buffers, vk_shader_module::stage::all } }, true)
+               , m_pool(device, { { vk_descriptor::type::combined_image_sampler, m_max_images },
+                                  { vk_descriptor::type::storage_buffer, m_max_buffers } }, 1, true)
+               , m_set(m_pool.allocate_descriptor_set(m_layout))
+{
+}
+
+uint32_t vk_bindless_set::slots::take(uint32_t max)
+{
+    if (!free.empty()) {
+        uint32_t index = free.back();
+        free.pop_back();
+        return index;
+    }
+    if (count == max) {
+        throw vk_exception("The bindless descriptor set is full, it has room for {} descriptors of this type.\n", max);
+    }
+    return count++;
+}
+
+void vk_bindless_set::slots::release(uint32_t index)
+{
+    if (index >= count || std::find(free.begin(), free.end(), index) != free.end()) {
+        throw vk_exception("The bindless descriptor {} is not in use.\n", index);
+    }
+    free.push_back(index);
+}
+
+uint32_t vk_bindless_set::add_image(const vk_image_view &view, VkSampler sampler, VkImageLayout layout)
+{
+    uint32_t index = m_images.take(m_max_images);
+    VkDescriptorImageInfo info = {
+        sampler, //sampler
+        view.get_handle(), //image view
+        layout, //image layout
+    };
+    write(0, index, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, &info, nullptr);
+    return index;
+}
+
+uint32_t vk_bindless_set::add_buffer(const vk_buffer &buffer, VkDeviceSize offset, VkDeviceSize size)
+{
+    uint32_t index = m_buffers.take(m_max_buffers);
+    VkDescriptorBufferInfo info = {
+        buffer.get_handle(), //buffer
+        offset, //offset
+        size, //range
+    };
+    write(1, index, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, nullptr, &info);
+    return index;
+}
+
+// Partially bound descriptors may be left pointing at destroyed objects as long
+// as the shaders don't access them
+void vk_bindless_set::remove_image(uint32_t index)
+{
+    m_images.release(index);
+}
+
+void vk_bindless_set::remove_buffer(uint32_t index)
+{
+    m_buffers.release(index);
+}
+
+void vk_bindless_set::write(uint32_t binding, uint32_t index, VkDescriptorType type, const VkDescriptorImageInfo *image, const VkDescriptorBufferInfo *buffer)
+{
+    VkWriteDescriptorSet descset_write = {
+        VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET, //type
+        nullptr, //next
+        m_set.get_handle(), //descriptor set
+        binding, //binding
+        index, //starting array element
+        1, //descriptor count
+        type, //descriptor type
+        image, //image info
+        buffer, //buffer info
+        nullptr, //texel buffer view
+    };
+    vkUpdateDescriptorSets(m_device.get_handle(), 1, &descset_write, 0, nullptr);
+}
+
+void vk_bindless_set::bind(const vk_command_buffer &cmd_buffer, VkPipelineBindPoint bind_point, const vk_pipeline_layout &layout, uint32_t set) const
+{
+    VkDescriptorSet descset = m_set.get_handle();
+    vkCmdBindDescriptorSets(cmd_buffer.get_handle(), bind_point, layout.get_handle(), set, 1, &descset, 0, nullptr);
+}
+
+
+//--
+
+
 vk_renderpass::scope::scope(const vk_command_buffer &cmd_buffer)
                     : m_cmd_buffer(cmd_buffer)
 {
@@ -137,74 +388,197 @@ vk_renderpass::scope::~scope()
 }
 
 
-vk_renderpass::vk_renderpass(const vk_device &device, VkFormat format, VkFormat depth_format)
-             : m_device(device)
+vk_renderpass::vk_renderpass(const vk_device &device)
+             : m_handle(VK_NULL_HANDLE)
+             , m_device(device)
 {
-    VkAttachmentDescription attachment_desc[] = {
-        {
-            0, //flags
-            format, //format
-            VK_SAMPLE_COUNT_1_BIT, //samples
-            VK_ATTACHMENT_LOAD_OP_CLEAR, //load op
-            VK_ATTACHMENT_STORE_OP_STORE, //store op
-            VK_ATTACHMENT_LOAD_OP_DONT_CARE, //stencil load op
-            VK_ATTACHMENT_STORE_OP_DONT_CARE, //stencil store op
-            VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL, //initial layout
-            VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL, //final layout
-        },
-        {
+}
+
+vk_renderpass::vk_renderpass(const vk_device &device, VkFormat format, VkFormat depth_format, VkSampleCountFlagBits samples)
+             : vk_renderpass(device)
+{
+    if (!(device.get_physical_device().get_framebuffer_sample_counts() & samples)) {
+        throw vk_exception("Sample count {} is not supported by the device.\n", (int)samples);
+    }
+    // With multisampling the color attachment is resolved into the single
+    // sampled image at the end of the subpass and never needs to be stored.
+    bool multisampled = samples != VK_SAMPLE_COUNT_1_BIT;
+
+    uint32_t color = add_attachment({ format, samples, load_op::clear, multisampled ? store_op::dont_care : store_op::store,
+                                      VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL, VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL });
+    uint32_t depth = add_attachment({ depth_format, samples, load_op::clear, store_op::dont_care,
+                                      VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL, VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL });
+
+    subpass main;
+    main.colors = { color };
+    main.depth = depth;
+    if (multisampled) {
+        main.resolves = { add_attachment({ format, VK_SAMPLE_COUNT_1_BIT, load_op::dont_care, store_op::store,
+                                           VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL, VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL }) };
+    }
+    add_subpass(main);
+
+    create();
+}
+
+vk_renderpass::~vk_renderpass()
+{
+    vkDestroyRenderPass(m_device.get_handle(), m_handle, nullptr);
+}
+
+uint32_t vk_renderpass::add_attachment(const attachment &a)
+{
+    if (m_handle != VK_NULL_HANDLE) {
+        throw vk_exception("Cannot add attachments to a render pass that was already created.\n");
+    }
+    m_attachments.push_back(a);
+    return m_attachments.size() - 1;
+}
+
+uint32_t vk_renderpass::add_subpass(const subpass &s)
+{
+    if (m_handle != VK_NULL_HANDLE) {
+        throw vk_exception("Cannot add subpasses to a render pass that was already created.\n");
+    }
+    if (!s.resolves.empty() && s.resolves.size() != s.colors.size()) {
+        throw vk_exception("A subpass needs either no resolve attachments or one per color attachment, got {} for {}.\n", s.resolves.size(), s.colors.size());
+    }
+    for (const auto *list: { &s.inputs, &s.colors, &s.resolves, &s.preserves }) {
+        for (uint32_t a: *list) {
+            if (a != VK_ATTACHMENT_UNUSED && a >= m_attachments.size()) {
+                throw vk_exception("Subpass references the attachment {} but the render pass has only {}.\n", a, m_attachments.size());
+            }
+        }
+    }
+    if (s.depth != VK_ATTACHMENT_UNUSED && s.depth >= m_attachments.size()) {
+        throw vk_exception("Subpass references the depth attachment {} but the render pass has only {}.\n", s.depth, m_attachments.size());
+    }
+
+    m_subpasses.push_back(s);
+    if (get_samples(m_subpasses.size() - 1) == 0) {
+        m_subpasses.pop_back();
+        throw vk_exception("The color and depth attachments of a subpass must all have the same sample count.\n");
+    }
+    return m_subpasses.size() - 1;
+}
+
+void vk_renderpass::add_dependency(uint32_t src_subpass, uint32_t dst_subpass, VkPipelineStageFlags src_stages, VkPipelineStageFlags dst_stages,
+                                   VkAccessFlags src_access, VkAccessFlags dst_access, bool by_region)
+{
+    m_dependencies.push_back({
+        src_subpass, //src subpass
+        dst_subpass, //dst subpass
+        src_stages, //src stage mask
+        dst_stages, //dst stage mask
+        src_access, //src access mask
+        dst_access, //dst access mask
+        by_region ? (VkDependencyFlags)VK_DEPENDENCY_BY_REGION_BIT : 0, //dependency flags
+    });
+}
+
+void vk_renderpass::create()
+{
+    if (m_subpasses.empty()) {
+        throw vk_exception("Cannot create a render pass without subpasses.\n");
+    }
+
+    auto attachment_desc = std::vector<VkAttachmentDescription>();
+    for (const attachment &a: m_attachments) {
+        attachment_desc.push_back({
             0, //flags
-            depth_format, //format
-            VK_SAMPLE_COUNT_1_BIT, //samples
-            VK_ATTACHMENT_LOAD_OP_CLEAR, //load op
-            VK_ATTACHMENT_STORE_OP_DONT_CARE, //store op
-            VK_ATTACHMENT_LOAD_OP_DONT_CARE, //stencil load op
-            VK_ATTACHMENT_STORE_OP_DONT_CARE, //stencil store op
-            VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL, //initial layout
-            VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL, //final layout
-        },
-    };
-    VkAttachmentReference color_attachments[] = {
-        { 0, VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL, },
-    };
-//     VkAttachmentReference resolve_attachments[] = {
-//         { VK_ATTACHMENT_UNUSED, VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL, },
-//     };
-    const VkAttachmentReference depth_reference = {
-        .attachment = 1,
-        .layout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL,
+            a.format, //format
+            a.samples, //samples
+            (VkAttachmentLoadOp)a.load, //load op
+            (VkAttachmentStoreOp)a.store, //store op
+            (VkAttachmentLoadOp)a.stencil_load, //stencil load op
+            (VkAttachmentStoreOp)a.stencil_store, //stencil store op
+            a.initial_layout, //initial layout
+            a.final_layout, //final layout
+        });
+    }
+
+    // The references must stay alive until vkCreateRenderPass, so reserve
+    // them all upfront to avoid reallocations.
+    struct references {
+        std::vector<VkAttachmentReference> inputs, colors, resolves;
+        VkAttachmentReference depth;
     };
-//     const uint32_t preserve_attachments[] = { 0 };
-    VkSubpassDescription subpass_desc[] = {
-        {
+    auto refs = std::vector<references>(m_subpasses.size());
+    auto subpass_desc = std::vector<VkSubpassDescription>();
+    for (uint32_t i = 0; i < m_subpasses.size(); ++i) {
+        const subpass &s = m_subpasses[i];
+        references &r = refs[i];
+
+        bool depth_is_input = std::find(s.inputs.begin(), s.inputs.end(), s.depth) != s.inputs.end();
+        auto depth_layout = depth_is_input ? VK_IMAGE_LAYOUT_DEPTH_STENCIL_READ_ONLY_OPTIMAL : VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
+        for (uint32_t a: s.inputs) {
+            r.inputs.push_back({ a, a == s.depth ? depth_layout : VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL });
+        }
+        for (uint32_t a: s.colors) {
+            r.colors.push_back({ a, VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL });
+        }
+        for (uint32_t a: s.resolves) {
+            r.resolves.push_back({ a, VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL });
+        }
+        r.depth = { s.depth, depth_layout };
+
+        subpass_desc.push_back({
             0, //flags
             VK_PIPELINE_BIND_POINT_GRAPHICS, //pipeline bind point
-            0, //input attachments count
-            nullptr, //input attachments
-            1, //color attachments count
-            color_attachments, //color_attachments
-            nullptr, //resolve attachments
-            &depth_reference, //depth stencil attachments
-            0, //preserve attachments count
-            nullptr, //preserve attachments
-        },
-    };
+            (uint32_t)r.inputs.size(), //input attachments count
+            r.inputs.data(), //input attachments
+            (uint32_t)r.colors.size(), //color attachments count
+            r.colors.data(), //color_attachments
+            r.resolves.empty() ? nullptr : r.resolves.data(), //resolve attachments
+            s.depth == VK_ATTACHMENT_UNUSED ? nullptr : &r.depth, //depth stencil attachments
+            (uint32_t)s.preserves.size(), //preserve attachments count
+            s.preserves.data(), //preserve attachments
+        });
+    }
+
     VkRenderPassCreateInfo create_info = {
         VK_STRUCTURE_TYPE_RENDER_PASS_CREATE_INFO, nullptr, 0,
-        sizeof(attachment_desc) / sizeof(VkAttachmentDescription), attachment_desc,
-        1, subpass_desc,
-        0, nullptr,
+        (uint32_t)attachment_desc.size(), attachment_desc.data(),
+        (uint32_t)subpass_desc.size(), subpass_desc.data(),
+        (uint32_t)m_dependencies.size(), m_dependencies.data(),
     };
 
-    VkResult res = vkCreateRenderPass(device.get_handle(), &create_info, nullptr, &m_handle);
+    VkResult res = vkCreateRenderPass(m_device.get_handle(), &create_info, nullptr, &m_handle);
     if (res != VK_SUCCESS) {
         throw vk_exception("Failed to create render pass: {}\n", res);
     }
 }
 
-vk_renderpass::~vk_renderpass()
+uint32_t vk_renderpass::get_color_attachment_count(uint32_t subpass) const
 {
-    vkDestroyRenderPass(m_device.get_handle(), m_handle, nullptr);
+    return m_subpasses.at(subpass).colors.size();
+}
+
+VkSampleCountFlagBits vk_renderpass::get_samples(uint32_t subpass) const
+{
+    // All the color and depth attachments of a subpass share the sample count,
+    // 0 means they don't.
+    const auto &s = m_subpasses.at(subpass);
+    auto samples = (VkSampleCountFlagBits)0;
+    auto check = [&](uint32_t a) {
+        if (a == VK_ATTACHMENT_UNUSED) {
+            return true;
+        }
+        if (samples && samples != m_attachments[a].samples) {
+            return false;
+        }
+        samples = m_attachments[a].samples;
+        return true;
+    };
+    for (uint32_t a: s.colors) {
+        if (!check(a)) {
+            return (VkSampleCountFlagBits)0;
+        }
+    }
+    if (!check(s.depth)) {
+        return (VkSampleCountFlagBits)0;
+    }
+    return samples ? samples : VK_SAMPLE_COUNT_1_BIT;
 }
 
 void vk_renderpass::set_clear_values(const std::vector<VkClearValue> &values)
@@ -228,12 +602,21 @@ vk_renderpass::scope vk_renderpass::begin(const vk_command_buffer &cmd_buffer, c
     return scope(cmd_buffer);
 }
 
+void vk_renderpass::next_subpass(const vk_command_buffer &cmd_buffer) const
+{
+    vkCmdNextSubpass(cmd_buffer.get_handle(), VK_SUBPASS_CONTENTS_INLINE);
+}
+
 
 //--
 
 
 vk_graphics_pipeline::vk_graphics_pipeline(const vk_device &device)
                     : m_device(device)
+                    , m_handle(VK_NULL_HANDLE)
+                    , m_renderpass(nullptr)
+                    , m_layout(nullptr)
+                    , m_subpass(0)
                     , m_topology(topology::triangle_list)
                     , m_primitive_restart(false)
                     , m_polygon_mode(polygon_mode::fill)
@@ -242,6 +625,12 @@ vk_graphics_pipeline::vk_graphics_pipeline(const vk_device &device)
 {
 }
 
+vk_graphics_pipeline::~vk_graphics_pipeline()
+{
+    destroy_retired(UINT64_MAX);
+    vkDestroyPipeline(m_device.get_handle(), m_handle, nullptr);
+}
+
 void vk_graphics_pipeline::add_stage(const vk_shader_module &shader, stringview entrypoint)
 {
     if (m_device != shader.get_device()) {
@@ -253,17 +642,23 @@ void vk_graphics_pipeline::add_stage(const vk_shader_module &shader, stringview
         }
     }
 
-    m_stages.emplace_back(shader, entrypoint.to_string());
+    m_stages.emplace_back(shader, entrypoint.to_string(), std::string());
 }
 
 void vk_graphics_pipeline::add_stage(vk_shader_module::stage s, stringview filename, stringview entrypoint)
 {
     add_stage(vk_shader_module(m_device, s, filename), entrypoint);
+    m_stages.back().filename = filename.to_string();
 }
 
 vk_graphics_pipeline::binding vk_graphics_pipeline::add_binding(const vk_buffer &buffer, input_rate rate)
 {
-    m_bindings.emplace_back(buffer, rate);
+    return add_binding(buffer, rate, {});
+}
+
+vk_graphics_pipeline::binding vk_graphics_pipeline::add_binding(const vk_buffer &buffer, input_rate rate, const std::vector<uint32_t> &locations)
+{
+    m_bindings.emplace_back(buffer, rate, locations);
     return m_bindings.size() - 1;
 }
 
@@ -299,15 +694,20 @@ void vk_graphics_pipeline::set_blending(bool enabled)
     m_blending.enabled = enabled;
 }
 
-void vk_graphics_pipeline::create(const vk_renderpass &render_pass, const vk_pipeline_layout &pipeline_layout)
+void vk_graphics_pipeline::create(const vk_renderpass &render_pass, const vk_pipeline_layout &pipeline_layout, uint32_t subpass)
 {
+    m_renderpass = &render_pass;
+    m_layout = &pipeline_layout;
+    m_subpass = subpass;
+
     auto shader_stages = std::vector<VkPipelineShaderStageCreateInfo>(m_stages.size());
     get_shader_info(shader_stages.data());
 
+    auto attributes = get_attributes();
     auto vs_binding_desc = std::vector<VkVertexInputBindingDescription>(m_bindings.size());
-    auto vs_attribute_desc = std::vector<VkVertexInputAttributeDescription>(m_attributes.size());
+    auto vs_attribute_desc = std::vector<VkVertexInputAttributeDescription>(attributes.size());
     VkPipelineVertexInputStateCreateInfo vertex_state_info;
-    get_bindings_info(&vertex_state_info, vs_binding_desc.data(), vs_attribute_desc.data());
+    get_bindings_info(&vertex_state_info, vs_binding_desc.data(), attributes, vs_attribute_desc.data());
 
     VkPipelineInputAssemblyStateCreateInfo input_assembly_info = {
         VK_STRUCTURE_TYPE_PIPELINE_INPUT_ASSEMBLY_STATE_CREATE_INFO, //type
@@ -347,7 +747,7 @@ void vk_graphics_pipeline::create(const vk_renderpass &render_pass, const vk_pip
         VK_STRUCTURE_TYPE_PIPELINE_MULTISAMPLE_STATE_CREATE_INFO, //type
         nullptr, //next
         0, //flags
-        VK_SAMPLE_COUNT_1_BIT, //rasterizationSamples is a VkSampleCountFlagBits specifying the number of samples per pixel used in rasterization.
+        render_pass.get_samples(subpass), //rasterizationSamples is a VkSampleCountFlagBits specifying the number of samples per pixel used in rasterization.
         false,                 //sampleShadingEnable specifies that fragment shading executes per-sample if VK_TRUE, or per-fragment if VK_FALSE,
                             //as described in Sample Shading.
         0,                     //minSampleShading is the minimum fraction of sample shading, as described in Sample Shading.
@@ -390,19 +790,17 @@ void vk_graphics_pipeline::create(const vk_renderpass &render_pass, const vk_pip
         0.f, //maxDepthBounds
     };
 
-    VkPipelineColorBlendAttachmentState colorblend_attachment_info[1] = {
-        {
-            m_blending.enabled, // blendEnable controls whether blending is enabled for the corresponding color attachment. If blending is not enabled, the source
-                                //fragment’s color for that attachment is passed through unmodified
-            VK_BLEND_FACTOR_SRC_ALPHA, //srcColorBlendFactor selects which blend factor is used to determine the source factors Sr,Sg,Sb
-            VK_BLEND_FACTOR_ONE_MINUS_SRC_ALPHA, //dstColorBlendFactor selects which blend factor is used to determine the destination factors Dr,Dg,Db
-            VK_BLEND_OP_ADD,      //colorBlendOp selects which blend operation is used to calculate the RGB values to write to the color attachment
-            VK_BLEND_FACTOR_ZERO, //srcAlphaBlendFactor selects which blend factor is used to determine the source factor Sa
-            VK_BLEND_FACTOR_ONE, //dstAlphaBlendFactor selects which blend factor is used to determine the destination factor Da
-            VK_BLEND_OP_ADD,      //alphaBlendOp selects which blend operation is use to calculate the alpha values to write to the color attachment
-            0xf,                  //colorWriteMask is a bitmask selecting which of the R, G, B, and/or A components are enabled for writing, as described later in this chapter
-        },
-    };
+    auto colorblend_attachment_info = std::vector<VkPipelineColorBlendAttachmentState>(render_pass.get_color_attachment_count(subpass), {
+        m_blending.enabled, // blendEnable controls whether blending is enabled for the corresponding color attachment. If blending is not enabled, the source
+                            //fragment’s color for that attachment is passed through unmodified
+        VK_BLEND_FACTOR_SRC_ALPHA, //srcColorBlendFactor selects which blend factor is used to determine the source factors Sr,Sg,Sb
+        VK_BLEND_FACTOR_ONE_MINUS_SRC_ALPHA, //dstColorBlendFactor selects which blend factor is used to determine the destination factors Dr,Dg,Db
+        VK_BLEND_OP_ADD,      //colorBlendOp selects which blend operation is used to calculate the RGB values to write to the color attachment
+        VK_BLEND_FACTOR_ZERO, //srcAlphaBlendFactor selects which blend factor is used to determine the source factor Sa
+        VK_BLEND_FACTOR_ONE, //dstAlphaBlendFactor selects which blend factor is used to determine the destination factor Da
+        VK_BLEND_OP_ADD,      //alphaBlendOp selects which blend operation is use to calculate the alpha values to write to the color attachment
+        0xf,                  //colorWriteMask is a bitmask selecting which of the R, G, B, and/or A components are enabled for writing, as described later in this chapter
+    });
 
     VkPipelineColorBlendStateCreateInfo colorblend_info = {
         VK_STRUCTURE_TYPE_PIPELINE_COLOR_BLEND_STATE_CREATE_INFO, //Type is the type of this structure.
@@ -410,9 +808,9 @@ void vk_graphics_pipeline::create(const vk_renderpass &render_pass, const vk_pip
         0,                                                        //flags is reserved for future use.
         0,                                                        //logicOpEnable controls whether to apply Logical Operations.
         VK_LOGIC_OP_CLEAR,                                        //logicOp selects which logical operation to apply.
-        1,                                                        //attachmentCount is the number of VkPipelineColorBlendAttachmentState elements in pAttachments.
+        (uint32_t)colorblend_attachment_info.size(),              //attachmentCount is the number of VkPipelineColorBlendAttachmentState elements in pAttachments.
                                                                 //This value must equal the colorAttachmentCount for the subpass in which this pipeline is used.
-        colorblend_attachment_info,                               //pAttachments: pointer to array of per target attachment states
+        colorblend_attachment_info.data(),                        //pAttachments: pointer to array of per target attachment states
         {0,0,0,0},                                                //blendConstants is an array of four values used as the R, G, B, and A components of the blend
                                                                 //constant that are used in blending, depending on the blend factor.
     };
@@ -446,7 +844,7 @@ void vk_graphics_pipeline::create(const vk_renderpass &render_pass, const vk_pip
         &dynamicstate_info, //pDynamicState is a pointer to VkPipelineDynamicStateCreateInfo and is used to indicate which properties of the pipeline state object are dynamic and can be changed independently of the pipeline state. This can be NULL, which means no state in the pipeline is considered dynamic
         pipeline_layout.get_handle(), //layout is the description of binding locations used by both the pipeline and descriptor sets used with the pipeline
         render_pass.get_handle(), //renderPass is a handle to a render pass object describing the environment in which the pipeline will be used; the pipeline can be used with an instance of any render pass compatible with the one provided. See Render Pass Compatibility for more information
-        0, //subpass is the index of the subpass in renderPass where this pipeline will be used
+        subpass, //subpass is the index of the subpass in renderPass where this pipeline will be used
         VK_NULL_HANDLE, //basePipelineHandle is a pipeline to derive from
         0, //basePipelineIndex is an index into the pCreateInfos parameter to use as a pipeline to derive from
     };
@@ -457,6 +855,51 @@ void vk_graphics_pipeline::create(const vk_renderpass &render_pass, const vk_pip
     }
 }
 
+bool vk_graphics_pipeline::uses_file(stringview filename) const
+{
+    for (const shader_stage &stg: m_stages) {
+        if (stg.filename == filename) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void vk_graphics_pipeline::reload(uint64_t last_use)
+{
+    if (!m_renderpass) {
+        throw vk_exception("Cannot reload a graphics pipeline that was never created.\n");
+    }
+
+    auto stages = m_stages;
+    VkPipeline handle = m_handle;
+    try {
+        for (shader_stage &stg: m_stages) {
+            if (!stg.filename.empty()) {
+                stg.shader = vk_shader_module(m_device, stg.shader.get_stage(), stg.filename);
+            }
+        }
+        create(*m_renderpass, *m_layout, m_subpass);
+    } catch (...) {
+        m_stages = stages;
+        m_handle = handle;
+        throw;
+    }
+
+    m_retired.push_back({ last_use, handle });
+}
+
+void vk_graphics_pipeline::destroy_retired(uint64_t completed)
+{
+    auto done = [completed](const std::pair<uint64_t, VkPipeline> &p) { return p.first <= completed; };
+    for (const auto &p: m_retired) {
+        if (done(p)) {
+            vkDestroyPipeline(m_device.get_handle(), p.second, nullptr);
+        }
+    }
+    m_retired.erase(std::remove_if(m_retired.begin(), m_retired.end(), done), m_retired.end());
+}
+
 void vk_graphics_pipeline::set_in_command_buffer(const vk_command_buffer &cmd_buffer) const
 {
     vkCmdBindPipeline(cmd_buffer.get_handle(), VK_PIPELINE_BIND_POINT_GRAPHICS, m_handle);
@@ -487,14 +930,49 @@ void vk_graphics_pipeline::get_shader_info(VkPipelineShaderStageCreateInfo *info
     }
 }
 
-void vk_graphics_pipeline::get_bindings_info(VkPipelineVertexInputStateCreateInfo *info, VkVertexInputBindingDescription *binding_desc, VkVertexInputAttributeDescription *attr_desc)
+std::vector<vk_graphics_pipeline::attribute> vk_graphics_pipeline::get_attributes() const
+{
+    auto attributes = m_attributes;
+
+    auto vertex_stage = std::find_if(m_stages.begin(), m_stages.end(), [](const shader_stage &stg) {
+        return stg.shader.get_stage() == vk_shader_module::stage::vertex;
+    });
+
+    uint32_t i = 0;
+    for (const binding_state &bind: m_bindings) {
+        uint32_t b = i++;
+        if (bind.locations.empty()) {
+            continue;
+        }
+        if (vertex_stage == m_stages.end()) {
+            throw vk_exception("Cannot derive the attributes of vertex binding {} without a vertex stage.\n", b);
+        }
+
+        uint32_t offset = 0;
+        for (uint32_t location: bind.locations) {
+            const auto *input = vertex_stage->shader.get_reflection().find_input(location);
+            if (!input) {
+                throw vk_exception("The vertex shader has no input at location {}.\n", location);
+            }
+            attributes.emplace_back(b, location, input->format, offset);
+            offset += input->size;
+        }
+        if (offset != bind.buffer.stride()) {
+            throw vk_exception("Vertex binding {} has a stride of {} bytes but the shader inputs need {} bytes.\n", b, bind.buffer.stride(), offset);
+        }
+    }
+    return attributes;
+}
+
+void vk_graphics_pipeline::get_bindings_info(VkPipelineVertexInputStateCreateInfo *info, VkVertexInputBindingDescription *binding_desc,
+                                             const std::vector<attribute> &attributes, VkVertexInputAttributeDescription *attr_desc)
 {
     info->sType = VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO;
     info->pNext = nullptr;
     info->flags = 0;
     info->vertexBindingDescriptionCount = m_bindings.size();
     info->pVertexBindingDescriptions = binding_desc;
-    info->vertexAttributeDescriptionCount = m_attributes.size();
+    info->vertexAttributeDescriptionCount = attributes.size();
     info->pVertexAttributeDescriptions = attr_desc;
 
     int i = 0;
@@ -505,7 +983,7 @@ void vk_graphics_pipeline::get_bindings_info(VkPipelineVertexInputStateCreateInf
         ++binding_desc;
     }
 
-    for (const attribute &attr: m_attributes) {
+    for (const attribute &attr: attributes) {
         attr_desc->location = attr.location;
         attr_desc->binding = attr.bind;
         attr_desc->format = attr.format;
@@ -523,14 +1001,61 @@ vk_framebuffer::vk_framebuffer(const vk_device &device, const vk_image &img, con
               , m_image(img)
               , m_view(m_image.create_image_view(vk_image::aspect::color))
 {
-    VkImageView view_handles[] = { m_view.get_handle(), depth.get_handle() };
+    if (rpass.get_samples() != VK_SAMPLE_COUNT_1_BIT) {
+        throw vk_exception("A multisampled render pass needs a multisampled color attachment.\n");
+    }
+    create(rpass, { m_view.get_handle(), depth.get_handle() });
+}
+
+vk_framebuffer::vk_framebuffer(const vk_device &device, const vk_image &img, const vk_image_view &depth, const vk_image_view &multisampled_color, const vk_renderpass &rpass)
+              : m_device(device)
+              , m_image(img)
+              , m_view(m_image.create_image_view(vk_image::aspect::color))
+{
+    if (rpass.get_samples() == VK_SAMPLE_COUNT_1_BIT) {
+        throw vk_exception("A render pass without multisampling cannot resolve into the framebuffer image.\n");
+    }
+    create(rpass, { multisampled_color.get_handle(), depth.get_handle(), m_view.get_handle() });
+}
+
+vk_framebuffer::vk_framebuffer(const vk_device &device, const vk_image &img, const std::vector<vk_image_view> &attachments, const vk_renderpass &rpass)
+              : m_device(device)
+              , m_image(img)
+{
+    auto views = std::vector<VkImageView>();
+    for (const vk_image_view &view: attachments) {
+        views.push_back(view.get_handle());
+    }
+    create(rpass, views);
+}
+
+vk_framebuffer::vk_framebuffer(vk_framebuffer &&fb)
+              : m_device(fb.m_device)
+              , m_image(fb.m_image)
+              , m_view(fb.m_view)
+              , m_handle(fb.m_handle)
+{
+    fb.m_handle = VK_NULL_HANDLE;
+}
+
+vk_framebuffer::~vk_framebuffer()
+{
+    vkDestroyFramebuffer(m_device.get_handle(), m_handle, nullptr);
+}
+
+void vk_framebuffer::create(const vk_renderpass &rpass, const std::vector<VkImageView> &views)
+{
+    if (views.size() != rpass.get_attachment_count()) {
+        throw vk_exception("The framebuffer has {} attachments but the render pass needs {}.\n", views.size(), rpass.get_attachment_count());
+    }
+
     VkFramebufferCreateInfo info = {
         VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO, //type
         nullptr, //next
         0, //flags
         rpass.get_handle(), //render pass
-        sizeof(view_handles) / sizeof(VkImageView), //attachment count
-        view_handles, //attachments
+        (uint32_t)views.size(), //attachment count
+        views.data(), //attachments
         m_image.get_width(), //width
         m_image.get_height(), //height
         1, //layers
@@ -51,6 +51,8 @@ public:
         };
         vkUpdateDescriptorSets(m_device.get_handle(), 1, descset_writes, 0, nullptr);
     }
+    // A combined image sampler at binding 0
+    void update(const vk_image_view &view, const vk_sampler &sampler, VkImageLayout layout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL);
 
     VkDescriptorSet get_handle() const { return m_handle; }
 
@@ -72,11 +74,16 @@ public:
         vk_shader_module::stage shader_stages;
     };
 
-    vk_descriptor_set_layout(const vk_device &device, const std::vector<binding> &bindings);
+    // Update after bind layouts can only be allocated from update after bind pools,
+    // their bindings are also partially bound
+    vk_descriptor_set_layout(const vk_device &device, const std::vector<binding> &bindings, bool update_after_bind = false);
+    vk_descriptor_set_layout(const vk_device &device, const std::vector<vk_shader_module> &modules, uint32_t set = 0);
 
     VkDescriptorSetLayout get_handle() const { return m_handle; }
 
 private:
+    static std::vector<binding> get_bindings(const std::vector<vk_shader_module> &modules, uint32_t set);
+
     VkDescriptorSetLayout m_handle;
 };
 
@@ -84,6 +91,7 @@ class vk_descriptor_pool
 {
 public:
     vk_descriptor_pool(const vk_device &device, const std::vector<std::pair<vk_descriptor::type, uint32_t>> &sizes);
+    vk_descriptor_pool(const vk_device &device, const std::vector<std::pair<vk_descriptor::type, uint32_t>> &sizes, uint32_t max_sets, bool update_after_bind);
     ~vk_descriptor_pool();
 
     vk_descriptor_set allocate_descriptor_set(const vk_descriptor_set_layout &descset_layout);
@@ -99,15 +107,63 @@ class vk_pipeline_layout
 {
 public:
     vk_pipeline_layout(const vk_device &device, const vk_descriptor_set_layout &descset_layout);
+    vk_pipeline_layout(const vk_device &device, const vk_descriptor_set_layout &descset_layout, const std::vector<vk_shader_module> &modules);
+    // The layout at index i is used for set i
+    vk_pipeline_layout(const vk_device &device, const std::vector<const vk_descriptor_set_layout *> &descset_layouts, const std::vector<vk_shader_module> &modules);
     ~vk_pipeline_layout();
 
     VkPipelineLayout get_handle() const { return m_handle; }
 
 private:
+    void create(const std::vector<const vk_descriptor_set_layout *> &descset_layouts, const std::vector<VkPushConstantRange> &push_constants);
+
     VkPipelineLayout m_handle;
     const vk_device &m_device;
 };
 
+// One descriptor set holding every texture and storage buffer, indexed from the
+// shaders with the values returned by add_image() and add_buffer():
+//   layout(set = N, binding = 0) uniform sampler2D textures[];
+//   layout(set = N, binding = 1) buffer buffers { ... } data[];
+// Descriptors can be added while the set is bound, but an index must not be
+// removed while a frame in flight may still use it. The array sizes are clamped
+// to the device's update after bind limits, which images and buffers share.
+class vk_bindless_set
+{
+public:
+    vk_bindless_set(const vk_device &device, uint32_t max_images, uint32_t max_buffers);
+    vk_bindless_set(const vk_bindless_set &) = delete;
+
+    uint32_t add_image(const vk_image_view &view, VkSampler sampler, VkImageLayout layout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL);
+    uint32_t add_buffer(const vk_buffer &buffer, VkDeviceSize offset = 0, VkDeviceSize size = VK_WHOLE_SIZE);
+    void remove_image(uint32_t index);
+    void remove_buffer(uint32_t index);
+
+    void bind(const vk_command_buffer &cmd_buffer, VkPipelineBindPoint bind_point, const vk_pipeline_layout &layout, uint32_t set = 0) const;
+
+    const vk_descriptor_set_layout &get_layout() const { return m_layout; }
+    VkDescriptorSet get_handle() const { return m_set.get_handle(); }
+
+private:
+    struct slots {
+        uint32_t take(uint32_t max);
+        void release(uint32_t index);
+
+        uint32_t count = 0;
+        std::vector<uint32_t> free;
+    };
+    void write(uint32_t binding, uint32_t index, VkDescriptorType type, const VkDescriptorImageInfo *image, const VkDescriptorBufferInfo *buffer);
+
+    const vk_device &m_device;
+    uint32_t m_max_images;
+    uint32_t m_max_buffers;
+    vk_descriptor_set_layout m_layout;
+    vk_descriptor_pool m_pool;
+    vk_descriptor_set m_set;
+    slots m_images;
+    slots m_buffers;
+};
+
 class vk_renderpass
 {
 public:
@@ -127,17 +183,63 @@ public:
         friend vk_renderpass;
     };
 
-    vk_renderpass(const vk_device &device, VkFormat format, VkFormat depth_format);
+    enum class load_op {
+        load = VK_ATTACHMENT_LOAD_OP_LOAD,
+        clear = VK_ATTACHMENT_LOAD_OP_CLEAR,
+        dont_care = VK_ATTACHMENT_LOAD_OP_DONT_CARE,
+    };
+    enum class store_op {
+        store = VK_ATTACHMENT_STORE_OP_STORE,
+        dont_care = VK_ATTACHMENT_STORE_OP_DONT_CARE,
+    };
+    struct attachment {
+        VkFormat format;
+        VkSampleCountFlagBits samples;
+        load_op load;
+        store_op store;
+        VkImageLayout initial_layout;
+        VkImageLayout final_layout;
+        load_op stencil_load = load_op::dont_care;
+        store_op stencil_store = store_op::dont_care;
+    };
+    struct subpass {
+        std::vector<uint32_t> inputs;
+        std::vector<uint32_t> colors;
+        // Either empty or one per color attachment, VK_ATTACHMENT_UNUSED to skip one
+        std::vector<uint32_t> resolves;
+        uint32_t depth = VK_ATTACHMENT_UNUSED;
+        std::vector<uint32_t> preserves;
+    };
+
+    // Builds the render pass with add_attachment(), add_subpass(), add_dependency() and create()
+    explicit vk_renderpass(const vk_device &device);
+    // One subpass rendering to a color and a depth attachment, multisampled
+    // ones are resolved into attachment 2 at the end of the subpass
+    vk_renderpass(const vk_device &device, VkFormat format, VkFormat depth_format, VkSampleCountFlagBits samples = VK_SAMPLE_COUNT_1_BIT);
+    vk_renderpass(const vk_renderpass &) = delete;
     ~vk_renderpass();
 
+    uint32_t add_attachment(const attachment &a);
+    uint32_t add_subpass(const subpass &s);
+    void add_dependency(uint32_t src_subpass, uint32_t dst_subpass, VkPipelineStageFlags src_stages, VkPipelineStageFlags dst_stages,
+                        VkAccessFlags src_access, VkAccessFlags dst_access, bool by_region = true);
+    void create();
+
     void set_clear_values(const std::vector<VkClearValue> &values);
     scope begin(const vk_command_buffer &cmd_buffer, const vk_framebuffer &framebuffer);
+    void next_subpass(const vk_command_buffer &cmd_buffer) const;
 
     VkRenderPass get_handle() const { return m_handle; }
+    uint32_t get_attachment_count() const { return m_attachments.size(); }
+    uint32_t get_color_attachment_count(uint32_t subpass) const;
+    VkSampleCountFlagBits get_samples(uint32_t subpass = 0) const;
 
 private:
     VkRenderPass m_handle;
     const vk_device &m_device;
+    std::vector<attachment> m_attachments;
+    std::vector<subpass> m_subpasses;
+    std::vector<VkSubpassDependency> m_dependencies;
     std::vector<VkClearValue> m_clear_values;
 };
 
@@ -189,11 +291,14 @@ public:
     };
 
     explicit vk_graphics_pipeline(const vk_device &device);
+    vk_graphics_pipeline(const vk_graphics_pipeline &) = delete;
+    ~vk_graphics_pipeline();
 
     void add_stage(const vk_shader_module &shader, stringview entrypoint);
     void add_stage(vk_shader_module::stage s, stringview filename, stringview entrypoint);
 
     binding add_binding(const vk_buffer &buffer, input_rate rate);
+    binding add_binding(const vk_buffer &buffer, input_rate rate, const std::vector<uint32_t> &locations);
     void add_attribute(binding b, uint32_t location, VkFormat format, uint32_t offset);
     void set_primitive_mode(topology topology, bool primitive_restart_enable);
 
@@ -204,22 +309,40 @@ public:
 
     VkPipeline get_handle() const { return m_handle; }
 
-    void create(const vk_renderpass &render_pass, const vk_pipeline_layout &pipeline_layout);
+    void create(const vk_renderpass &render_pass, const vk_pipeline_layout &pipeline_layout, uint32_t subpass = 0);
     void set_in_command_buffer(const vk_command_buffer &cmd_buffer) const;
 
+    bool uses_file(stringview filename) const;
+    // Recreates the pipeline with the shaders loaded again from their files. The old
+    // one is kept, as the frame signaling last_use on the caller's timeline or any
+    // before it may still use it.
+    void reload(uint64_t last_use);
+    // Destroys the old pipelines whose frames are done, completed being the value
+    // the timeline reached
+    void destroy_retired(uint64_t completed);
+
 private:
+    struct attribute;
     void get_shader_info(VkPipelineShaderStageCreateInfo *info);
-    void get_bindings_info(VkPipelineVertexInputStateCreateInfo *info, VkVertexInputBindingDescription *binding_desc, VkVertexInputAttributeDescription *attr_desc);
+    std::vector<attribute> get_attributes() const;
+    void get_bindings_info(VkPipelineVertexInputStateCreateInfo *info, VkVertexInputBindingDescription *binding_desc,
+                           const std::vector<attribute> &attributes, VkVertexInputAttributeDescription *attr_desc);
 
     const vk_device &m_device;
     VkPipeline m_handle;
+    std::vector<std::pair<uint64_t, VkPipeline>> m_retired;
+    const vk_renderpass *m_renderpass;
+    const vk_pipeline_layout *m_layout;
+    uint32_t m_subpass;
     struct shader_stage {
-        shader_stage(const vk_shader_module &module, const std::string &ep)
+        shader_stage(const vk_shader_module &module, const std::string &ep, const std::string &file)
             : shader(module)
             , entrypoint(ep)
+            , filename(file)
         {}
         vk_shader_module shader;
         std::string entrypoint;
+        std::string filename;
     };
     std::vector<shader_stage> m_stages;
     struct attribute {
@@ -236,9 +359,10 @@ private:
     };
     std::vector<attribute> m_attributes;
     struct binding_state {
-        binding_state(const vk_buffer &buf, input_rate r) : buffer(buf), rate(r) {}
+        binding_state(const vk_buffer &buf, input_rate r, const std::vector<uint32_t> &locs) : buffer(buf), rate(r), locations(locs) {}
         const vk_buffer &buffer;
         input_rate rate;
+        std::vector<uint32_t> locations;
     };
     std::vector<binding_state> m_bindings;
 
@@ -259,6 +383,13 @@ class vk_framebuffer
 {
 public:
     vk_framebuffer(const vk_device &device, const vk_image &img, const vk_image_view &depth, const vk_renderpass &rpass);
+    // The multisampled color attachment is resolved into img
+    vk_framebuffer(const vk_device &device, const vk_image &img, const vk_image_view &depth, const vk_image_view &multisampled_color, const vk_renderpass &rpass);
+    // One view per render pass attachment, img gives the framebuffer size
+    vk_framebuffer(const vk_device &device, const vk_image &img, const std::vector<vk_image_view> &attachments, const vk_renderpass &rpass);
+    vk_framebuffer(const vk_framebuffer &) = delete;
+    vk_framebuffer(vk_framebuffer &&fb);
+    ~vk_framebuffer();
 
     uint32_t get_width() const { return m_image.get_width(); }
     uint32_t get_height() const { return m_image.get_height(); }
@@ -267,6 +398,8 @@ public:
     VkFramebuffer get_handle() const { return m_handle; }
 
 private:
+    void create(const vk_renderpass &rpass, const std::vector<VkImageView> &views);
+
     const vk_device &m_device;
     const vk_image &m_image;
     vk_image_view m_view;
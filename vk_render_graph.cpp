@@ -0,0 +1,448 @@
+
+#include <algorithm>
+
+#include "vk_render_graph.h"
+
+namespace {
+
+const uint32_t none = UINT32_MAX;
+
+struct access_info {
+    VkPipelineStageFlags stages;
+    VkAccessFlags access;
+    VkImageLayout layout;
+    bool write;
+};
+
+access_info get_access_info(vk_render_graph::access a)
+{
+    using access = vk_render_graph::access;
+    switch (a) {
+    case access::undefined:
+        return { 0, 0, VK_IMAGE_LAYOUT_UNDEFINED, false };
+    case access::color_attachment:
+        return { VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT, VK_ACCESS_COLOR_ATTACHMENT_READ_BIT | VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT,
+                 VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL, true };
+    case access::depth_attachment:
+        return { VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT | VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT,
+                 VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_READ_BIT | VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT,
+                 VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL, true };
+    case access::depth_read:
+        return { VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT | VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT, VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_READ_BIT,
+                 VK_IMAGE_LAYOUT_DEPTH_STENCIL_READ_ONLY_OPTIMAL, false };
+    case access::sampled:
+        return { VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, VK_ACCESS_SHADER_READ_BIT, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL, false };
+    case access::input_attachment:
+        return { VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, VK_ACCESS_INPUT_ATTACHMENT_READ_BIT, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL, false };
+    case access::transfer_src:
+        return { VK_PIPELINE_STAGE_TRANSFER_BIT, VK_ACCESS_TRANSFER_READ_BIT, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, false };
+    case access::transfer_dst:
+        return { VK_PIPELINE_STAGE_TRANSFER_BIT, VK_ACCESS_TRANSFER_WRITE_BIT, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, true };
+    case access::present:
+        return { VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, 0, VK_IMAGE_LAYOUT_PRESENT_SRC_KHR, false };
+    case access::vertex_buffer:
+        return { VK_PIPELINE_STAGE_VERTEX_INPUT_BIT, VK_ACCESS_VERTEX_ATTRIBUTE_READ_BIT, VK_IMAGE_LAYOUT_UNDEFINED, false };
+    case access::index_buffer:
+        return { VK_PIPELINE_STAGE_VERTEX_INPUT_BIT, VK_ACCESS_INDEX_READ_BIT, VK_IMAGE_LAYOUT_UNDEFINED, false };
+    case access::uniform_buffer:
+        return { VK_PIPELINE_STAGE_VERTEX_SHADER_BIT | VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, VK_ACCESS_UNIFORM_READ_BIT, VK_IMAGE_LAYOUT_UNDEFINED, false };
+    }
+    return { 0, 0, VK_IMAGE_LAYOUT_UNDEFINED, false };
+}
+
+// An image starting the graph undefined was most likely written the same way by
+// the previous frame, the transition discarding its contents must wait for that
+access_info get_previous_frame_access(vk_render_graph::access a)
+{
+    using access = vk_render_graph::access;
+    switch (a) {
+    case access::color_attachment:
+        return { VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT, VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT, VK_IMAGE_LAYOUT_UNDEFINED, true };
+    case access::depth_attachment:
+        return { VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT, VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT, VK_IMAGE_LAYOUT_UNDEFINED, true };
+    case access::transfer_dst:
+        return { VK_PIPELINE_STAGE_TRANSFER_BIT, VK_ACCESS_TRANSFER_WRITE_BIT, VK_IMAGE_LAYOUT_UNDEFINED, true };
+    default:
+        return { get_access_info(a).stages, 0, VK_IMAGE_LAYOUT_UNDEFINED, false };
+    }
+}
+
+vk_image::usage get_image_usage(vk_render_graph::access a)
+{
+    using access = vk_render_graph::access;
+    switch (a) {
+    case access::color_attachment: return vk_image::usage::color_attachment;
+    case access::depth_attachment:
+    case access::depth_read: return vk_image::usage::depth_stencil_attachment;
+    case access::sampled: return vk_image::usage::sampled;
+    case access::input_attachment: return vk_image::usage::input_attachment;
+    case access::transfer_src: return vk_image::usage::transfer_src;
+    case access::transfer_dst: return vk_image::usage::transfer_dst;
+    default: return (vk_image::usage)0;
+    }
+}
+
+}
+
+vk_render_graph::pass::pass(const std::string &name, const record_func &record)
+                     : m_name(name)
+                     , m_record(record)
+                     , m_enabled(true)
+{
+}
+
+vk_render_graph::pass &vk_render_graph::pass::read(resource r, access a)
+{
+    m_reads.push_back({ r, a });
+    return *this;
+}
+
+vk_render_graph::pass &vk_render_graph::pass::write(resource r, access a)
+{
+    m_writes.push_back({ r, a });
+    return *this;
+}
+
+
+//--
+
+
+vk_render_graph::vk_render_graph(const vk_device &device)
+               : m_device(device)
+               , m_queries(nullptr)
+               , m_queries_recorded(false)
+{
+}
+
+vk_render_graph::resource vk_render_graph::import_image(vk_image::aspect aspect, access initial)
+{
+    m_resources.push_back({ true, false, nullptr, nullptr, aspect, initial, false, access::undefined, VK_FORMAT_UNDEFINED, { 0, 0, 0 }, none, none });
+    return m_resources.size() - 1;
+}
+
+vk_render_graph::resource vk_render_graph::import_buffer(const vk_buffer &buffer)
+{
+    m_resources.push_back({ false, false, nullptr, &buffer, vk_image::aspect::color, access::undefined, false, access::undefined, VK_FORMAT_UNDEFINED, { 0, 0, 0 }, none, none });
+    return m_resources.size() - 1;
+}
+
+vk_render_graph::resource vk_render_graph::create_image(VkFormat format, vk_image::aspect aspect, const VkExtent3D &extent)
+{
+    m_resources.push_back({ true, true, nullptr, nullptr, aspect, access::undefined, false, access::undefined, format, extent, none, none });
+    return m_resources.size() - 1;
+}
+
+void vk_render_graph::set_image(resource r, const vk_image &image)
+{
+    if (m_resources.at(r).transient) {
+        throw vk_exception("Cannot replace the image of a transient render graph resource.\n");
+    }
+    m_resources[r].image = &image;
+}
+
+const vk_image &vk_render_graph::get_image(resource r) const
+{
+    const vk_image *image = m_resources.at(r).image;
+    if (!image) {
+        throw vk_exception("Render graph resource {} has no image. Transient images are created by compile().\n", r);
+    }
+    return *image;
+}
+
+vk_render_graph::pass &vk_render_graph::add_pass(const std::string &name, const record_func &record)
+{
+    m_passes.push_back(pass(name, record));
+    return m_passes.back();
+}
+
+void vk_render_graph::set_output(resource r, access a)
+{
+    m_resources.at(r).output = true;
+    m_resources[r].final = a;
+}
+
+void vk_render_graph::compile()
+{
+    cull_passes();
+
+    allocate_transients();
+
+    auto states = std::vector<state>(m_resources.size());
+    for (resource r = 0; r < m_resources.size(); ++r) {
+        auto info = get_access_info(m_resources[r].initial);
+        states[r] = { info.stages, info.write ? info.access : 0, info.layout };
+    }
+
+    uint32_t index = 0;
+    for (pass &p: m_passes) {
+        p.m_barriers = pass::barrier_batch();
+        if (!p.m_enabled) {
+            ++index;
+            continue;
+        }
+
+        // An aliased image starts with undefined contents, but must wait for the
+        // previous user of its memory to be done with it.
+        for (resource r = 0; r < m_resources.size(); ++r) {
+            const resource_data &res = m_resources[r];
+            if (res.transient && res.first_use == index && res.alias_of != none) {
+                states[r] = { states[res.alias_of].stages, states[res.alias_of].writes, VK_IMAGE_LAYOUT_UNDEFINED };
+            }
+        }
+        ++index;
+        for (const auto &u: p.m_reads) {
+            add_barrier(p.m_barriers, u.res, states[u.res], u.acc);
+        }
+        for (const auto &u: p.m_writes) {
+            add_barrier(p.m_barriers, u.res, states[u.res], u.acc);
+        }
+    }
+
+    m_final_barriers = pass::barrier_batch();
+    for (resource r = 0; r < m_resources.size(); ++r) {
+        if (m_resources[r].output && m_resources[r].final != access::undefined) {
+            add_barrier(m_final_barriers, r, states[r], m_resources[r].final);
+        }
+    }
+}
+
+void vk_render_graph::cull_passes()
+{
+    // Walk the passes backwards and keep only the ones which write something
+    // that is either an output of the graph or is read by a pass we keep.
+    auto needed = std::vector<bool>(m_resources.size(), false);
+    for (resource r = 0; r < m_resources.size(); ++r) {
+        needed[r] = m_resources[r].output;
+    }
+
+    for (auto it = m_passes.rbegin(); it != m_passes.rend(); ++it) {
+        pass &p = *it;
+        p.m_enabled = false;
+        for (const auto &u: p.m_writes) {
+            p.m_enabled = p.m_enabled || needed.at(u.res);
+        }
+        if (p.m_enabled) {
+            for (const auto &u: p.m_reads) {
+                needed.at(u.res) = true;
+            }
+        }
+    }
+}
+
+void vk_render_graph::allocate_transients()
+{
+    m_transient_images.clear();
+    m_transient_memory.clear();
+
+    struct lifetime {
+        uint32_t first = UINT32_MAX;
+        uint32_t last = 0;
+        int usage = 0;
+    };
+    auto lifetimes = std::vector<lifetime>(m_resources.size());
+
+    uint32_t index = 0;
+    for (const pass &p: m_passes) {
+        if (p.m_enabled) {
+            for (const auto *uses: { &p.m_reads, &p.m_writes }) {
+                for (const auto &u: *uses) {
+                    lifetime &l = lifetimes[u.res];
+                    l.first = std::min(l.first, index);
+                    l.last = std::max(l.last, index);
+                    l.usage |= (int)get_image_usage(u.acc);
+                }
+            }
+        }
+        ++index;
+    }
+
+    auto order = std::vector<resource>();
+    for (resource r = 0; r < m_resources.size(); ++r) {
+        if (m_resources[r].transient && lifetimes[r].first != none) {
+            if (m_resources[r].output) {
+                lifetimes[r].last = index;
+            }
+            order.push_back(r);
+        }
+    }
+    std::sort(order.begin(), order.end(), [&](resource a, resource b) { return lifetimes[a].first < lifetimes[b].first; });
+
+    // Transient images whose lifetimes do not overlap share the same memory.
+    struct slot {
+        bool lazy;
+        uint64_t size;
+        uint32_t type_bits;
+        uint32_t last;
+        resource last_user;
+        std::vector<vk_image *> images;
+    };
+    auto slots = std::vector<slot>();
+    auto predecessors = std::vector<resource>(m_resources.size(), none);
+    for (resource r: order) {
+        resource_data &res = m_resources[r];
+        auto usage = (vk_image::usage)lifetimes[r].usage;
+
+        // Images which are only ever used as attachments within this graph never
+        // need their contents in memory, so they can use lazily allocated memory.
+        const int attachment_usage = (int)(vk_image::usage::color_attachment | vk_image::usage::depth_stencil_attachment | vk_image::usage::input_attachment);
+        bool lazy = !(lifetimes[r].usage & ~attachment_usage) && !res.output;
+        if (lazy) {
+            usage |= vk_image::usage::transient_attachment;
+        }
+        m_transient_images.push_back(std::make_unique<vk_image>(m_device, res.format, usage, vk_image::type::t2D, res.extent));
+        res.image = m_transient_images.back().get();
+
+        auto it = std::find_if(slots.begin(), slots.end(), [&](const slot &s) {
+            return s.lazy == lazy && s.last < lifetimes[r].first && (s.type_bits & res.image->get_required_memory_type());
+        });
+        if (it == slots.end()) {
+            slots.push_back({ lazy, 0, res.image->get_required_memory_type(), 0, none, {} });
+            it = slots.end() - 1;
+        }
+        it->size = std::max(it->size, res.image->get_required_memory_size());
+        it->type_bits &= res.image->get_required_memory_type();
+        it->last = lifetimes[r].last;
+        predecessors[r] = it->last_user;
+        it->last_user = r;
+        it->images.push_back(m_transient_images.back().get());
+    }
+
+    for (const slot &s: slots) {
+        auto props = s.lazy ? vk_device_memory::property::lazily_allocated | vk_device_memory::property::device_local : vk_device_memory::property::device_local;
+        m_transient_memory.push_back(std::make_unique<vk_device_memory>(m_device, std::initializer_list<vk_device_memory::property>{ props, vk_device_memory::property::device_local }, s.size, s.type_bits));
+        for (vk_image *image: s.images) {
+            image->bind_memory(m_transient_memory.back().get(), 0);
+        }
+    }
+
+    for (resource r: order) {
+        m_resources[r].first_use = lifetimes[r].first;
+        m_resources[r].alias_of = predecessors[r];
+    }
+}
+
+void vk_render_graph::add_barrier(pass::barrier_batch &batch, resource r, state &s, access a) const
+{
+    auto info = get_access_info(a);
+    bool is_image = m_resources[r].is_image;
+
+    if (is_image && info.layout != s.layout) {
+        auto src = s.stages ? access_info{ s.stages, s.writes, s.layout, false } : get_previous_frame_access(a);
+        batch.src_stages |= src.stages;
+        batch.dst_stages |= info.stages;
+        batch.barriers.push_back({ r, src.access, info.access, s.layout, info.layout });
+    } else if (s.writes) {
+        batch.src_stages |= s.stages;
+        batch.dst_stages |= info.stages;
+        batch.barriers.push_back({ r, s.writes, info.access, s.layout, s.layout });
+    } else if (info.write && s.stages) {
+        // Write after read only needs an execution dependency
+        batch.src_stages |= s.stages;
+        batch.dst_stages |= info.stages;
+    } else {
+        s.stages |= info.stages;
+        return;
+    }
+
+    s = { info.stages, info.write ? info.access : 0, is_image ? info.layout : s.layout };
+}
+
+void vk_render_graph::execute(const vk_command_buffer &cmd_buffer)
+{
+    if (m_queries) {
+        m_queries->reset(cmd_buffer, 0, m_passes.size() * 2);
+        m_queries_recorded = true;
+    }
+
+    uint32_t index = 0;
+    for (const pass &p: m_passes) {
+        if (p.m_enabled) {
+            emit(cmd_buffer, p.m_barriers);
+            if (m_queries) {
+                m_queries->write_timestamp(cmd_buffer, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, index * 2);
+            }
+            p.m_record(cmd_buffer);
+            if (m_queries) {
+                m_queries->write_timestamp(cmd_buffer, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, index * 2 + 1);
+            }
+        }
+        ++index;
+    }
+    emit(cmd_buffer, m_final_barriers);
+}
+
+void vk_render_graph::set_timestamp_queries(const vk_query_pool *pool)
+{
+    if (pool && pool->get_count() < m_passes.size() * 2) {
+        throw vk_exception("The render graph needs {} timestamp queries but the pool has only {}.\n", m_passes.size() * 2, pool->get_count());
+    }
+    m_queries = pool;
+    m_queries_recorded = false;
+}
+
+std::vector<vk_render_graph::pass_timing> vk_render_graph::get_pass_timings() const
+{
+    auto timings = std::vector<pass_timing>();
+    auto timestamps = std::vector<uint64_t>();
+    if (!m_queries || !m_queries_recorded) {
+        return timings;
+    }
+
+    const vk_physical_device &phys = m_device.get_physical_device();
+    double period = phys.get_timestamp_period();
+    // Only the low bits of the counter are meaningful, and they may wrap between the two queries
+    uint32_t bits = phys.get_queue_family_properties().at(m_device.get_queue_family_index()).timestamp_valid_bits();
+    uint64_t mask = bits >= 64 ? UINT64_MAX : (uint64_t(1) << bits) - 1;
+    uint32_t index = 0;
+    for (const pass &p: m_passes) {
+        if (p.m_enabled && m_queries->get_timestamps(index * 2, 2, timestamps)) {
+            auto begin = uint64_t((timestamps[0] & mask) * period);
+            auto end = begin + uint64_t(((timestamps[1] - timestamps[0]) & mask) * period);
+            timings.push_back({ p.m_name, (end - begin) / 1.e6, begin, end });
+        }
+        ++index;
+    }
+    return timings;
+}
+
+void vk_render_graph::emit(const vk_command_buffer &cmd_buffer, const pass::barrier_batch &batch) const
+{
+    if (!batch.src_stages) {
+        return;
+    }
+
+    auto image_barriers = std::vector<VkImageMemoryBarrier>();
+    auto buffer_barriers = std::vector<VkBufferMemoryBarrier>();
+    for (const auto &b: batch.barriers) {
+        const resource_data &res = m_resources[b.res];
+        if (res.is_image) {
+            image_barriers.push_back({
+                VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER, //type
+                nullptr, //next
+                b.src_access, //src access mask
+                b.dst_access, //dst access mask
+                b.old_layout, //old image layout
+                b.new_layout, //new image layout
+                VK_QUEUE_FAMILY_IGNORED, //src queue family index
+                VK_QUEUE_FAMILY_IGNORED, //dst queue family index
+                get_image(b.res).get_handle(), //image
+                { (VkImageAspectFlags)res.aspect, 0, VK_REMAINING_MIP_LEVELS, 0, VK_REMAINING_ARRAY_LAYERS }, //subresource range
+            });
+        } else {
+            buffer_barriers.push_back({
+                VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER, //type
+                nullptr, //next
+                b.src_access, //src access mask
+                b.dst_access, //dst access mask
+                VK_QUEUE_FAMILY_IGNORED, //src queue family index
+                VK_QUEUE_FAMILY_IGNORED, //dst queue family index
+                res.buffer->get_handle(), //buffer
+                0, //offset
+                VK_WHOLE_SIZE, //size
+            });
+        }
+    }
+
+    vkCmdPipelineBarrier(cmd_buffer.get_handle(), batch.src_stages, batch.dst_stages, 0, 0, nullptr,
+                         buffer_barriers.size(), buffer_barriers.data(), image_barriers.size(), image_barriers.data());
+}
@@ -0,0 +1,132 @@
+
+#pragma once
+
+#include <deque>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "vk.h"
+
+class vk_render_graph
+{
+public:
+    using resource = uint32_t;
+    using record_func = std::function<void (const vk_command_buffer &cmd_buffer)>;
+
+    enum class access {
+        undefined,
+        color_attachment,
+        depth_attachment,
+        depth_read,
+        sampled,
+        input_attachment,
+        transfer_src,
+        transfer_dst,
+        present,
+        vertex_buffer,
+        index_buffer,
+        uniform_buffer,
+    };
+
+    class pass
+    {
+    public:
+        pass &read(resource r, access a);
+        pass &write(resource r, access a);
+
+    private:
+        pass(const std::string &name, const record_func &record);
+
+        struct use {
+            resource res;
+            access acc;
+        };
+        struct barrier {
+            resource res;
+            VkAccessFlags src_access;
+            VkAccessFlags dst_access;
+            VkImageLayout old_layout;
+            VkImageLayout new_layout;
+        };
+        struct barrier_batch {
+            VkPipelineStageFlags src_stages = 0;
+            VkPipelineStageFlags dst_stages = 0;
+            std::vector<barrier> barriers;
+        };
+
+        std::string m_name;
+        record_func m_record;
+        std::vector<use> m_reads;
+        std::vector<use> m_writes;
+        bool m_enabled;
+        barrier_batch m_barriers;
+
+        friend vk_render_graph;
+    };
+
+    explicit vk_render_graph(const vk_device &device);
+    vk_render_graph(const vk_render_graph &) = delete;
+
+    resource import_image(vk_image::aspect aspect, access initial = access::undefined);
+    resource import_buffer(const vk_buffer &buffer);
+    resource create_image(VkFormat format, vk_image::aspect aspect, const VkExtent3D &extent);
+
+    void set_image(resource r, const vk_image &image);
+    const vk_image &get_image(resource r) const;
+
+    pass &add_pass(const std::string &name, const record_func &record);
+    void set_output(resource r, access a);
+
+    void compile();
+    void execute(const vk_command_buffer &cmd_buffer);
+
+    struct pass_timing {
+        std::string name;
+        double ms;
+        // In nanoseconds of the GPU clock
+        uint64_t begin;
+        uint64_t end;
+    };
+    // Timestamps are written around every enabled pass, two queries per pass
+    void set_timestamp_queries(const vk_query_pool *pool);
+    // The GPU time of each enabled pass in the last executed frame, empty if not available yet
+    std::vector<pass_timing> get_pass_timings() const;
+
+private:
+    struct resource_data {
+        bool is_image;
+        bool transient;
+        const vk_image *image;
+        const vk_buffer *buffer;
+        vk_image::aspect aspect;
+        access initial;
+        bool output;
+        access final;
+        VkFormat format;
+        VkExtent3D extent;
+        uint32_t first_use;
+        resource alias_of;
+    };
+    struct state {
+        VkPipelineStageFlags stages;
+        VkAccessFlags writes;
+        VkImageLayout layout;
+    };
+
+    void cull_passes();
+    void allocate_transients();
+    void add_barrier(pass::barrier_batch &batch, resource r, state &s, access a) const;
+    void emit(const vk_command_buffer &cmd_buffer, const pass::barrier_batch &batch) const;
+
+    const vk_device &m_device;
+    std::vector<resource_data> m_resources;
+    std::deque<pass> m_passes;
+    pass::barrier_batch m_final_barriers;
+    const vk_query_pool *m_queries;
+    // The queries are only reset by execute(), they cannot be read before
+    bool m_queries_recorded;
+    std::vector<std::unique_ptr<vk_image>> m_transient_images;
+    std::vector<std::unique_ptr<vk_device_memory>> m_transient_memory;
+};
@@ -0,0 +1,119 @@
+
+#include "vk.h"
+#include "vk_submit.h"
+#include "trace.h"
+
+vk_submit_batch::vk_submit_batch(const vk_device &device, const vk_queue &queue)
+               : m_device(device)
+               , m_queue(queue)
+               , m_count(0)
+{
+}
+
+void vk_submit_batch::add(const vk_command_buffer &cmd_buffer)
+{
+    submit *s = &current();
+    if (s->has_signals) {
+        s = &next();
+    }
+    s->command_buffers.push_back(cmd_buffer.get_handle());
+}
+
+void vk_submit_batch::wait(vk_timeline &timeline, uint64_t value, VkPipelineStageFlags stage)
+{
+    submit *s = &current();
+    if (!s->command_buffers.empty() || s->has_signals) {
+        s = &next();
+    }
+    s->timeline.wait(timeline, value, stage);
+}
+
+void vk_submit_batch::signal(vk_timeline &timeline, uint64_t value)
+{
+    submit &s = current();
+    s.timeline.signal(timeline, value);
+    s.has_signals = true;
+}
+
+void vk_submit_batch::wait(VkSemaphore semaphore, VkPipelineStageFlags stage)
+{
+    submit *s = &current();
+    if (!s->command_buffers.empty() || s->has_signals) {
+        s = &next();
+    }
+    s->timeline.wait(semaphore, stage);
+}
+
+void vk_submit_batch::signal(VkSemaphore semaphore)
+{
+    submit &s = current();
+    s.timeline.signal(semaphore);
+    s.has_signals = true;
+}
+
+void vk_submit_batch::flush()
+{
+    if (m_count == 0) {
+        return;
+    }
+    TRACE_ZONE("submit");
+
+    m_infos.clear();
+    for (size_t i = 0; i < m_count; ++i) {
+        submit &s = *m_submits[i];
+        // The host can only wait for work that is already submitted
+        if (s.timeline.has_host_waits()) {
+            submit_infos(m_infos, VK_NULL_HANDLE);
+        }
+
+        VkSubmitInfo info = {
+            VK_STRUCTURE_TYPE_SUBMIT_INFO, //type
+            nullptr, //next
+            0, //wait semaphore count
+            nullptr, //wait semaphores
+            nullptr, //wait dst stage mask
+            (uint32_t)s.command_buffers.size(), //command buffer count
+            s.command_buffers.data(), //command buffers
+            0, //signal semaphores count
+            nullptr, //signal semaphores
+        };
+        VkFence fence = s.timeline.prepare(info);
+        m_infos.push_back(info);
+        if (fence) {
+            submit_infos(m_infos, fence);
+        }
+    }
+    submit_infos(m_infos, VK_NULL_HANDLE);
+
+    for (size_t i = 0; i < m_count; ++i) {
+        m_submits[i]->timeline.clear();
+        m_submits[i]->command_buffers.clear();
+        m_submits[i]->has_signals = false;
+    }
+    m_count = 0;
+}
+
+vk_submit_batch::submit &vk_submit_batch::current()
+{
+    return m_count ? *m_submits[m_count - 1] : next();
+}
+
+vk_submit_batch::submit &vk_submit_batch::next()
+{
+    if (m_count == m_submits.size()) {
+        m_submits.push_back(std::make_unique<submit>(m_device));
+    }
+    return *m_submits[m_count++];
+}
+
+void vk_submit_batch::submit_infos(std::vector<VkSubmitInfo> &infos, VkFence fence)
+{
+    if (infos.empty()) {
+        return;
+    }
+    VkResult res = vkQueueSubmit(m_queue.get_handle(), infos.size(), infos.data(), fence);
+    infos.clear();
+    if (res != VK_SUCCESS) {
+        throw vk_exception("Failed to submit queue: {}\n", res);
+    }
+}
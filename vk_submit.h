@@ -0,0 +1,57 @@
+
+#pragma once
+
+#include <stdint.h>
+
+#include <memory>
+#include <vector>
+
+#include <vulkan/vulkan.h>
+
+#include "vk_timeline.h"
+
+class vk_device;
+class vk_queue;
+class vk_command_buffer;
+
+// Collects the work for a queue made during a frame. Command buffers are merged
+// into the same VkSubmitInfo until a wait needs to go in between, and all of
+// them are submitted with one vkQueueSubmit. Only host waits and fences of the
+// timeline fallback split them in more calls.
+class vk_submit_batch
+{
+public:
+    vk_submit_batch(const vk_device &device, const vk_queue &queue);
+    vk_submit_batch(const vk_submit_batch &) = delete;
+
+    void add(const vk_command_buffer &cmd_buffer);
+    // Done before running the command buffers added from now on
+    void wait(vk_timeline &timeline, uint64_t value, VkPipelineStageFlags stage);
+    // Done once the command buffers added so far are complete
+    void signal(vk_timeline &timeline, uint64_t value);
+    // Same with a binary semaphore
+    void wait(VkSemaphore semaphore, VkPipelineStageFlags stage);
+    void signal(VkSemaphore semaphore);
+
+    void flush();
+    bool empty() const { return m_count == 0; }
+
+private:
+    struct submit {
+        explicit submit(const vk_device &device) : timeline(device), has_signals(false) {}
+
+        vk_timeline_submit timeline;
+        std::vector<VkCommandBuffer> command_buffers;
+        bool has_signals;
+    };
+    submit &current();
+    submit &next();
+    void submit_infos(std::vector<VkSubmitInfo> &infos, VkFence fence);
+
+    const vk_device &m_device;
+    const vk_queue &m_queue;
+    // Reused between flushes, only the first m_count are in use
+    std::vector<std::unique_ptr<submit>> m_submits;
+    size_t m_count;
+    std::vector<VkSubmitInfo> m_infos;
+};
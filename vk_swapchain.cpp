@@ -15,7 +15,7 @@ stringview vk_swapchain_extension::get_extension()
     return VK_KHR_SWAPCHAIN_EXTENSION_NAME;
 }
 
-vk_swapchain vk_swapchain_extension::create_swapchain(const vk_surface &surface, const VkSurfaceFormatKHR &format)
+vk_swapchain vk_swapchain_extension::create_swapchain(const vk_surface &surface, const VkSurfaceFormatKHR &format, const vk_swapchain *old)
 {
     uint32_t width = surface.get_window().get_width();
     uint32_t height = surface.get_window().get_height();
@@ -38,7 +38,7 @@ vk_swapchain vk_swapchain_extension::create_swapchain(const vk_surface &surface,
         VK_COMPOSITE_ALPHA_OPAQUE_BIT_KHR, //composite alpha
         VK_PRESENT_MODE_MAILBOX_KHR, //present mode
         false, //clipped
-        nullptr, //old swap chain
+        old ? old->get_handle() : VK_NULL_HANDLE, //old swap chain
     };
     VkSwapchainKHR swapchain;
     auto res = vkCreateSwapchainKHR(m_device.get_handle(), &swapchain_info, nullptr, &swapchain);
@@ -56,6 +56,7 @@ vk_swapchain::vk_swapchain(const vk_device &device, VkSwapchainKHR handle, const
             : m_device(device)
             , m_handle(handle)
             , m_surface(surface)
+            , m_out_of_date(false)
 {
     uint32_t image_count = 0;
     vkGetSwapchainImagesKHR(device.get_handle(), m_handle, &image_count, nullptr);
@@ -72,6 +73,30 @@ vk_swapchain::vk_swapchain(const vk_device &device, VkSwapchainKHR handle, const
     for (VkImage img: imgs) {
         m_images.emplace_back(device, img, (VkExtent3D){ width, height, 1 });
     }
+
+    m_acquire_semaphores.reserve(image_count + 1);
+    m_render_done_semaphores.reserve(image_count);
+    for (uint32_t i = 0; i < image_count; ++i) {
+        m_acquire_semaphores.emplace_back(device);
+        m_image_acquire_semaphores.push_back(i);
+        m_render_done_semaphores.emplace_back(device);
+    }
+    m_acquire_semaphores.emplace_back(device);
+    m_spare_acquire_semaphore = image_count;
+}
+
+vk_swapchain::vk_swapchain(vk_swapchain &&s)
+            : m_device(s.m_device)
+            , m_handle(s.m_handle)
+            , m_images(std::move(s.m_images))
+            , m_surface(s.m_surface)
+            , m_out_of_date(s.m_out_of_date)
+            , m_acquire_semaphores(std::move(s.m_acquire_semaphores))
+            , m_image_acquire_semaphores(std::move(s.m_image_acquire_semaphores))
+            , m_spare_acquire_semaphore(s.m_spare_acquire_semaphore)
+            , m_render_done_semaphores(std::move(s.m_render_done_semaphores))
+{
+    s.m_handle = VK_NULL_HANDLE;
 }
 
 vk_swapchain::~vk_swapchain()
@@ -79,32 +104,77 @@ vk_swapchain::~vk_swapchain()
     vkDestroySwapchainKHR(m_device.get_handle(), m_handle, nullptr);
 }
 
-uint32_t vk_swapchain::acquire_next_image_index()
+bool vk_swapchain::acquire_next_image_index(uint32_t &index)
 {
-    uint32_t index;
-    VkResult res = vkAcquireNextImageKHR(m_device.get_handle(), m_handle, UINT64_MAX, VK_NULL_HANDLE, VK_NULL_HANDLE, &index);
-    if (res != VK_SUCCESS) {
+    VkSemaphore semaphore = m_acquire_semaphores[m_spare_acquire_semaphore].get_handle();
+    VkResult res = vkAcquireNextImageKHR(m_device.get_handle(), m_handle, UINT64_MAX, semaphore, VK_NULL_HANDLE, &index);
+    if (res == VK_ERROR_OUT_OF_DATE_KHR) {
+        m_out_of_date = true;
+        return false;
+    }
+    // Suboptimal until the window is resized to match, the image can still be presented
+    if (res != VK_SUCCESS && res != VK_SUBOPTIMAL_KHR) {
         throw vk_exception("Failed to aquire swap chain image: {}\n", res);
     }
-    return index;
+    // The previous acquire of this image was waited on by the frame that rendered to it
+    std::swap(m_image_acquire_semaphores[index], m_spare_acquire_semaphore);
+    return true;
+}
+
+VkSemaphore vk_swapchain::get_acquire_semaphore(uint32_t image_index) const
+{
+    return m_acquire_semaphores[m_image_acquire_semaphores[image_index]].get_handle();
+}
+
+VkSemaphore vk_swapchain::get_render_done_semaphore(uint32_t image_index) const
+{
+    return m_render_done_semaphores[image_index].get_handle();
 }
 
 void vk_swapchain::present(const vk_queue &queue, uint32_t image_index)
 {
-    m_surface.m_window.prepare_swap();
+    present(queue, { { this, image_index } });
+}
+
+void vk_swapchain::present(const vk_queue &queue, const std::vector<std::pair<vk_swapchain *, uint32_t>> &images)
+{
+    std::vector<VkSemaphore> semaphores;
+    std::vector<VkSwapchainKHR> handles;
+    std::vector<uint32_t> indices;
+    semaphores.reserve(images.size());
+    handles.reserve(images.size());
+    indices.reserve(images.size());
+    for (const auto &i: images) {
+        i.first->m_surface.m_window.prepare_swap();
+        semaphores.push_back(i.first->get_render_done_semaphore(i.second));
+        handles.push_back(i.first->m_handle);
+        indices.push_back(i.second);
+    }
+    std::vector<VkResult> results(images.size());
 
     VkPresentInfoKHR present_info = {
         VK_STRUCTURE_TYPE_PRESENT_INFO_KHR, //type
         nullptr, //next
-        0, //wait semaphores count
-        nullptr, //wait semaphores
-        1, //swapchain count
-        &m_handle, //swapchains
-        &image_index, //image indices
-        nullptr, //results
+        (uint32_t)semaphores.size(), //wait semaphores count
+        semaphores.data(), //wait semaphores
+        (uint32_t)handles.size(), //swapchain count
+        handles.data(), //swapchains
+        indices.data(), //image indices
+        results.data(), //results
     };
     VkResult res = vkQueuePresentKHR(queue.get_handle(), &present_info);
-    if (res != VK_SUCCESS) {
-        throw vk_exception("Failed to present queue: {}\n", res);
+    if (res != VK_SUCCESS && res != VK_SUBOPTIMAL_KHR) {
+        bool out_of_date = false;
+        for (size_t i = 0; i < results.size(); ++i) {
+            if (results[i] == VK_ERROR_OUT_OF_DATE_KHR) {
+                images[i].first->m_out_of_date = true;
+                out_of_date = true;
+            } else if (results[i] != VK_SUCCESS && results[i] != VK_SUBOPTIMAL_KHR) {
+                throw vk_exception("Failed to present swapchain {}: {}\n", i, results[i]);
+            }
+        }
+        if (!out_of_date) {
+            throw vk_exception("Failed to present queue: {}\n", res);
+        }
     }
 }
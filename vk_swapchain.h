@@ -2,6 +2,8 @@
 #pragma once
 
 #include <memory>
+#include <utility>
+#include <vector>
 
 #include "stringview.h"
 
@@ -19,7 +21,8 @@ public:
 
     static stringview get_extension();
 
-    vk_swapchain create_swapchain(const vk_surface &surface, const VkSurfaceFormatKHR &format);
+    // The old swapchain, if any, can be destroyed once the new one is created
+    vk_swapchain create_swapchain(const vk_surface &surface, const VkSurfaceFormatKHR &format, const vk_swapchain *old = nullptr);
 
 private:
     const vk_device &m_device;
@@ -34,15 +37,31 @@ public:
     ~vk_swapchain();
 
     const std::vector<vk_image> &get_images() const { return m_images; }
-    uint32_t acquire_next_image_index();
+    // Returns false if the swapchain is out of date and must be recreated
+    bool acquire_next_image_index(uint32_t &index);
+    // Signalled once the acquired image can be rendered to
+    VkSemaphore get_acquire_semaphore(uint32_t image_index) const;
+    // To be signalled by the submission rendering to the image, presenting waits on it
+    VkSemaphore get_render_done_semaphore(uint32_t image_index) const;
+    // Set when acquiring or presenting found that the surface changed
+    bool is_out_of_date() const { return m_out_of_date; }
 
     VkSwapchainKHR get_handle() const { return m_handle; }
 
     void present(const vk_queue &queue, uint32_t image_index);
+    // Presents an image of each swapchain with a single vkQueuePresentKHR.
+    // Out of date swapchains are only flagged, see is_out_of_date().
+    static void present(const vk_queue &queue, const std::vector<std::pair<vk_swapchain *, uint32_t>> &images);
 
 private:
     const vk_device &m_device;
     VkSwapchainKHR m_handle;
     std::vector<vk_image> m_images;
     const vk_surface &m_surface;
+    bool m_out_of_date;
+    // One more than the images, the spare one is used by the next acquire
+    std::vector<vk_semaphore> m_acquire_semaphores;
+    std::vector<uint32_t> m_image_acquire_semaphores;
+    uint32_t m_spare_acquire_semaphore;
+    std::vector<vk_semaphore> m_render_done_semaphores;
 };
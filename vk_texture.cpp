@@ -0,0 +1,265 @@
+
+#include <string.h>
+
+#include <algorithm>
+
+#include "vk_texture.h"
+
+vk_staging_buffer::vk_staging_buffer(const vk_device &device, uint64_t size)
+                 : m_buffer(device, vk_buffer::usage::transfer_src, size, 1)
+                 , m_memory(device, vk_device_memory::property::host_visible | vk_device_memory::property::host_coherent,
+                            m_buffer.get_required_memory_size(), m_buffer.get_required_memory_type())
+                 , m_size(size)
+                 , m_used(0)
+{
+    m_buffer.bind_memory(&m_memory, 0);
+    // Stays mapped for the whole lifetime of the buffer
+    m_data = (uint8_t *)m_memory.map(0);
+}
+
+vk_staging_buffer::~vk_staging_buffer()
+{
+    m_memory.unmap();
+}
+
+vk_staging_buffer::allocation vk_staging_buffer::allocate(uint64_t size, uint64_t alignment)
+{
+    uint64_t offset = (m_used + alignment - 1) / alignment * alignment;
+    if (offset + size > m_size) {
+        throw vk_exception("Staging buffer exhausted: {} bytes requested, {} available.\n", size, m_size - std::min(offset, m_size));
+    }
+    m_used = offset + size;
+    return { offset, m_data + offset };
+}
+
+
+//--
+
+
+// The formats whose levels can be sized, to check uploads against
+struct format_texel_block {
+    VkFormat format;
+    vk_texture::texel_block block;
+};
+
+static const format_texel_block texel_blocks[] = {
+    { VK_FORMAT_R8_UNORM, { 1, 1, 1 } },
+    { VK_FORMAT_R8_SRGB, { 1, 1, 1 } },
+    { VK_FORMAT_R8G8_UNORM, { 1, 1, 2 } },
+    { VK_FORMAT_R8G8_SRGB, { 1, 1, 2 } },
+    { VK_FORMAT_R8G8B8_UNORM, { 1, 1, 3 } },
+    { VK_FORMAT_R8G8B8_SRGB, { 1, 1, 3 } },
+    { VK_FORMAT_R8G8B8A8_UNORM, { 1, 1, 4 } },
+    { VK_FORMAT_R8G8B8A8_SRGB, { 1, 1, 4 } },
+    { VK_FORMAT_B8G8R8A8_UNORM, { 1, 1, 4 } },
+    { VK_FORMAT_B8G8R8A8_SRGB, { 1, 1, 4 } },
+    { VK_FORMAT_A2B10G10R10_UNORM_PACK32, { 1, 1, 4 } },
+    { VK_FORMAT_B10G11R11_UFLOAT_PACK32, { 1, 1, 4 } },
+    { VK_FORMAT_E5B9G9R9_UFLOAT_PACK32, { 1, 1, 4 } },
+    { VK_FORMAT_R16_SFLOAT, { 1, 1, 2 } },
+    { VK_FORMAT_R16G16_SFLOAT, { 1, 1, 4 } },
+    { VK_FORMAT_R16G16B16A16_SFLOAT, { 1, 1, 8 } },
+    { VK_FORMAT_R32_SFLOAT, { 1, 1, 4 } },
+    { VK_FORMAT_R32G32_SFLOAT, { 1, 1, 8 } },
+    { VK_FORMAT_R32G32B32A32_SFLOAT, { 1, 1, 16 } },
+    { VK_FORMAT_BC1_RGB_UNORM_BLOCK, { 4, 4, 8 } },
+    { VK_FORMAT_BC1_RGB_SRGB_BLOCK, { 4, 4, 8 } },
+    { VK_FORMAT_BC1_RGBA_UNORM_BLOCK, { 4, 4, 8 } },
+    { VK_FORMAT_BC1_RGBA_SRGB_BLOCK, { 4, 4, 8 } },
+    { VK_FORMAT_BC2_UNORM_BLOCK, { 4, 4, 16 } },
+    { VK_FORMAT_BC2_SRGB_BLOCK, { 4, 4, 16 } },
+    { VK_FORMAT_BC3_UNORM_BLOCK, { 4, 4, 16 } },
+    { VK_FORMAT_BC3_SRGB_BLOCK, { 4, 4, 16 } },
+    { VK_FORMAT_BC4_UNORM_BLOCK, { 4, 4, 8 } },
+    { VK_FORMAT_BC4_SNORM_BLOCK, { 4, 4, 8 } },
+    { VK_FORMAT_BC5_UNORM_BLOCK, { 4, 4, 16 } },
+    { VK_FORMAT_BC5_SNORM_BLOCK, { 4, 4, 16 } },
+    { VK_FORMAT_BC6H_UFLOAT_BLOCK, { 4, 4, 16 } },
+    { VK_FORMAT_BC6H_SFLOAT_BLOCK, { 4, 4, 16 } },
+    { VK_FORMAT_BC7_UNORM_BLOCK, { 4, 4, 16 } },
+    { VK_FORMAT_BC7_SRGB_BLOCK, { 4, 4, 16 } },
+    { VK_FORMAT_ETC2_R8G8B8_UNORM_BLOCK, { 4, 4, 8 } },
+    { VK_FORMAT_ETC2_R8G8B8_SRGB_BLOCK, { 4, 4, 8 } },
+    { VK_FORMAT_ETC2_R8G8B8A1_UNORM_BLOCK, { 4, 4, 8 } },
+    { VK_FORMAT_ETC2_R8G8B8A1_SRGB_BLOCK, { 4, 4, 8 } },
+    { VK_FORMAT_ETC2_R8G8B8A8_UNORM_BLOCK, { 4, 4, 16 } },
+    { VK_FORMAT_ETC2_R8G8B8A8_SRGB_BLOCK, { 4, 4, 16 } },
+    { VK_FORMAT_EAC_R11_UNORM_BLOCK, { 4, 4, 8 } },
+    { VK_FORMAT_EAC_R11G11_UNORM_BLOCK, { 4, 4, 16 } },
+    { VK_FORMAT_ASTC_4x4_UNORM_BLOCK, { 4, 4, 16 } },
+    { VK_FORMAT_ASTC_4x4_SRGB_BLOCK, { 4, 4, 16 } },
+    { VK_FORMAT_ASTC_5x5_UNORM_BLOCK, { 5, 5, 16 } },
+    { VK_FORMAT_ASTC_5x5_SRGB_BLOCK, { 5, 5, 16 } },
+    { VK_FORMAT_ASTC_6x6_UNORM_BLOCK, { 6, 6, 16 } },
+    { VK_FORMAT_ASTC_6x6_SRGB_BLOCK, { 6, 6, 16 } },
+    { VK_FORMAT_ASTC_8x8_UNORM_BLOCK, { 8, 8, 16 } },
+    { VK_FORMAT_ASTC_8x8_SRGB_BLOCK, { 8, 8, 16 } },
+};
+
+const vk_texture::texel_block *vk_texture::find_texel_block(VkFormat format)
+{
+    for (const format_texel_block &b: texel_blocks) {
+        if (b.format == format) {
+            return &b.block;
+        }
+    }
+    return nullptr;
+}
+
+static uint64_t mul_saturate(uint64_t a, uint64_t b)
+{
+    return b && a > UINT64_MAX / b ? UINT64_MAX : a * b;
+}
+
+uint64_t vk_texture::get_level_size(const texel_block &block, const VkExtent3D &extent, uint32_t layers, uint32_t level)
+{
+    uint64_t width = std::max(extent.width >> level, 1u);
+    uint64_t height = std::max(extent.height >> level, 1u);
+    uint64_t depth = std::max(extent.depth >> level, 1u);
+    uint64_t blocks = mul_saturate((width + block.width - 1) / block.width, (height + block.height - 1) / block.height);
+    return mul_saturate(mul_saturate(mul_saturate(blocks, depth), layers), block.size);
+}
+
+// vkCmdCopyBufferToImage needs the buffer offset to be a multiple of both
+static uint64_t get_copy_alignment(const vk_texture::texel_block &block)
+{
+    uint64_t a = block.size, b = 4;
+    while (b) {
+        uint64_t r = a % b;
+        a = b;
+        b = r;
+    }
+    return block.size * 4 / a;
+}
+
+static vk_image::usage get_texture_usage(uint32_t mip_levels)
+{
+    auto u = vk_image::usage::sampled | vk_image::usage::transfer_dst;
+    return mip_levels > 1 ? u | vk_image::usage::transfer_src : u;
+}
+
+static uint32_t get_texture_mip_levels(const VkExtent3D &extent, uint32_t mip_levels)
+{
+    return mip_levels ? mip_levels : vk_image::get_max_mip_levels(extent);
+}
+
+vk_texture::vk_texture(const vk_device &device, VkFormat format, const VkExtent3D &extent, uint32_t mip_levels, uint32_t array_layers)
+          : m_device(device)
+          , m_image(device, format, get_texture_usage(get_texture_mip_levels(extent, mip_levels)), extent.depth > 1 ? vk_image::type::t3D : vk_image::type::t2D,
+                    extent, get_texture_mip_levels(extent, mip_levels), array_layers)
+          , m_memory(device, vk_device_memory::property::device_local, m_image.get_required_memory_size(), m_image.get_required_memory_type())
+{
+    m_image.bind_memory(&m_memory, 0);
+    m_view = m_image.create_image_view(vk_image::aspect::color);
+}
+
+void vk_texture::upload(const vk_command_buffer &cmd_buffer, vk_staging_buffer &staging, const void *data, uint64_t size)
+{
+    const texel_block *block = find_texel_block(m_image.get_format());
+    if (!block) {
+        throw vk_exception("Cannot upload to a texture of format {}, its texel block size is not known.\n", m_image.get_format());
+    }
+    uint64_t level_size = get_level_size(*block, m_image.get_mip_extent(0), m_image.get_array_layers(), 0);
+    if (size < level_size) {
+        throw vk_exception("Level 0 of the texture takes {} bytes but only {} were given.\n", level_size, size);
+    }
+
+    auto alloc = staging.allocate(level_size, get_copy_alignment(*block));
+    memcpy(alloc.data, data, level_size);
+
+    begin_upload(cmd_buffer);
+    copy_level(cmd_buffer, staging.get_buffer(), alloc.offset, 0);
+    generate_mipmaps(cmd_buffer);
+}
+
+void vk_texture::begin_upload(const vk_command_buffer &cmd_buffer)
+{
+    // The old contents are discarded
+    barrier(cmd_buffer, 0, m_image.get_mip_levels(), VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+            0, VK_ACCESS_TRANSFER_WRITE_BIT, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT);
+}
+
+void vk_texture::copy_level(const vk_command_buffer &cmd_buffer, const vk_buffer &buffer, uint64_t offset, uint32_t level,
+                            uint32_t base_layer, uint32_t layer_count)
+{
+    if (level >= m_image.get_mip_levels()) {
+        throw vk_exception("Cannot copy level {} of a texture with {} levels.\n", level, m_image.get_mip_levels());
+    }
+    if (layer_count == VK_REMAINING_ARRAY_LAYERS) {
+        layer_count = m_image.get_array_layers() - base_layer;
+    }
+
+    VkBufferImageCopy region = {
+        offset, //buffer offset
+        0, //buffer row length
+        0, //buffer image height
+        { //image subresource
+            VK_IMAGE_ASPECT_COLOR_BIT, //aspect mask
+            level, //mip level
+            base_layer, //base array layer
+            layer_count, //layer count
+        },
+        { 0, 0, 0 }, //image offset
+        m_image.get_mip_extent(level), //image extent
+    };
+    vkCmdCopyBufferToImage(cmd_buffer.get_handle(), buffer.get_handle(), m_image.get_handle(), VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &region);
+}
+
+void vk_texture::end_upload(const vk_command_buffer &cmd_buffer)
+{
+    barrier(cmd_buffer, 0, m_image.get_mip_levels(), VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
+            VK_ACCESS_TRANSFER_WRITE_BIT, VK_ACCESS_SHADER_READ_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT);
+}
+
+void vk_texture::generate_mipmaps(const vk_command_buffer &cmd_buffer)
+{
+    VkFormatProperties props;
+    vkGetPhysicalDeviceFormatProperties(m_device.get_physical_device().get_handle(), m_image.get_format(), &props);
+    const VkFormatFeatureFlags blit = VK_FORMAT_FEATURE_BLIT_SRC_BIT | VK_FORMAT_FEATURE_BLIT_DST_BIT;
+    if (m_image.get_mip_levels() > 1 && (props.optimalTilingFeatures & blit) != blit) {
+        throw vk_exception("Cannot generate mipmaps, format {} does not support blitting.\n", m_image.get_format());
+    }
+    auto filter = props.optimalTilingFeatures & VK_FORMAT_FEATURE_SAMPLED_IMAGE_FILTER_LINEAR_BIT ? VK_FILTER_LINEAR : VK_FILTER_NEAREST;
+
+    // Every level is read back as soon as it is written, then goes to the shaders
+    for (uint32_t i = 1; i < m_image.get_mip_levels(); ++i) {
+        barrier(cmd_buffer, i - 1, 1, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+                VK_ACCESS_TRANSFER_WRITE_BIT, VK_ACCESS_TRANSFER_READ_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT);
+
+        VkExtent3D src = m_image.get_mip_extent(i - 1);
+        VkExtent3D dst = m_image.get_mip_extent(i);
+        VkImageBlit region = {
+            { VK_IMAGE_ASPECT_COLOR_BIT, i - 1, 0, m_image.get_array_layers() }, //src subresource
+            { { 0, 0, 0 }, { (int32_t)src.width, (int32_t)src.height, (int32_t)src.depth } }, //src offsets
+            { VK_IMAGE_ASPECT_COLOR_BIT, i, 0, m_image.get_array_layers() }, //dst subresource
+            { { 0, 0, 0 }, { (int32_t)dst.width, (int32_t)dst.height, (int32_t)dst.depth } }, //dst offsets
+        };
+        vkCmdBlitImage(cmd_buffer.get_handle(), m_image.get_handle(), VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+                       m_image.get_handle(), VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &region, filter);
+
+        barrier(cmd_buffer, i - 1, 1, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
+                VK_ACCESS_TRANSFER_READ_BIT, VK_ACCESS_SHADER_READ_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT);
+    }
+
+    uint32_t last = m_image.get_mip_levels() - 1;
+    barrier(cmd_buffer, last, 1, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
+            VK_ACCESS_TRANSFER_WRITE_BIT, VK_ACCESS_SHADER_READ_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT);
+}
+
+void vk_texture::barrier(const vk_command_buffer &cmd_buffer, uint32_t base_level, uint32_t level_count, VkImageLayout old_layout, VkImageLayout new_layout,
+                         VkAccessFlags src_access, VkAccessFlags dst_access, VkPipelineStageFlags src_stages, VkPipelineStageFlags dst_stages) const
+{
+    VkImageMemoryBarrier image_barrier = {
+        VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER, //type
+        nullptr, //next
+        src_access, //src access mask
+        dst_access, //dst access mask
+        old_layout, //old image layout
+        new_layout, //new image layout
+        VK_QUEUE_FAMILY_IGNORED, //src queue family index
+        VK_QUEUE_FAMILY_IGNORED, //dst queue family index
+        m_image.get_handle(), //image
+        { VK_IMAGE_ASPECT_COLOR_BIT, base_level, level_count, 0, VK_REMAINING_ARRAY_LAYERS }, //subresource range
+    };
+    vkCmdPipelineBarrier(cmd_buffer.get_handle(), src_stages, dst_stages, 0, 0, nullptr, 0, nullptr, 1, &image_barrier);
+}
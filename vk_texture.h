@@ -0,0 +1,80 @@
+
+#pragma once
+
+#include <stdint.h>
+
+#include "vk.h"
+
+// A host visible buffer uploads are copied through. Space is handed out
+// linearly and reclaimed all at once by reset(), which must only be called
+// once the GPU is done with the copies recorded from it.
+class vk_staging_buffer
+{
+public:
+    struct allocation {
+        uint64_t offset;
+        void *data;
+    };
+
+    vk_staging_buffer(const vk_device &device, uint64_t size);
+    vk_staging_buffer(const vk_staging_buffer &) = delete;
+    ~vk_staging_buffer();
+
+    allocation allocate(uint64_t size, uint64_t alignment = 16);
+    void reset() { m_used = 0; }
+
+    const vk_buffer &get_buffer() const { return m_buffer; }
+    uint64_t get_size() const { return m_size; }
+    uint64_t get_available() const { return m_size - m_used; }
+
+private:
+    vk_buffer m_buffer;
+    vk_device_memory m_memory;
+    uint8_t *m_data;
+    uint64_t m_size;
+    uint64_t m_used;
+};
+
+// A sampled image in device local memory. Either upload() level 0 and let the
+// GPU build the mip chain, or copy every level between begin_upload() and
+// end_upload(). Both leave the image ready to be read by the fragment shaders.
+class vk_texture
+{
+public:
+    struct texel_block {
+        uint32_t width, height;
+        uint32_t size;
+    };
+    // Null for the formats whose block size is not known, they cannot be uploaded
+    static const texel_block *find_texel_block(VkFormat format);
+    // The bytes vkCmdCopyBufferToImage reads for the level, with tightly packed rows
+    static uint64_t get_level_size(const texel_block &block, const VkExtent3D &extent, uint32_t layers, uint32_t level);
+
+    // 0 mip levels means a full mip chain
+    vk_texture(const vk_device &device, VkFormat format, const VkExtent3D &extent, uint32_t mip_levels = 0, uint32_t array_layers = 1);
+    vk_texture(const vk_texture &) = delete;
+
+    // data holds level 0 of all the layers, tightly packed, size is checked against it
+    void upload(const vk_command_buffer &cmd_buffer, vk_staging_buffer &staging, const void *data, uint64_t size);
+
+    void begin_upload(const vk_command_buffer &cmd_buffer);
+    // The level is read tightly packed from buffer, one layer after the other
+    void copy_level(const vk_command_buffer &cmd_buffer, const vk_buffer &buffer, uint64_t offset, uint32_t level,
+                    uint32_t base_layer = 0, uint32_t layer_count = VK_REMAINING_ARRAY_LAYERS);
+    void end_upload(const vk_command_buffer &cmd_buffer);
+    // Fills the other levels by blitting each one from the previous, level 0
+    // must have been copied. Replaces end_upload().
+    void generate_mipmaps(const vk_command_buffer &cmd_buffer);
+
+    const vk_image &get_image() const { return m_image; }
+    const vk_image_view &get_view() const { return m_view; }
+
+private:
+    void barrier(const vk_command_buffer &cmd_buffer, uint32_t base_level, uint32_t level_count, VkImageLayout old_layout, VkImageLayout new_layout,
+                 VkAccessFlags src_access, VkAccessFlags dst_access, VkPipelineStageFlags src_stages, VkPipelineStageFlags dst_stages) const;
+
+    const vk_device &m_device;
+    vk_image m_image;
+    vk_device_memory m_memory;
+    vk_image_view m_view;
+};
@@ -0,0 +1,231 @@
+
+#include <algorithm>
+
+#include "vk.h"
+#include "vk_timeline.h"
+
+template<class T>
+static T get_device_proc(const vk_device &device, const char *name)
+{
+    auto func = reinterpret_cast<T>(vkGetDeviceProcAddr(device.get_handle(), name));
+    if (!func) {
+        throw vk_exception("Failed to get the address of {}.\n", name);
+    }
+    return func;
+}
+
+vk_timeline_semaphore_extension::vk_timeline_semaphore_extension(const vk_device &device)
+                               : m_get_semaphore_counter_value(get_device_proc<PFN_vkGetSemaphoreCounterValueKHR>(device, "vkGetSemaphoreCounterValueKHR"))
+                               , m_wait_semaphores(get_device_proc<PFN_vkWaitSemaphoresKHR>(device, "vkWaitSemaphoresKHR"))
+                               , m_signal_semaphore(get_device_proc<PFN_vkSignalSemaphoreKHR>(device, "vkSignalSemaphoreKHR"))
+{
+}
+
+stringview vk_timeline_semaphore_extension::get_extension()
+{
+    return VK_KHR_TIMELINE_SEMAPHORE_EXTENSION_NAME;
+}
+
+//--
+
+vk_timeline::vk_timeline(const vk_device &device, uint64_t initial_value)
+           : m_device(device)
+           , m_handle(VK_NULL_HANDLE)
+           , m_value(initial_value)
+{
+    if (!device.is_extension_enabled(vk_timeline_semaphore_extension::get_extension())) {
+        return;
+    }
+
+    m_ext = device.get_extension_object<vk_timeline_semaphore_extension>();
+    VkSemaphoreTypeCreateInfoKHR type_info = {
+        VK_STRUCTURE_TYPE_SEMAPHORE_TYPE_CREATE_INFO_KHR, //type
+        nullptr, //next
+        VK_SEMAPHORE_TYPE_TIMELINE_KHR, //semaphore type
+        initial_value, //initial value
+    };
+    VkSemaphoreCreateInfo info = {
+        VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO, //type
+        &type_info, //next
+        0, //flags
+    };
+    VkResult res = vkCreateSemaphore(device.get_handle(), &info, nullptr, &m_handle);
+    if (res != VK_SUCCESS) {
+        throw vk_exception("Failed to create timeline semaphore: {}\n", res);
+    }
+}
+
+vk_timeline::~vk_timeline()
+{
+    if (m_handle) {
+        vkDestroySemaphore(m_device.get_handle(), m_handle, nullptr);
+    }
+}
+
+uint64_t vk_timeline::get_value()
+{
+    if (!is_native()) {
+        retire();
+        return m_value;
+    }
+
+    uint64_t value;
+    VkResult res = m_ext->m_get_semaphore_counter_value(m_device.get_handle(), m_handle, &value);
+    if (res != VK_SUCCESS) {
+        throw vk_exception("Failed to get the timeline value: {}\n", res);
+    }
+    return value;
+}
+
+bool vk_timeline::wait(uint64_t value, uint64_t timeout_ns)
+{
+    if (!is_native()) {
+        retire();
+        if (m_value >= value) {
+            return true;
+        }
+        auto it = std::find_if(m_pending.begin(), m_pending.end(), [value](const pending &p) { return p.value >= value; });
+        if (it == m_pending.end()) {
+            throw vk_exception("Waiting for timeline value {} which is never signalled.\n", value);
+        }
+        if (!it->fence->wait(timeout_ns)) {
+            return false;
+        }
+        retire();
+        return true;
+    }
+
+    VkSemaphoreWaitInfoKHR info = {
+        VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO_KHR, //type
+        nullptr, //next
+        0, //flags
+        1, //semaphore count
+        &m_handle, //semaphores
+        &value, //values
+    };
+    VkResult res = m_ext->m_wait_semaphores(m_device.get_handle(), &info, timeout_ns);
+    if (res == VK_TIMEOUT) {
+        return false;
+    } else if (res != VK_SUCCESS) {
+        throw vk_exception("Failed to wait for the timeline: {}\n", res);
+    }
+    return true;
+}
+
+void vk_timeline::signal(uint64_t value)
+{
+    if (!is_native()) {
+        m_value = std::max(m_value, value);
+        return;
+    }
+
+    VkSemaphoreSignalInfoKHR info = {
+        VK_STRUCTURE_TYPE_SEMAPHORE_SIGNAL_INFO_KHR, //type
+        nullptr, //next
+        m_handle, //semaphore
+        value, //value
+    };
+    VkResult res = m_ext->m_signal_semaphore(m_device.get_handle(), &info);
+    if (res != VK_SUCCESS) {
+        throw vk_exception("Failed to signal the timeline: {}\n", res);
+    }
+}
+
+void vk_timeline::retire()
+{
+    auto it = m_pending.begin();
+    for (; it != m_pending.end() && it->fence->is_signalled(); ++it) {
+        m_value = std::max(m_value, it->value);
+    }
+    m_pending.erase(m_pending.begin(), it);
+}
+
+//--
+
+vk_timeline_submit::vk_timeline_submit(const vk_device &device)
+                  : m_device(device)
+                  , m_has_timelines(false)
+{
+}
+
+void vk_timeline_submit::wait(vk_timeline &timeline, uint64_t value, VkPipelineStageFlags stage)
+{
+    if (!timeline.is_native()) {
+        m_host_waits.push_back({ &timeline, value });
+        return;
+    }
+    m_wait_semaphores.push_back(timeline.get_handle());
+    m_wait_values.push_back(value);
+    m_wait_stages.push_back(stage);
+    m_has_timelines = true;
+}
+
+void vk_timeline_submit::signal(vk_timeline &timeline, uint64_t value)
+{
+    if (!timeline.is_native()) {
+        m_fence_signals.push_back({ &timeline, value });
+        return;
+    }
+    m_signal_semaphores.push_back(timeline.get_handle());
+    m_signal_values.push_back(value);
+    m_has_timelines = true;
+}
+
+// The values of binary semaphores are ignored
+void vk_timeline_submit::wait(VkSemaphore semaphore, VkPipelineStageFlags stage)
+{
+    m_wait_semaphores.push_back(semaphore);
+    m_wait_values.push_back(0);
+    m_wait_stages.push_back(stage);
+}
+
+void vk_timeline_submit::signal(VkSemaphore semaphore)
+{
+    m_signal_semaphores.push_back(semaphore);
+    m_signal_values.push_back(0);
+}
+
+VkFence vk_timeline_submit::prepare(VkSubmitInfo &info)
+{
+    for (const auto &w: m_host_waits) {
+        w.first->wait(w.second);
+    }
+    if (!m_fence_signals.empty()) {
+        m_fence = std::make_shared<vk_fence>(m_device);
+        for (const auto &s: m_fence_signals) {
+            s.first->m_pending.push_back({ s.second, m_fence });
+        }
+    }
+
+    if (m_has_timelines) {
+        m_timeline_info = {
+            VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO_KHR, //type
+            info.pNext, //next
+            (uint32_t)m_wait_values.size(), //wait semaphore values count
+            m_wait_values.data(), //wait semaphore values
+            (uint32_t)m_signal_values.size(), //signal semaphore values count
+            m_signal_values.data(), //signal semaphore values
+        };
+        info.pNext = &m_timeline_info;
+    }
+    info.waitSemaphoreCount = m_wait_semaphores.size();
+    info.pWaitSemaphores = m_wait_semaphores.data();
+    info.pWaitDstStageMask = m_wait_stages.data();
+    info.signalSemaphoreCount = m_signal_semaphores.size();
+    info.pSignalSemaphores = m_signal_semaphores.data();
+
+    return m_fence ? m_fence->get_handle() : VK_NULL_HANDLE;
+}
+
+void vk_timeline_submit::clear()
+{
+    m_wait_semaphores.clear();
+    m_wait_values.clear();
+    m_wait_stages.clear();
+    m_signal_semaphores.clear();
+    m_signal_values.clear();
+    m_has_timelines = false;
+    m_host_waits.clear();
+    m_fence_signals.clear();
+    m_fence.reset();
+}
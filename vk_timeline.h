@@ -0,0 +1,103 @@
+
+#pragma once
+
+#include <stdint.h>
+
+#include <memory>
+#include <utility>
+#include <vector>
+
+#include <vulkan/vulkan.h>
+
+#include "stringview.h"
+
+class vk_device;
+class vk_fence;
+
+class vk_timeline_semaphore_extension
+{
+public:
+    vk_timeline_semaphore_extension(const vk_device &device);
+    vk_timeline_semaphore_extension(const vk_timeline_semaphore_extension &) = delete;
+
+    static stringview get_extension();
+
+private:
+    PFN_vkGetSemaphoreCounterValueKHR m_get_semaphore_counter_value;
+    PFN_vkWaitSemaphoresKHR m_wait_semaphores;
+    PFN_vkSignalSemaphoreKHR m_signal_semaphore;
+
+    friend class vk_timeline;
+};
+
+// A counter that only goes up, advanced by submissions or by the host, that
+// orders work by value. Uses a timeline semaphore when the device has them.
+// Otherwise every value signalled by a submission gets a fence and waiting
+// for it on the GPU becomes a host wait when the waiting submission is made.
+class vk_timeline
+{
+public:
+    explicit vk_timeline(const vk_device &device, uint64_t initial_value = 0);
+    vk_timeline(const vk_timeline &) = delete;
+    ~vk_timeline();
+
+    bool is_native() const { return m_handle != VK_NULL_HANDLE; }
+
+    // The highest value reached so far
+    uint64_t get_value();
+    // Returns false on timeout
+    bool wait(uint64_t value, uint64_t timeout_ns = UINT64_MAX);
+    void signal(uint64_t value);
+
+    VkSemaphore get_handle() const { return m_handle; }
+
+private:
+    struct pending {
+        uint64_t value;
+        std::shared_ptr<vk_fence> fence;
+    };
+    void retire();
+
+    const vk_device &m_device;
+    std::shared_ptr<vk_timeline_semaphore_extension> m_ext;
+    VkSemaphore m_handle;
+    // Only used without timeline semaphores, in signal order
+    uint64_t m_value;
+    std::vector<pending> m_pending;
+
+    friend class vk_timeline_submit;
+};
+
+// The timeline waits and signals of one vkQueueSubmit
+class vk_timeline_submit
+{
+public:
+    explicit vk_timeline_submit(const vk_device &device);
+    vk_timeline_submit(const vk_timeline_submit &) = delete;
+
+    void wait(vk_timeline &timeline, uint64_t value, VkPipelineStageFlags stage);
+    void signal(vk_timeline &timeline, uint64_t value);
+    // Binary semaphores, e.g. of a swapchain, with or without timeline semaphores
+    void wait(VkSemaphore semaphore, VkPipelineStageFlags stage);
+    void signal(VkSemaphore semaphore);
+
+    // Fills in the semaphores of info, which must not outlive this object,
+    // and returns the fence to submit with, if any
+    VkFence prepare(VkSubmitInfo &info);
+    // Whether prepare() waits on the host for work submitted earlier
+    bool has_host_waits() const { return !m_host_waits.empty(); }
+    void clear();
+
+private:
+    const vk_device &m_device;
+    std::vector<VkSemaphore> m_wait_semaphores;
+    std::vector<uint64_t> m_wait_values;
+    std::vector<VkPipelineStageFlags> m_wait_stages;
+    std::vector<VkSemaphore> m_signal_semaphores;
+    std::vector<uint64_t> m_signal_values;
+    bool m_has_timelines;
+    VkTimelineSemaphoreSubmitInfoKHR m_timeline_info;
+    std::vector<std::pair<vk_timeline *, uint64_t>> m_host_waits;
+    std::vector<std::pair<vk_timeline *, uint64_t>> m_fence_signals;
+    std::shared_ptr<vk_fence> m_fence;
+};
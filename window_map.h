@@ -0,0 +1,64 @@
+
+#pragma once
+
+#include <algorithm>
+#include <utility>
+#include <vector>
+
+// Maps platform window ids to their windows. There are only ever a few windows,
+// so a binary search in contiguous memory beats hashing, and as events usually
+// come in runs for the same window the last lookup is cached in front of it.
+template<class id_type, class window_type>
+class window_map
+{
+public:
+    // Returns null for ids that are not registered
+    window_type *find(id_type id)
+    {
+        if (m_last && m_last_id == id) {
+            return m_last;
+        }
+
+        auto it = lower_bound(id);
+        if (it == m_windows.end() || it->first != id) {
+            return nullptr;
+        }
+        m_last_id = id;
+        m_last = it->second;
+        return it->second;
+    }
+
+    void set(id_type id, window_type *w)
+    {
+        auto it = lower_bound(id);
+        if (it != m_windows.end() && it->first == id) {
+            it->second = w;
+        } else {
+            m_windows.insert(it, { id, w });
+        }
+        m_last = nullptr;
+    }
+
+    // Only if id still maps to w, a moved window may have replaced it
+    void remove(id_type id, window_type *w)
+    {
+        auto it = lower_bound(id);
+        if (it != m_windows.end() && it->first == id && it->second == w) {
+            m_windows.erase(it);
+        }
+        m_last = nullptr;
+    }
+
+private:
+    using entry = std::pair<id_type, window_type *>;
+
+    typename std::vector<entry>::iterator lower_bound(id_type id)
+    {
+        return std::lower_bound(m_windows.begin(), m_windows.end(), id, [](const entry &e, id_type id) { return e.first < id; });
+    }
+
+    // Sorted by id
+    std::vector<entry> m_windows;
+    id_type m_last_id = id_type();
+    window_type *m_last = nullptr;
+};
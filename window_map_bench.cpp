@@ -0,0 +1,108 @@
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include <chrono>
+#include <random>
+#include <unordered_map>
+#include <vector>
+
+#include "format.h"
+#include "window_map.h"
+
+// Times the window lookup done for every event by the xcb platform, dispatching
+// synthetic events to a few windows, against the unordered_map it replaced.
+
+struct fake_window {
+    uint64_t events = 0;
+};
+
+class unordered_window_map
+{
+public:
+    fake_window *find(uint32_t id)
+    {
+        auto it = m_windows.find(id);
+        return it == m_windows.end() ? nullptr : it->second;
+    }
+    void set(uint32_t id, fake_window *w) { m_windows[id] = w; }
+
+private:
+    std::unordered_map<uint32_t, fake_window *> m_windows;
+};
+
+// Runs of events for the same window, like a motion stream, or every event
+// for a random window
+static std::vector<uint32_t> make_events(const std::vector<uint32_t> &ids, size_t count, size_t run, uint32_t seed)
+{
+    std::mt19937 rng(seed);
+    std::uniform_int_distribution<size_t> pick(0, ids.size() - 1);
+    auto events = std::vector<uint32_t>();
+    events.reserve(count);
+    while (events.size() < count) {
+        uint32_t id = ids[pick(rng)];
+        for (size_t i = 0; i < run && events.size() < count; ++i) {
+            events.push_back(id);
+        }
+    }
+    // Some events for windows that are not ours, e.g. the root window
+    for (size_t i = 0; i < count; i += 997) {
+        events[i] = 1;
+    }
+    return events;
+}
+
+template<class map>
+static double dispatch(map &windows, const std::vector<uint32_t> &events, int repeats)
+{
+    double best = 1e30;
+    for (int r = 0; r < repeats; ++r) {
+        auto start = std::chrono::steady_clock::now();
+        for (uint32_t id: events) {
+            if (fake_window *w = windows.find(id)) {
+                ++w->events;
+            }
+        }
+        auto end = std::chrono::steady_clock::now();
+        best = std::min(best, std::chrono::duration<double, std::milli>(end - start).count());
+    }
+    return best;
+}
+
+int main(int argc, char **argv)
+{
+    size_t count = argc > 1 ? strtoul(argv[1], nullptr, 10) : 1000000;
+    const int repeats = 5;
+
+    fmt::print("{} events, best of {} runs\n", count, repeats);
+    fmt::print("{:>8} {:>8} {:>12} {:>12}\n", "windows", "run", "window_map", "unordered");
+    for (size_t window_count: { 1, 4, 16 }) {
+        auto windows = std::vector<fake_window>(window_count);
+        auto ids = std::vector<uint32_t>();
+        window_map<uint32_t, fake_window> sorted;
+        unordered_window_map hashed;
+        for (size_t i = 0; i < window_count; ++i) {
+            // xcb ids are allocated from a per client base
+            ids.push_back(0x2400001 + i * 7);
+            sorted.set(ids.back(), &windows[i]);
+            hashed.set(ids.back(), &windows[i]);
+        }
+
+        for (size_t run: { 64, 1 }) {
+            auto events = make_events(ids, count, run, 42);
+            double a = dispatch(sorted, events, repeats);
+            double b = dispatch(hashed, events, repeats);
+            fmt::print("{:>8} {:>8} {:>9.2f} ms {:>9.2f} ms\n", window_count, run, a, b);
+        }
+
+        // Uses the counters, so the dispatch can't be optimized away
+        uint64_t dispatched = 0;
+        for (const fake_window &w: windows) {
+            dispatched += w.events;
+        }
+        if (dispatched == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
@@ -1,8 +1,18 @@
 
+#include <errno.h>
+#include <poll.h>
+#include <string.h>
+#include <time.h>
 #include <unistd.h>
 #include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <sys/timerfd.h>
 
+#include <algorithm>
+#include <memory>
+#include <mutex>
+#include <thread>
+
 #define VK_USE_PLATFORM_WAYLAND_KHR
 #include <vulkan/vk_platform.h>
 #include <vulkan/vulkan.h>
@@ -10,6 +20,11 @@
 #include "vk.h"
 #include "display.h"
 #include "event_loop.h"
+#include "log.h"
+#include "trace.h"
+
+#include "presentation-time-client-protocol.h"
+#include "xdg-shell-client-protocol.h"
 
 template<class T, class... Args>
 struct Wrapper {
@@ -32,19 +47,7 @@ class wl_platform_window;
 class pointer
 {
 public:
-    explicit pointer(wl_pointer *p)
-        : m_pointer(p)
-        , m_window(nullptr)
-    {
-        static const wl_pointer_listener listener = {
-            wrapInterface(&pointer::enter),
-            wrapInterface(&pointer::leave),
-            wrapInterface(&pointer::motion),
-            wrapInterface(&pointer::button),
-            wrapInterface(&pointer::axis),
-        };
-        wl_pointer_add_listener(p, &listener, this);
-    }
+    explicit pointer(wl_pointer *p, wl_platform_display *dpy);
 
     void enter(wl_pointer *, uint32_t serial, wl_surface *surface, wl_fixed_t x, wl_fixed_t y);
     void leave(wl_pointer *, uint32_t serial, wl_surface *surface);
@@ -54,25 +57,15 @@ public:
 
 private:
     wl_pointer *m_pointer;
+    wl_platform_display *m_display;
+    // Guarded by the display input mutex
     wl_platform_window *m_window;
 };
 
 class keyboard
 {
 public:
-    explicit keyboard(wl_keyboard *k)
-        : m_keyboard(k)
-        , m_window(nullptr)
-    {
-        static const wl_keyboard_listener listener = {
-            wrapInterface(&keyboard::keymap),
-            wrapInterface(&keyboard::enter),
-            wrapInterface(&keyboard::leave),
-            wrapInterface(&keyboard::key),
-            wrapInterface(&keyboard::modifiers),
-        };
-        wl_keyboard_add_listener(k, &listener, this);
-    }
+    explicit keyboard(wl_keyboard *k, wl_platform_display *dpy);
 
     void keymap(wl_keyboard *, uint32_t format, int fd, uint32_t size);
     void enter(wl_keyboard *, uint32_t serial, wl_surface *surface, wl_array *keys);
@@ -82,14 +75,17 @@ public:
 
 private:
     wl_keyboard *m_keyboard;
+    wl_platform_display *m_display;
+    // Guarded by the display input mutex
     wl_platform_window *m_window;
 };
 
 class seat
 {
 public:
-    explicit seat(wl_seat *s)
+    explicit seat(wl_seat *s, wl_platform_display *dpy)
         : m_seat(s)
+        , m_display(dpy)
     {
         static const wl_seat_listener listener = {
             wrapInterface(&seat::capabilities),
@@ -100,10 +96,10 @@ public:
     void capabilities(wl_seat *, uint32_t caps)
     {
         if (!m_pointer && caps & WL_SEAT_CAPABILITY_POINTER) {
-            m_pointer = std::make_unique<pointer>(wl_seat_get_pointer(m_seat));
+            m_pointer = std::make_unique<pointer>(wl_seat_get_pointer(m_seat), m_display);
         }
         if (!m_keyboard && caps & WL_SEAT_CAPABILITY_KEYBOARD) {
-            m_keyboard = std::make_unique<keyboard>(wl_seat_get_keyboard(m_seat));
+            m_keyboard = std::make_unique<keyboard>(wl_seat_get_keyboard(m_seat), m_display);
         }
     }
 
@@ -111,6 +107,7 @@ public:
 
 private:
     wl_seat *m_seat;
+    wl_platform_display *m_display;
     std::unique_ptr<pointer> m_pointer;
     std::unique_ptr<keyboard> m_keyboard;
 };
@@ -121,6 +118,7 @@ public:
     explicit wl_platform_window(wl_platform_display *dpy, int w, int h, window::handler hnd);
     wl_platform_window(const wl_platform_window &) = delete;
     wl_platform_window(wl_platform_window &&w);
+    ~wl_platform_window();
 
     void show();
     vk_surface create_vk_surface(const vk_instance &instance, window &win);
@@ -128,18 +126,61 @@ public:
     void prepare_swap();
 
     window::handler &get_handler() { return m_winhnd; }
+    // Called on the input thread with the input mutex held. The events are handed
+    // to the handler on the next frame, together with the time the first one arrived.
+    template<class F>
+    void queue_input(F push);
 
+    // Null once the window is destroyed
     static wl_platform_window *from_surface(wl_surface *surf) { return static_cast<wl_platform_window *>(wl_surface_get_user_data(surf)); }
+    // For callbacks that may run after the window was moved or destroyed
+    std::weak_ptr<wl_platform_window *> get_weak_ref() const { return m_self; }
 
 private:
     void send_update(wl_callback *, uint32_t time);
+    void frame(double time);
+    void toplevel_configure(xdg_toplevel *, int32_t width, int32_t height, wl_array *states);
+    void toplevel_close(xdg_toplevel *);
+    void surface_configure(xdg_surface *, uint32_t serial);
 
     window::handler m_winhnd;
     wl_platform_display *m_display;
+    // Points to the window wherever it was moved to
+    std::shared_ptr<wl_platform_window *> m_self;
     wl_surface *m_surface;
     wl_shell_surface *m_shell_surface;
+    xdg_surface *m_xdg_surface;
+    xdg_toplevel *m_xdg_toplevel;
+    bool m_configured;
+    int m_width, m_height;
+    // Applied when the xdg_surface configure event ends the sequence
+    int m_pending_width, m_pending_height;
     bool m_update;
     wl_callback *m_frame_callback;
+    // Guarded by the display input mutex
+    input_queue m_input;
+    uint64_t m_input_time;
+    // The arrival time of the input handled in the frame being drawn
+    uint64_t m_frame_input_time;
+};
+
+// Lives until the compositor tells what happened to the frame
+class presentation_feedback
+{
+public:
+    presentation_feedback(wp_presentation_feedback *feedback, std::weak_ptr<wl_platform_window *> window, uint64_t swap_time, uint64_t input_time);
+
+    void sync_output(wp_presentation_feedback *, wl_output *output);
+    void presented(wp_presentation_feedback *, uint32_t tv_sec_hi, uint32_t tv_sec_lo, uint32_t tv_nsec, uint32_t refresh,
+                   uint32_t seq_hi, uint32_t seq_lo, uint32_t flags);
+    void discarded(wp_presentation_feedback *);
+
+private:
+    void done();
+
+    wp_presentation_feedback *m_feedback;
+    std::weak_ptr<wl_platform_window *> m_window;
+    frame_presentation m_presentation;
 };
 
 class wl_platform_display
@@ -148,12 +189,34 @@ public:
     explicit wl_platform_display()
         : m_compositor(nullptr)
         , m_shell(nullptr)
+        , m_wm_base(nullptr)
+        , m_presentation(nullptr)
+        , m_clock_id(CLOCK_MONOTONIC)
+        , m_reading(false)
     {
     }
+    wl_platform_display(wl_platform_display &&) = default;
+
+    ~wl_platform_display()
+    {
+        if (m_input) {
+            uint64_t v = 1;
+            write(m_input->stop_fd, &v, sizeof(v));
+            m_input->thread.join();
+            close(m_input->stop_fd);
+            close(m_input->notify_fd);
+        }
+    }
 
     void init()
     {
         m_display = wl_display_connect(nullptr);
+        if (!m_display) {
+            throw platform_exception("Failed to connect to the Wayland display");
+        }
+
+        m_input = std::make_unique<input_thread>();
+        m_input->queue = wl_display_create_queue(m_display);
 
         auto *reg = wl_display_get_registry(m_display);
         static const wl_registry_listener listener = {
@@ -166,13 +229,25 @@ public:
         if (!m_compositor) {
             throw platform_exception("No wl_compositor global available.");
         }
-        if (!m_shell) {
-            throw platform_exception("No wl_shell global available.");
+        if (!m_wm_base && !m_shell) {
+            throw platform_exception("No xdg_wm_base nor wl_shell global available.");
         }
 
-        fmt::print("display {}\n",(void*)m_display);
+        if (!m_presentation) {
+            log_info("No wp_presentation global available, frames will not be timed.\n");
+        }
+
+        log_debug("display {}\n", (void*)m_display);
 
         m_event_loop.add_fd(wl_display_get_fd(m_display), event_loop::type::readable, [this](event_loop::type) { read_events(); });
+
+        m_input->stop_fd = eventfd(0, EFD_CLOEXEC);
+        m_input->notify_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+        if (m_input->stop_fd < 0 || m_input->notify_fd < 0) {
+            throw platform_exception(fmt::format("Failed to create eventfd: {}\n", strerror(errno)));
+        }
+        m_event_loop.add_fd(m_input->notify_fd, event_loop::type::readable, [this](event_loop::type) { input_ready(); });
+        m_input->thread = std::thread([this]() { read_input(); });
     }
 
     vk_instance create_vk_instance(const std::vector<std::string> &extensions)
@@ -184,27 +259,116 @@ public:
         return vk_instance(std::vector<std::string>(), exts);
     }
 
+    bool supports_present(const vk_physical_device &dev, uint32_t queue_family)
+    {
+        return vkGetPhysicalDeviceWaylandPresentationSupportKHR(dev.get_handle(), queue_family, m_display);
+    }
+
     wl_platform_window create_window(int w, int h, window::handler hnd)
     {
         return wl_platform_window(this, w, h, std::move(hnd));
     }
 
+    // Every thread reading from the display must go through prepare_read and
+    // then either read_events or cancel_read, or the other readers block.
+    // The idles are run outside of that, as presenting may read too.
+    void run()
+    {
+        m_run = true;
+        while (m_run) {
+            m_event_loop.run_idles();
+
+            while (wl_display_prepare_read(m_display) != 0) {
+                TRACE_ZONE("dispatch");
+                wl_display_dispatch_pending(m_display);
+            }
+            wl_display_flush(m_display);
+
+            m_reading = true;
+            m_event_loop.poll();
+            if (m_reading) {
+                wl_display_cancel_read(m_display);
+                m_reading = false;
+            }
+
+            TRACE_ZONE("dispatch");
+            wl_display_dispatch_pending(m_display);
+        }
+    }
+
     void read_events()
     {
-        if (wl_display_prepare_read(m_display) != -1) {
-            wl_display_read_events(m_display);
+        if (m_reading) {
+            m_reading = false;
+            if (wl_display_read_events(m_display) < 0) {
+                throw platform_exception(fmt::format("Failed to read the Wayland events: {}\n", strerror(errno)));
+            }
         }
     }
 
-    void run()
+    // Runs on the input thread, which owns the queue of the seat and its devices
+    void read_input()
     {
+        trace::set_thread_name("wayland input");
 
-        m_run = true;
-        while (m_run) {
+        pollfd fds[] = {
+            { wl_display_get_fd(m_display), POLLIN, 0 },
+            { m_input->stop_fd, POLLIN, 0 },
+        };
+        for (;;) {
+            while (wl_display_prepare_read_queue(m_display, m_input->queue) != 0) {
+                wl_display_dispatch_queue_pending(m_display, m_input->queue);
+            }
             wl_display_flush(m_display);
-            wl_display_dispatch_pending(m_display);
 
-            m_event_loop.loop_once();
+            if (poll(fds, 2, -1) < 0 && errno != EINTR) {
+                wl_display_cancel_read(m_display);
+                log_error("poll failed on the input thread: {}\n", strerror(errno));
+                return;
+            }
+            if (fds[1].revents) {
+                wl_display_cancel_read(m_display);
+                return;
+            }
+            if (fds[0].revents & POLLIN) {
+                if (wl_display_read_events(m_display) < 0) {
+                    log_error("Failed to read the Wayland events on the input thread: {}\n", strerror(errno));
+                    return;
+                }
+            } else {
+                wl_display_cancel_read(m_display);
+            }
+
+            TRACE_ZONE("input");
+            wl_display_dispatch_queue_pending(m_display, m_input->queue);
+
+            bool notify;
+            {
+                std::lock_guard<std::mutex> lock(m_input->mutex);
+                notify = !m_input->pending.empty();
+            }
+            if (notify) {
+                uint64_t v = 1;
+                write(m_input->notify_fd, &v, sizeof(v));
+            }
+        }
+    }
+
+    // Runs on the main thread, schedules a frame for the windows that got input
+    void input_ready()
+    {
+        uint64_t v;
+        read(m_input->notify_fd, &v, sizeof(v));
+
+        std::vector<wl_surface *> surfaces;
+        {
+            std::lock_guard<std::mutex> lock(m_input->mutex);
+            surfaces.swap(m_input->pending);
+        }
+        for (wl_surface *surface: surfaces) {
+            if (auto win = wl_platform_window::from_surface(surface)) {
+                win->update();
+            }
         }
     }
 
@@ -213,6 +377,33 @@ public:
         m_run = false;
     }
 
+    // Called on the input thread by the pointer and the keyboard
+    void add_focus(wl_platform_window **focus)
+    {
+        std::lock_guard<std::mutex> lock(m_input->mutex);
+        m_input->focus.push_back(focus);
+    }
+
+    void set_focus(wl_platform_window **focus, wl_surface *surface)
+    {
+        std::lock_guard<std::mutex> lock(m_input->mutex);
+        *focus = surface ? wl_platform_window::from_surface(surface) : nullptr;
+    }
+
+    template<class F>
+    void queue_input(wl_platform_window *const *focus, F push)
+    {
+        std::lock_guard<std::mutex> lock(m_input->mutex);
+        if (*focus) {
+            (*focus)->queue_input(push);
+        }
+    }
+
+    event_loop &get_event_loop()
+    {
+        return m_event_loop;
+    }
+
     void global(wl_registry *reg, uint32_t id, const char *interface, uint32_t version)
     {
         #define registry_bind(reg, type, ver) \
@@ -221,14 +412,46 @@ public:
         auto iface = stringview(interface);
         if (iface == "wl_compositor") {
             m_compositor = registry_bind(reg, wl_compositor, 1);
+        } else if (iface == "xdg_wm_base") {
+            m_wm_base = registry_bind(reg, xdg_wm_base, 1);
+            static const xdg_wm_base_listener listener = {
+                wrapInterface(&wl_platform_display::ping),
+            };
+            xdg_wm_base_add_listener(m_wm_base, &listener, this);
         } else if (iface == "wl_shell") {
             m_shell = registry_bind(reg, wl_shell, 1);
         } else if (iface == "wl_seat") {
             wl_seat *s = registry_bind(reg, wl_seat, seat::supported_version);
-            new seat(s);
+            // The pointer and keyboard created from the seat inherit its queue
+            wl_proxy_set_queue((wl_proxy *)s, m_input->queue);
+            new seat(s, this);
+        } else if (iface == "wp_presentation") {
+            m_presentation = registry_bind(reg, wp_presentation, 1);
+            static const wp_presentation_listener listener = {
+                wrapInterface(&wl_platform_display::clock_id),
+            };
+            wp_presentation_add_listener(m_presentation, &listener, this);
         }
     }
 
+    void ping(xdg_wm_base *wm_base, uint32_t serial)
+    {
+        xdg_wm_base_pong(wm_base, serial);
+    }
+
+    void clock_id(wp_presentation *, uint32_t clk_id)
+    {
+        m_clock_id = clk_id;
+    }
+
+    // The current time in the presentation clock
+    uint64_t now() const
+    {
+        timespec ts;
+        clock_gettime(m_clock_id, &ts);
+        return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+    }
+
     void global_remove(wl_registry *reg, uint32_t id)
     {
     }
@@ -244,6 +467,24 @@ private:
     wl_display *m_display;
     wl_compositor *m_compositor;
     wl_shell *m_shell;
+    xdg_wm_base *m_wm_base;
+    wp_presentation *m_presentation;
+    clockid_t m_clock_id;
+    bool m_reading;
+
+    struct input_thread {
+        wl_event_queue *queue;
+        std::thread thread;
+        // Wakes up the input thread to stop it
+        int stop_fd = -1;
+        // Wakes up the main thread when windows got input
+        int notify_fd = -1;
+        std::mutex mutex;
+        std::vector<wl_surface *> pending;
+        // The window each pointer and keyboard is focused on
+        std::vector<wl_platform_window **> focus;
+    };
+    std::unique_ptr<input_thread> m_input;
     std::vector<std::function<void ()>> m_runlist;
     bool m_run;
     event_loop m_event_loop;
@@ -255,35 +496,161 @@ REGISTER_PLATFORM(platform::wayland, wl_platform_display);
 
 
 
-wl_platform_window::wl_platform_window(wl_platform_display *dpy, int, int, window::handler hnd)
+wl_platform_window::wl_platform_window(wl_platform_display *dpy, int w, int h, window::handler hnd)
                 : m_winhnd(std::move(hnd))
                 , m_display(dpy)
+                , m_self(std::make_shared<wl_platform_window *>(this))
+                , m_shell_surface(nullptr)
+                , m_xdg_surface(nullptr)
+                , m_xdg_toplevel(nullptr)
+                , m_configured(false)
+                , m_width(w)
+                , m_height(h)
+                , m_pending_width(w)
+                , m_pending_height(h)
                 , m_update(false)
                 , m_frame_callback(nullptr)
+                , m_input_time(0)
+                , m_frame_input_time(0)
 {
     m_surface = wl_compositor_create_surface(dpy->m_compositor);
     wl_surface_add_listener(m_surface, nullptr, this);
-    fmt::print("new wind {} {}\n",(void*)this,(void*)m_surface);
+    log_debug("new wind {} {}\n", (void*)this, (void*)m_surface);
 }
 
 wl_platform_window::wl_platform_window(wl_platform_window &&w)
                   : m_winhnd(std::move(w.m_winhnd))
                   , m_display(w.m_display)
+                  , m_self(std::move(w.m_self))
                   , m_surface(w.m_surface)
                   , m_shell_surface(w.m_shell_surface)
+                  , m_xdg_surface(w.m_xdg_surface)
+                  , m_xdg_toplevel(w.m_xdg_toplevel)
+                  , m_configured(w.m_configured)
+                  , m_width(w.m_width)
+                  , m_height(w.m_height)
+                  , m_pending_width(w.m_pending_width)
+                  , m_pending_height(w.m_pending_height)
                   , m_update(w.m_update)
                   , m_frame_callback(w.m_frame_callback)
+                  , m_input(w.m_input)
+                  , m_input_time(w.m_input_time)
+                  , m_frame_input_time(w.m_frame_input_time)
 {
-    wl_surface_set_user_data(m_surface, this);
+    *m_self = this;
+    w.m_surface = nullptr;
+    w.m_shell_surface = nullptr;
+    w.m_xdg_surface = nullptr;
+    w.m_xdg_toplevel = nullptr;
+    w.m_frame_callback = nullptr;
+
+    {
+        std::lock_guard<std::mutex> lock(m_display->m_input->mutex);
+        wl_surface_set_user_data(m_surface, this);
+        for (wl_platform_window **focus: m_display->m_input->focus) {
+            if (*focus == &w) {
+                *focus = this;
+            }
+        }
+    }
     if (m_frame_callback) {
         wl_callback_set_user_data(m_frame_callback, this);
     }
+    if (m_xdg_surface) {
+        xdg_surface_set_user_data(m_xdg_surface, this);
+        xdg_toplevel_set_user_data(m_xdg_toplevel, this);
+    }
+}
+
+// The input thread may be dispatching events for the window, so it must not be
+// reachable from there anymore when the surface goes away
+wl_platform_window::~wl_platform_window()
+{
+    if (!m_surface) {
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(m_display->m_input->mutex);
+        wl_surface_set_user_data(m_surface, nullptr);
+        for (wl_platform_window **focus: m_display->m_input->focus) {
+            if (*focus == this) {
+                *focus = nullptr;
+            }
+        }
+        auto &pending = m_display->m_input->pending;
+        pending.erase(std::remove(pending.begin(), pending.end(), m_surface), pending.end());
+    }
+
+    if (m_frame_callback) {
+        wl_callback_destroy(m_frame_callback);
+    }
+    if (m_xdg_toplevel) {
+        xdg_toplevel_destroy(m_xdg_toplevel);
+        xdg_surface_destroy(m_xdg_surface);
+    }
+    if (m_shell_surface) {
+        wl_shell_surface_destroy(m_shell_surface);
+    }
+    wl_surface_destroy(m_surface);
+    wl_display_flush(m_display->m_display);
 }
 
 void wl_platform_window::show()
 {
-    m_shell_surface = wl_shell_get_shell_surface(m_display->m_shell, m_surface);
-    wl_shell_surface_set_toplevel(m_shell_surface);
+    if (!m_display->m_wm_base) {
+        m_shell_surface = wl_shell_get_shell_surface(m_display->m_shell, m_surface);
+        wl_shell_surface_set_toplevel(m_shell_surface);
+        return;
+    }
+
+    m_xdg_surface = xdg_wm_base_get_xdg_surface(m_display->m_wm_base, m_surface);
+    static const xdg_surface_listener surface_listener = {
+        wrapInterface(&wl_platform_window::surface_configure),
+    };
+    xdg_surface_add_listener(m_xdg_surface, &surface_listener, this);
+
+    m_xdg_toplevel = xdg_surface_get_toplevel(m_xdg_surface);
+    static const xdg_toplevel_listener toplevel_listener = {
+        wrapInterface(&wl_platform_window::toplevel_configure),
+        wrapInterface(&wl_platform_window::toplevel_close),
+    };
+    xdg_toplevel_add_listener(m_xdg_toplevel, &toplevel_listener, this);
+    xdg_toplevel_set_title(m_xdg_toplevel, "vktest");
+
+    // No buffer can be attached before the first configure is acked
+    wl_surface_commit(m_surface);
+    while (!m_configured) {
+        if (wl_display_roundtrip(m_display->m_display) < 0) {
+            throw platform_exception(fmt::format("Failed to configure the surface: {}\n", strerror(errno)));
+        }
+    }
+}
+
+// A size of 0 means the client can choose, so keep the current one
+void wl_platform_window::toplevel_configure(xdg_toplevel *, int32_t width, int32_t height, wl_array *)
+{
+    if (width > 0 && height > 0) {
+        m_pending_width = width;
+        m_pending_height = height;
+    }
+}
+
+void wl_platform_window::toplevel_close(xdg_toplevel *)
+{
+    m_winhnd.close();
+}
+
+void wl_platform_window::surface_configure(xdg_surface *surface, uint32_t serial)
+{
+    xdg_surface_ack_configure(surface, serial);
+    m_configured = true;
+
+    if (m_pending_width != m_width || m_pending_height != m_height) {
+        m_width = m_pending_width;
+        m_height = m_pending_height;
+        m_winhnd.resize(m_width, m_height);
+    }
 }
 
 vk_surface wl_platform_window::create_vk_surface(const vk_instance &instance, window &win)
@@ -308,9 +675,11 @@ void wl_platform_window::update()
    if (!m_update) {
         m_update = true;
         if (!m_frame_callback) {
-            m_display->schedule([this]() {
-                m_update = false;
-                m_winhnd.update(0);
+            auto self = get_weak_ref();
+            m_display->schedule([self]() {
+                if (auto w = self.lock()) {
+                    (*w)->frame(0);
+                }
             });
         }
    }
@@ -323,6 +692,21 @@ void wl_platform_window::prepare_swap()
         wrapInterface(&wl_platform_window::send_update),
     };
     wl_callback_add_listener(m_frame_callback, &listener, this);
+
+    if (m_display->m_presentation) {
+        new presentation_feedback(wp_presentation_feedback(m_display->m_presentation, m_surface), m_self, m_display->now(), m_frame_input_time);
+    }
+    m_frame_input_time = 0;
+}
+
+template<class F>
+void wl_platform_window::queue_input(F push)
+{
+    if (m_input.empty()) {
+        m_display->m_input->pending.push_back(m_surface);
+        m_input_time = m_display->now();
+    }
+    push(m_input);
 }
 
 void wl_platform_window::send_update(wl_callback *, uint32_t time)
@@ -330,36 +714,121 @@ void wl_platform_window::send_update(wl_callback *, uint32_t time)
     wl_callback_destroy(m_frame_callback);
     m_frame_callback = nullptr;
     if (m_update) {
-        m_update = false;
-        m_winhnd.update((double)time / 1000.);
+        frame((double)time / 1000.);
+    }
+}
+
+void wl_platform_window::frame(double time)
+{
+    m_update = false;
+
+    input_queue events;
+    {
+        std::lock_guard<std::mutex> lock(m_display->m_input->mutex);
+        events = m_input;
+        m_input.clear();
+        if (!events.empty()) {
+            m_frame_input_time = m_input_time;
+        }
+    }
+    if (!events.empty()) {
+        m_winhnd.input(events);
+    }
+    m_winhnd.update(time);
+}
+
+
+
+presentation_feedback::presentation_feedback(wp_presentation_feedback *feedback, std::weak_ptr<wl_platform_window *> window, uint64_t swap_time, uint64_t input_time)
+                     : m_feedback(feedback)
+                     , m_window(std::move(window))
+{
+    static const wp_presentation_feedback_listener listener = {
+        wrapInterface(&presentation_feedback::sync_output),
+        wrapInterface(&presentation_feedback::presented),
+        wrapInterface(&presentation_feedback::discarded),
+    };
+    wp_presentation_feedback_add_listener(feedback, &listener, this);
+
+    m_presentation = frame_presentation();
+    m_presentation.swap_time = swap_time;
+    m_presentation.input_time = input_time;
+}
+
+void presentation_feedback::sync_output(wp_presentation_feedback *, wl_output *output)
+{
+}
+
+void presentation_feedback::presented(wp_presentation_feedback *, uint32_t tv_sec_hi, uint32_t tv_sec_lo, uint32_t tv_nsec, uint32_t refresh,
+                                      uint32_t seq_hi, uint32_t seq_lo, uint32_t flags)
+{
+    uint64_t sec = ((uint64_t)tv_sec_hi << 32) | tv_sec_lo;
+    m_presentation.discarded = false;
+    m_presentation.presented = sec * 1000000000ull + tv_nsec;
+    m_presentation.refresh = refresh;
+    m_presentation.sequence = ((uint64_t)seq_hi << 32) | seq_lo;
+    m_presentation.flags = (frame_presentation::kind)flags;
+    done();
+}
+
+void presentation_feedback::discarded(wp_presentation_feedback *)
+{
+    m_presentation.discarded = true;
+    done();
+}
+
+void presentation_feedback::done()
+{
+    if (auto win = m_window.lock()) {
+        (*win)->get_handler().presented(m_presentation);
     }
+    wp_presentation_feedback_destroy(m_feedback);
+    delete this;
 }
 
 
 
+pointer::pointer(wl_pointer *p, wl_platform_display *dpy)
+       : m_pointer(p)
+       , m_display(dpy)
+       , m_window(nullptr)
+{
+    static const wl_pointer_listener listener = {
+        wrapInterface(&pointer::enter),
+        wrapInterface(&pointer::leave),
+        wrapInterface(&pointer::motion),
+        wrapInterface(&pointer::button),
+        wrapInterface(&pointer::axis),
+    };
+    wl_pointer_add_listener(p, &listener, this);
+    // Cleared by the window if it goes away while focused
+    dpy->add_focus(&m_window);
+}
+
+// The surface is null if it was destroyed in the meantime
 void pointer::enter(wl_pointer *, uint32_t serial, wl_surface *surface, wl_fixed_t fx, wl_fixed_t fy)
 {
-    m_window = wl_platform_window::from_surface(surface);
+    m_display->set_focus(&m_window, surface);
     double x = wl_fixed_to_double(fx);
     double y = wl_fixed_to_double(fy);
-    m_window->get_handler().mouse_motion(x, y);
+    m_display->queue_input(&m_window, [=](input_queue &q) { q.push_motion(x, y); });
 }
 
 void pointer::leave(wl_pointer *, uint32_t serial, wl_surface *surface)
 {
-    m_window = nullptr;
+    m_display->set_focus(&m_window, nullptr);
 }
 
 void pointer::motion(wl_pointer *, uint32_t time, wl_fixed_t fx, wl_fixed_t fy)
 {
     double x = wl_fixed_to_double(fx);
     double y = wl_fixed_to_double(fy);
-    m_window->get_handler().mouse_motion(x, y);
+    m_display->queue_input(&m_window, [=](input_queue &q) { q.push_motion(x, y); });
 }
 
 void pointer::button(wl_pointer *, uint32_t serial, uint32_t time, uint32_t button, uint32_t state)
 {
-    m_window->get_handler().mouse_button(state == WL_POINTER_BUTTON_STATE_PRESSED);
+    m_display->queue_input(&m_window, [=](input_queue &q) { q.push_button(state == WL_POINTER_BUTTON_STATE_PRESSED); });
 }
 
 void pointer::axis(wl_pointer *, uint32_t time, uint32_t axis, wl_fixed_t value)
@@ -368,23 +837,39 @@ void pointer::axis(wl_pointer *, uint32_t time, uint32_t axis, wl_fixed_t value)
 
 
 
+keyboard::keyboard(wl_keyboard *k, wl_platform_display *dpy)
+        : m_keyboard(k)
+        , m_display(dpy)
+        , m_window(nullptr)
+{
+    static const wl_keyboard_listener listener = {
+        wrapInterface(&keyboard::keymap),
+        wrapInterface(&keyboard::enter),
+        wrapInterface(&keyboard::leave),
+        wrapInterface(&keyboard::key),
+        wrapInterface(&keyboard::modifiers),
+    };
+    wl_keyboard_add_listener(k, &listener, this);
+    dpy->add_focus(&m_window);
+}
+
 void keyboard::keymap(wl_keyboard *, uint32_t format, int fd, uint32_t size)
 {
 }
 
 void keyboard::enter(wl_keyboard *, uint32_t serial, wl_surface *surface, wl_array *keys)
 {
-    m_window = wl_platform_window::from_surface(surface);
+    m_display->set_focus(&m_window, surface);
 }
 
 void keyboard::leave(wl_keyboard *, uint32_t serial, wl_surface *surface)
 {
-    m_window = nullptr;
+    m_display->set_focus(&m_window, nullptr);
 }
 
 void keyboard::key(wl_keyboard *, uint32_t serial, uint32_t time, uint32_t key, uint32_t state)
 {
-    m_window->get_handler().key(key, state == WL_KEYBOARD_KEY_STATE_PRESSED);
+    m_display->queue_input(&m_window, [=](input_queue &q) { q.push_key(key, state == WL_KEYBOARD_KEY_STATE_PRESSED); });
 }
 
 void keyboard::modifiers(wl_keyboard *, uint32_t serial, uint32_t mods_depressed, uint32_t mods_latched, uint32_t mods_locked, uint32_t group)
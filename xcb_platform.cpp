@@ -1,5 +1,7 @@
 
+#include <algorithm>
 #include <chrono>
+#include <vector>
 
 #define VK_USE_PLATFORM_XCB_KHR
 #include <vulkan/vk_platform.h>
@@ -8,6 +10,9 @@
 #include "vk.h"
 #include "display.h"
 #include "event_loop.h"
+#include "log.h"
+#include "trace.h"
+#include "window_map.h"
 
 class xcb_platform_display;
 
@@ -17,6 +22,7 @@ public:
     explicit xcb_platform_window(xcb_platform_display *dpy, int w, int h, window::handler hnd);
     xcb_platform_window(const xcb_platform_window &) = delete;
     xcb_platform_window(xcb_platform_window &&);
+    ~xcb_platform_window();
 
     void show();
     vk_surface create_vk_surface(const vk_instance &instance, window &win);
@@ -30,13 +36,19 @@ public:
     void mouse_leave_event(xcb_leave_notify_event_t *e);
     void key_press_event(xcb_key_press_event_t *e);
     void key_release_event(xcb_key_release_event_t *e);
+    void configure_event(xcb_configure_notify_event_t *e);
+    void client_message_event(xcb_client_message_event_t *e);
 
 private:
+    void frame();
+
     xcb_platform_display *m_display;
     xcb_window_t m_xcb_window;
     xcb_visualid_t m_root_visual;
+    xcb_atom_t m_wm_delete_window;
     window::handler m_winhnd;
     bool m_update;
+    input_queue m_input;
 };
 
 class xcb_platform_display
@@ -66,6 +78,12 @@ public:
         return vk_instance(std::vector<std::string>(), exts);
     }
 
+    bool supports_present(const vk_physical_device &dev, uint32_t queue_family)
+    {
+        xcb_screen_iterator_t iter = xcb_setup_roots_iterator(xcb_get_setup(m_connection));
+        return vkGetPhysicalDeviceXcbPresentationSupportKHR(dev.get_handle(), queue_family, m_connection, iter.data->root_visual);
+    }
+
     xcb_platform_window create_window(int w, int h, window::handler hnd)
     {
         return xcb_platform_window(this, w, h, std::move(hnd));
@@ -73,6 +91,7 @@ public:
 
     void dispatch()
     {
+        TRACE_ZONE("dispatch");
         int connection_error = xcb_connection_has_error(m_connection);
         if (connection_error) {
             throw platform_exception(fmt::format("The X11 connection broke (error {}). Did the X11 server die?", connection_error));
@@ -80,41 +99,68 @@ public:
 
         xcb_generic_event_t *event;
         while ((event = xcb_poll_for_event(m_connection))) {
-            fmt::print("event {}\n",(int)event->response_type);
             switch (event->response_type & ~0x80) {
             case XCB_BUTTON_PRESS: {
                 xcb_button_press_event_t *press = (xcb_button_press_event_t *)event;
-                window(press->event)->mouse_press_event(press);
+                if (auto w = window(press->event)) {
+                    w->mouse_press_event(press);
+                }
                 break;
             }
             case XCB_BUTTON_RELEASE: {
                 xcb_button_release_event_t *release = (xcb_button_release_event_t *)event;
-                window(release->event)->mouse_release_event(release);
+                if (auto w = window(release->event)) {
+                    w->mouse_release_event(release);
+                }
                 break;
             }
             case XCB_MOTION_NOTIFY: {
                 auto motion = (xcb_motion_notify_event_t *)event;
-                window(motion->event)->mouse_motion_event(motion);
+                if (auto w = window(motion->event)) {
+                    w->mouse_motion_event(motion);
+                }
                 break;
             }
             case XCB_ENTER_NOTIFY: {
                 auto enter = (xcb_enter_notify_event_t *)event;
-                window(enter->event)->mouse_enter_event(enter);
+                if (auto w = window(enter->event)) {
+                    w->mouse_enter_event(enter);
+                }
                 break;
             }
             case XCB_LEAVE_NOTIFY: {
                 auto leave = (xcb_leave_notify_event_t *)event;
-                window(leave->event)->mouse_leave_event(leave);
+                if (auto w = window(leave->event)) {
+                    w->mouse_leave_event(leave);
+                }
                 break;
             }
             case XCB_KEY_PRESS: {
                 xcb_key_press_event_t *press = (xcb_key_press_event_t *)event;
-                window(press->event)->key_press_event(press);
+                if (auto w = window(press->event)) {
+                    w->key_press_event(press);
+                }
                 break;
             }
             case XCB_KEY_RELEASE: {
                 xcb_key_release_event_t *release = (xcb_key_release_event_t *)event;
-                window(release->event)->key_release_event(release);
+                if (auto w = window(release->event)) {
+                    w->key_release_event(release);
+                }
+                break;
+            }
+            case XCB_CONFIGURE_NOTIFY: {
+                auto configure = (xcb_configure_notify_event_t *)event;
+                if (auto w = window(configure->window)) {
+                    w->configure_event(configure);
+                }
+                break;
+            }
+            case XCB_CLIENT_MESSAGE: {
+                auto message = (xcb_client_message_event_t *)event;
+                if (auto w = window(message->window)) {
+                    w->client_message_event(message);
+                }
                 break;
             }
             default:
@@ -143,20 +189,22 @@ public:
         m_run = false;
     }
 
+    event_loop &get_event_loop()
+    {
+        return m_event_loop;
+    }
+
+    // Returns null for windows that are not ours or were already destroyed
     xcb_platform_window *window(xcb_window_t id)
     {
-        auto it = m_windows.find(id);
-        if (it == m_windows.end()) {
-            throw platform_exception(fmt::format("No window found with the given Xid: {}\n", id));
-        }
-        return it->second;
+        return m_windows.find(id);
     }
 
 private:
     xcb_connection_t *m_connection;
     bool m_run;
     event_loop m_event_loop;
-    std::unordered_map<xcb_window_t, xcb_platform_window *> m_windows;
+    window_map<xcb_window_t, xcb_platform_window> m_windows;
 
     friend class xcb_platform_window;
 };
@@ -219,14 +267,14 @@ xcb_platform_window::xcb_platform_window(xcb_platform_display *dpy, int width, i
     m_root_visual = iter.data->root_visual;
 
     auto atom_wm_protocols = get_atom(m_display->m_connection, "WM_PROTOCOLS");
-    auto atom_wm_delete_window = get_atom(m_display->m_connection, "WM_DELETE_WINDOW");
+    m_wm_delete_window = get_atom(m_display->m_connection, "WM_DELETE_WINDOW");
     xcb_change_property(m_display->m_connection,
                         XCB_PROP_MODE_REPLACE,
                         m_xcb_window,
                         atom_wm_protocols,
                         XCB_ATOM_ATOM,
                         32,
-                        1, &atom_wm_delete_window);
+                        1, &m_wm_delete_window);
 //
 //    xcb_change_property(vc->xcb.conn,
 //                        XCB_PROP_MODE_REPLACE,
@@ -237,17 +285,29 @@ xcb_platform_window::xcb_platform_window(xcb_platform_display *dpy, int width, i
 //                        strlen(title), title);
 //
 
-    m_display->m_windows[m_xcb_window] = this;
+    m_display->m_windows.set(m_xcb_window, this);
 }
 
 xcb_platform_window::xcb_platform_window(xcb_platform_window &&w)
                     : m_display(w.m_display)
                     , m_xcb_window(w.m_xcb_window)
                     , m_root_visual(w.m_root_visual)
+                    , m_wm_delete_window(w.m_wm_delete_window)
                     , m_winhnd(std::move(w.m_winhnd))
                     , m_update(w.m_update)
+                    , m_input(w.m_input)
 {
-    m_display->m_windows[m_xcb_window] = this;
+    w.m_display = nullptr;
+    m_display->m_windows.set(m_xcb_window, this);
+}
+
+xcb_platform_window::~xcb_platform_window()
+{
+    if (m_display) {
+        m_display->m_windows.remove(m_xcb_window, this);
+        xcb_destroy_window(m_display->m_connection, m_xcb_window);
+        xcb_flush(m_display->m_connection);
+    }
 }
 
 void xcb_platform_window::show()
@@ -261,16 +321,31 @@ void xcb_platform_window::update()
 {
     if (!m_update) {
         m_update = true;
-        m_display->m_event_loop.add_idle([this]() {
-            m_update = false;
-
-            auto new_time = std::chrono::high_resolution_clock::now();
-            auto diff = std::chrono::duration_cast<std::chrono::microseconds>(new_time.time_since_epoch());
-            m_winhnd.update(diff.count() / 1.e6);
+        // The window may be moved or destroyed before the callback runs, so look it up again
+        auto dpy = m_display;
+        auto id = m_xcb_window;
+        m_display->m_event_loop.add_idle([dpy, id]() {
+            if (auto w = dpy->window(id)) {
+                w->frame();
+            }
         });
    }
 }
 
+void xcb_platform_window::frame()
+{
+    m_update = false;
+
+    if (!m_input.empty()) {
+        m_winhnd.input(m_input);
+        m_input.clear();
+    }
+
+    auto new_time = std::chrono::high_resolution_clock::now();
+    auto diff = std::chrono::duration_cast<std::chrono::microseconds>(new_time.time_since_epoch());
+    m_winhnd.update(diff.count() / 1.e6);
+}
+
 vk_surface xcb_platform_window::create_vk_surface(const vk_instance &instance, window &window)
 {
     VkSurfaceKHR surface = 0;
@@ -286,24 +361,29 @@ vk_surface xcb_platform_window::create_vk_surface(const vk_instance &instance, w
     return vk_surface(instance, window, surface);
 }
 
+// Input is queued and handed to the handler once per frame, right before update()
 void xcb_platform_window::mouse_press_event(xcb_button_press_event_t *e)
 {
-   m_winhnd.mouse_button(true);
+    m_input.push_button(true);
+    update();
 }
 
 void xcb_platform_window::mouse_release_event(xcb_button_release_event_t *e)
 {
-   m_winhnd.mouse_button(false);
+    m_input.push_button(false);
+    update();
 }
 
 void xcb_platform_window::mouse_motion_event(xcb_motion_notify_event_t *e)
 {
-    m_winhnd.mouse_motion(e->event_x, e->event_y);
+    m_input.push_motion(e->event_x, e->event_y);
+    update();
 }
 
 void xcb_platform_window::mouse_enter_event(xcb_enter_notify_event_t *e)
 {
-    m_winhnd.mouse_motion(e->event_x, e->event_y);
+    m_input.push_motion(e->event_x, e->event_y);
+    update();
 }
 
 void xcb_platform_window::mouse_leave_event(xcb_leave_notify_event_t *e)
@@ -312,10 +392,26 @@ void xcb_platform_window::mouse_leave_event(xcb_leave_notify_event_t *e)
 
 void xcb_platform_window::key_press_event(xcb_key_press_event_t *e)
 {
-    m_winhnd.key(e->detail - 8, true);
+    m_input.push_key(e->detail - 8, true);
+    update();
 }
 
 void xcb_platform_window::key_release_event(xcb_key_press_event_t *e)
 {
-    m_winhnd.key(e->detail - 8, false);
+    m_input.push_key(e->detail - 8, false);
+    update();
+}
+
+// Also sent on moves, the handler ignores those as the size doesn't change
+void xcb_platform_window::configure_event(xcb_configure_notify_event_t *e)
+{
+    m_winhnd.resize(e->width, e->height);
+}
+
+// The window manager asks through WM_DELETE_WINDOW, the handler decides what to destroy
+void xcb_platform_window::client_message_event(xcb_client_message_event_t *e)
+{
+    if (e->data.data32[0] == m_wm_delete_window) {
+        m_winhnd.close();
+    }
 }